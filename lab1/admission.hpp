@@ -0,0 +1,179 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+// ---- Admission control ----
+// Decides for every accepted TCP connection whether it gets a session now,
+// waits in a bounded pending queue for a free slot, or is shed with a BUSY
+// reply. A connection that waits longer than max_wait_ms is shed as well. Keeps the number of live sessions (and with it threads and UDP
+// ports) bounded so a connection storm slows the server down instead of
+// exhausting it.
+
+struct AdmissionConfig
+{
+    size_t max_sessions = 1000; // concurrent sessions, 0 = unlimited
+    size_t max_pending = 100;   // connections waiting for a free slot
+    int max_wait_ms = 5000;     // then a pending connection gets BUSY, 0 = no limit
+    double ip_rate = 0;         // new connections/s per source IP, 0 = off
+    double ip_burst = 10;       // token bucket depth per source IP
+    int backlog = 10;           // listen() backlog
+};
+
+struct PendingConn
+{
+    int fd;
+    in_addr_t peer;
+    std::string ip;
+    std::chrono::steady_clock::time_point accepted; // queued conns keep theirs
+};
+
+class AdmissionControl
+{
+public:
+    enum class Verdict
+    {
+        ADMIT,
+        QUEUED,
+        REJECT
+    };
+
+    // set once at startup, before any connection is accepted
+    void configure(const AdmissionConfig &c) { cfg = c; }
+
+    // called from the accept loop for every new connection
+    Verdict on_connect(const PendingConn &conn)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (cfg.ip_rate > 0 && !take_token(conn.peer))
+        {
+            rejected_rate++;
+            return Verdict::REJECT;
+        }
+        if (cfg.max_sessions == 0 || active < cfg.max_sessions)
+        {
+            active++;
+            admitted++;
+            return Verdict::ADMIT;
+        }
+        if (pending.size() < cfg.max_pending)
+        {
+            pending.push_back(conn);
+            queued++;
+            return Verdict::QUEUED;
+        }
+        rejected_full++;
+        return Verdict::REJECT;
+    }
+
+    // A session finished and gave its slot back. If a connection is waiting
+    // it inherits the slot and is returned so the caller can start it.
+    std::optional<PendingConn> release()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!pending.empty())
+        {
+            PendingConn conn = pending.front();
+            pending.pop_front();
+            admitted++;
+            return conn;
+        }
+        if (active > 0)
+            active--;
+        return std::nullopt;
+    }
+
+    // Pending connections that waited longer than max_wait_ms, removed from
+    // the queue; the caller replies BUSY to each.
+    std::vector<PendingConn> expire_pending(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<PendingConn> expired;
+        if (cfg.max_wait_ms <= 0)
+            return expired;
+        auto limit = std::chrono::milliseconds(cfg.max_wait_ms);
+        // FIFO: the oldest are at the front
+        while (!pending.empty() && now - pending.front().accepted > limit)
+        {
+            expired.push_back(pending.front());
+            pending.pop_front();
+            rejected_wait++;
+        }
+        return expired;
+    }
+
+    const AdmissionConfig &config() const { return cfg; }
+
+    // one line of counters, empty if nothing changed since the last call
+    std::string report()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t events = admitted + queued + rejected_rate + rejected_full + rejected_wait;
+        if (events == last_events)
+            return {};
+        last_events = events;
+        return "[ADMISSION] active=" + std::to_string(active) +
+               " pending=" + std::to_string(pending.size()) +
+               " admitted=" + std::to_string(admitted) +
+               " queued=" + std::to_string(queued) +
+               " rejected=" + std::to_string(rejected_rate + rejected_full + rejected_wait) +
+               " (rate=" + std::to_string(rejected_rate) +
+               ", full=" + std::to_string(rejected_full) +
+               ", wait=" + std::to_string(rejected_wait) + ")";
+    }
+
+private:
+    struct TokenBucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    // caller holds mtx
+    bool take_token(in_addr_t peer)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (buckets.size() > 4096)
+            evict_full(now);
+        auto [it, fresh] = buckets.try_emplace(peer, TokenBucket{cfg.ip_burst, now});
+        TokenBucket &b = it->second;
+        if (!fresh)
+        {
+            double dt = std::chrono::duration<double>(now - b.last).count();
+            b.tokens = std::min(cfg.ip_burst, b.tokens + dt * cfg.ip_rate);
+            b.last = now;
+        }
+        if (b.tokens < 1)
+            return false;
+        b.tokens -= 1;
+        return true;
+    }
+
+    // forget sources whose bucket has refilled, they behave like new ones
+    void evict_full(std::chrono::steady_clock::time_point now)
+    {
+        for (auto it = buckets.begin(); it != buckets.end();)
+        {
+            double dt = std::chrono::duration<double>(now - it->second.last).count();
+            if (it->second.tokens + dt * cfg.ip_rate >= cfg.ip_burst)
+                it = buckets.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    AdmissionConfig cfg;
+    std::mutex mtx;
+    size_t active = 0;
+    std::deque<PendingConn> pending;
+    std::unordered_map<in_addr_t, TokenBucket> buckets;
+    uint64_t admitted = 0, queued = 0, rejected_rate = 0, rejected_full = 0, rejected_wait = 0;
+    uint64_t last_events = 0;
+};
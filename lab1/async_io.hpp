@@ -0,0 +1,582 @@
+#pragma once
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "common.hpp"
+
+// ---- Coroutine async I/O ----
+// A single-threaded epoll executor plus awaitable versions of the protocol
+// helpers in common.hpp. A conversation is written as a straight-line
+// coroutine (co_await async_recv_frame(...)) and thousands of them share
+// one thread. Every wait takes an optional timeout and cancel token; they
+// surface as IO_TIMEOUT / IO_CANCELLED, next to the -1/-2/-3 codes the
+// blocking helpers already use.
+// Keep every co_await a statement of its own (`rv = co_await ...;`): GCC 12
+// mis-handles the awaiter's lifetime when it sits inside a condition.
+
+constexpr int IO_TIMEOUT = -4;
+constexpr int IO_CANCELLED = -5;
+
+using io_clock = std::chrono::steady_clock;
+
+class Executor;
+class CancelToken;
+
+struct IoOptions
+{
+    std::chrono::milliseconds timeout{-1}; // < 0: wait forever
+    CancelToken *cancel = nullptr;
+};
+
+// ---- Task<T> ----
+// Lazily started coroutine; co_await-ing it runs it and resumes the awaiter
+// when it finishes (symmetric transfer, no stack growth).
+template <typename T = void>
+class Task;
+
+namespace detail
+{
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            if (auto c = h.promise().continuation)
+                return c;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct PromiseBase
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+}
+
+template <typename T>
+class Task
+{
+public:
+    struct promise_type : detail::PromiseBase
+    {
+        std::optional<T> value;
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    Task(Task &&o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+    T await_resume()
+    {
+        if (h.promise().error)
+            std::rethrow_exception(h.promise().error);
+        return std::move(*h.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+template <>
+class Task<void>
+{
+public:
+    struct promise_type : detail::PromiseBase
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task &&o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+    void await_resume()
+    {
+        if (h.promise().error)
+            std::rethrow_exception(h.promise().error);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+// ---- Executor ----
+
+// one suspended coroutine waiting for an fd, a deadline or both
+struct IoWaiter
+{
+    std::coroutine_handle<> h;
+    int fd = -1;
+    int result = 0;
+    bool timed = false;
+    std::multimap<io_clock::time_point, IoWaiter *>::iterator timer;
+    CancelToken *cancel = nullptr;
+};
+
+// Cancels every wait that was started with it. Executor thread only.
+class CancelToken
+{
+public:
+    explicit CancelToken(Executor &ex) : ex(ex) {}
+    void cancel();
+    bool cancelled() const { return done; }
+
+private:
+    friend class Executor;
+    Executor &ex;
+    bool done = false;
+    std::unordered_set<IoWaiter *> waiters;
+};
+
+class Executor
+{
+public:
+    Executor()
+    {
+        epfd = epoll_create1(0);
+        wakefd = eventfd(0, EFD_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr; // nullptr marks the wakeup eventfd
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+    ~Executor()
+    {
+        close(wakefd);
+        close(epfd);
+    }
+
+    // start a task; it runs until its first suspension right away
+    void spawn(Task<void> t)
+    {
+        live++;
+        [](Executor *ex, Task<void> t) -> Detached
+        {
+            try
+            {
+                co_await t;
+            }
+            catch (const std::exception &e)
+            {
+                ts_print("[ASYNC] task failed: ", e.what(), "\n");
+            }
+            ex->live--;
+        }(this, std::move(t));
+    }
+
+    // run fn on the executor thread; safe to call from any thread
+    void post(std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(post_mtx);
+            posted.push_back(std::move(fn));
+        }
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0)
+            perror("eventfd write");
+    }
+
+    // runs until every spawned task finished (forever = keep going anyway)
+    void run(bool forever = false)
+    {
+        epoll_event events[256];
+        while (forever || live > 0)
+        {
+            int wait_ms = -1;
+            if (!timers.empty())
+            {
+                auto d = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    timers.begin()->first - io_clock::now());
+                wait_ms = std::max<long>(0, d.count() + 1);
+            }
+            int n = epoll_wait(epfd, events, 256, wait_ms);
+            for (int i = 0; i < n; i++)
+            {
+                auto *w = (IoWaiter *)events[i].data.ptr;
+                if (w == nullptr)
+                    run_posted();
+                else if (armed.count(w)) // may have been cancelled meanwhile
+                    complete(w, 0);
+            }
+            auto now = io_clock::now();
+            while (!timers.empty() && timers.begin()->first <= now)
+            {
+                IoWaiter *w = timers.begin()->second;
+                complete(w, w->fd >= 0 ? IO_TIMEOUT : 0); // plain sleeps end with 0
+            }
+        }
+    }
+
+    // awaitable: fd ready for `events` (EPOLLIN / EPOLLOUT), timeout or
+    // cancellation. Resumes with 0, IO_TIMEOUT or IO_CANCELLED.
+    auto wait_io(int fd, uint32_t events, IoOptions opt = {})
+    {
+        struct Awaiter
+        {
+            Executor &ex;
+            int fd;
+            uint32_t events;
+            IoOptions opt;
+            IoWaiter w;
+            bool await_ready() { return opt.cancel && opt.cancel->done; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                w.h = h;
+                w.fd = fd;
+                ex.arm(&w, events, opt);
+            }
+            int await_resume() { return w.h ? w.result : IO_CANCELLED; }
+        };
+        return Awaiter{*this, fd, events, opt, {}};
+    }
+
+    // awaitable: resumes after d (or early with IO_CANCELLED)
+    auto sleep_for(std::chrono::milliseconds d, CancelToken *cancel = nullptr)
+    {
+        return wait_io(-1, 0, IoOptions{d, cancel});
+    }
+
+private:
+    friend class CancelToken;
+
+    // coroutine that starts eagerly and frees itself when done
+    struct Detached
+    {
+        struct promise_type
+        {
+            Detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    void arm(IoWaiter *w, uint32_t events, const IoOptions &opt)
+    {
+        armed.insert(w);
+        if (w->fd >= 0)
+        {
+            epoll_event ev{};
+            ev.events = events | EPOLLONESHOT;
+            ev.data.ptr = w;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0 &&
+                epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+            {
+                // not pollable (closed fd ...): report it as ready, the
+                // following syscall returns the real error
+                posted_ready.push_back(w);
+                uint64_t one = 1;
+                if (write(wakefd, &one, sizeof(one)) < 0)
+                    perror("eventfd write");
+                return;
+            }
+        }
+        if (opt.timeout.count() >= 0)
+        {
+            w->timed = true;
+            w->timer = timers.emplace(io_clock::now() + opt.timeout, w);
+        }
+        if (opt.cancel)
+        {
+            w->cancel = opt.cancel;
+            opt.cancel->waiters.insert(w);
+        }
+    }
+
+    // detach the waiter from everything it is registered with and resume it.
+    // A fired EPOLLONESHOT registration is already disarmed and is re-armed
+    // with EPOLL_CTL_MOD by the next wait; only timeouts and cancellations
+    // have to remove a still armed one.
+    void complete(IoWaiter *w, int result)
+    {
+        if (w->fd >= 0 && result != 0)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+        if (w->timed)
+            timers.erase(w->timer);
+        if (w->cancel)
+            w->cancel->waiters.erase(w);
+        armed.erase(w);
+        w->timed = false;
+        w->cancel = nullptr;
+        w->result = result;
+        w->h.resume();
+    }
+
+    void run_posted()
+    {
+        uint64_t cnt;
+        if (read(wakefd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+            perror("eventfd read");
+        std::vector<std::function<void()>> fns;
+        {
+            std::lock_guard<std::mutex> lock(post_mtx);
+            fns.swap(posted);
+        }
+        for (auto &fn : fns)
+            fn();
+        std::vector<IoWaiter *> ready;
+        ready.swap(posted_ready);
+        for (auto *w : ready)
+        {
+            w->fd = -1; // was never registered with epoll
+            complete(w, 0);
+        }
+    }
+
+    int epfd, wakefd;
+    size_t live = 0;
+    std::multimap<io_clock::time_point, IoWaiter *> timers;
+    std::unordered_set<IoWaiter *> armed;
+    std::mutex post_mtx;
+    std::vector<std::function<void()>> posted;
+    std::vector<IoWaiter *> posted_ready;
+};
+
+inline void CancelToken::cancel()
+{
+    done = true;
+    auto ws = std::vector<IoWaiter *>(waiters.begin(), waiters.end());
+    for (auto *w : ws)
+        ex.complete(w, IO_CANCELLED);
+}
+
+// ---- Awaitable protocol helpers ----
+
+inline void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// remaining part of a timeout that started at `start`
+inline IoOptions io_left(const IoOptions &opt, io_clock::time_point start)
+{
+    if (opt.timeout.count() < 0)
+        return opt;
+    auto used = std::chrono::duration_cast<std::chrono::milliseconds>(io_clock::now() - start);
+    return IoOptions{std::max(std::chrono::milliseconds(0), opt.timeout - used), opt.cancel};
+}
+
+inline Task<int> async_connect(Executor &ex, int fd, const sockaddr *addr, socklen_t len, IoOptions opt = {})
+{
+    set_nonblocking(fd);
+    if (connect(fd, addr, len) == 0)
+        co_return 0;
+    if (errno != EINPROGRESS)
+        co_return -1;
+    int rv = co_await ex.wait_io(fd, EPOLLOUT, opt);
+    if (rv < 0)
+        co_return rv;
+    int err = 0;
+    socklen_t elen = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+    co_return err == 0 ? 0 : -1;
+}
+
+inline Task<int> async_send_all(Executor &ex, int fd, const char *buf, size_t len, IoOptions opt = {})
+{
+    auto start = io_clock::now();
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t n = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            total += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        int rv = co_await ex.wait_io(fd, EPOLLOUT, io_left(opt, start));
+        if (rv < 0)
+            co_return rv;
+    }
+    co_return 0;
+}
+
+inline Task<int> async_recv_exact(Executor &ex, int fd, char *buf, size_t len, IoOptions opt = {})
+{
+    auto start = io_clock::now();
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t n = recv(fd, buf + total, len - total, 0);
+        if (n > 0)
+        {
+            total += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            co_return -1; // connection closed or error
+        int rv = co_await ex.wait_io(fd, EPOLLIN, io_left(opt, start));
+        if (rv < 0)
+            co_return rv;
+    }
+    co_return 0;
+}
+
+// send a message over a (non-blocking) TCP socket
+template <msg_type T>
+inline Task<int> async_send_message(Executor &ex, int sockfd, const typed_message<T> &msg, IoOptions opt = {})
+{
+    char buf[typed_message<T>::max_frame];
+    int n = msg.encode(buf, sizeof(buf));
+    if (n < 0)
+        co_return n;
+    int rv = co_await async_send_all(ex, sockfd, buf, n, opt);
+    co_return rv;
+}
+
+// receive one frame over a (non-blocking) TCP socket into buf of cap
+// bytes: the fixed type/length header first, then exactly `length` bytes
+// of body. The frame size, or -2 if the body would not fit
+inline Task<int> async_recv_frame(Executor &ex, int sockfd, char *buf, int cap, IoOptions opt = {})
+{
+    auto start = io_clock::now();
+    int rv = co_await async_recv_exact(ex, sockfd, buf, FRAME_HEADER, opt);
+    if (rv < 0)
+        co_return rv;
+    int32_t len = frame_length(buf);
+    if (len < 0 || len > cap - FRAME_HEADER)
+        co_return -2;
+    rv = co_await async_recv_exact(ex, sockfd, buf + FRAME_HEADER, len, io_left(opt, start));
+    if (rv < 0)
+        co_return rv;
+    co_return FRAME_HEADER + len;
+}
+
+// one raw datagram into buf; its length, or -1 / IO_TIMEOUT / IO_CANCELLED
+inline Task<int> async_recvfrom(Executor &ex, int sockfd, char *buf, size_t len,
+                                sockaddr_in &from, socklen_t &fromlen, IoOptions opt = {})
+{
+    for (;;)
+    {
+        fromlen = sizeof(from);
+        ssize_t n = recvfrom(sockfd, buf, len, 0, (sockaddr *)&from, &fromlen);
+        if (n >= 0)
+            co_return (int)n;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        int rv = co_await ex.wait_io(sockfd, EPOLLIN, opt);
+        if (rv < 0)
+            co_return rv;
+    }
+}
+
+// receive one datagram message, recording the sender
+inline Task<int> async_recvfrom_message(Executor &ex, int sockfd, message &msg,
+                                        sockaddr_in &from, socklen_t &fromlen, IoOptions opt = {})
+{
+    char buf[sizeof(int32_t) * 2 + MSG_LEN];
+    for (;;)
+    {
+        fromlen = sizeof(from);
+        ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromlen);
+        if (n >= 0)
+            co_return msg.parseFromBuf(buf, n);
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        int rv = co_await ex.wait_io(sockfd, EPOLLIN, opt);
+        if (rv < 0)
+            co_return rv;
+    }
+}
+
+// client handshake: send HELLO, expect WELCOME; returns the UDP port
+inline Task<int> async_client_handshake(Executor &ex, int sockfd, IoOptions opt = {},
+                                        bool keep_alive = false)
+{
+    auto start = io_clock::now();
+    typed_message<msg_type::TYPE_1> hello;
+    hello.set(keep_alive ? KEEPALIVE_HELLO : "");
+    int rv = co_await async_send_message(ex, sockfd, hello, opt);
+    if (rv < 0)
+        co_return -1;
+    char buf[typed_message<msg_type::TYPE_2>::max_frame]; // BUSY is shorter
+    rv = co_await async_recv_frame(ex, sockfd, buf, sizeof(buf), io_left(opt, start));
+    if (rv == IO_TIMEOUT || rv == IO_CANCELLED)
+        co_return rv;
+    if (rv < 0)
+        co_return -1;
+    if (frame_type(buf) == msg_type::TYPE_5)
+        co_return -3; // server busy
+    typed_message<msg_type::TYPE_2> welcome;
+    rv = welcome.decode(buf, rv);
+    if (rv == -3)
+        co_return -2;
+    if (rv < 0)
+        co_return -1;
+    co_return atoi(welcome.body);
+}
+
+// server handshake: expect HELLO, reply WELCOME; 1 for a keep-alive session
+inline Task<int> async_server_handshake(Executor &ex, int sockfd, const char *UDP_PORT, IoOptions opt = {})
+{
+    auto start = io_clock::now();
+    char buf[typed_message<msg_type::TYPE_1>::max_frame];
+    int rv = co_await async_recv_frame(ex, sockfd, buf, sizeof(buf), opt);
+    if (rv == IO_TIMEOUT || rv == IO_CANCELLED)
+        co_return rv;
+    if (rv < 0)
+        co_return -1;
+    typed_message<msg_type::TYPE_1> hello;
+    rv = hello.decode(buf, rv);
+    if (rv == -3)
+        co_return -2;
+    if (rv < 0)
+        co_return -1;
+    int keep_alive = wants_keep_alive(hello);
+
+    typed_message<msg_type::TYPE_2> welcome;
+    if (welcome.set(UDP_PORT) < 0)
+        co_return -1;
+    rv = co_await async_send_message(ex, sockfd, welcome, io_left(opt, start));
+    if (rv < 0)
+        co_return -1;
+    co_return keep_alive;
+}
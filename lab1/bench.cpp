@@ -0,0 +1,414 @@
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "session_index.hpp"
+#include "scheduler.hpp"
+#include "performance/perf_common.hpp"
+#include "performance/io_buffers.hpp"
+
+// ---- Microbenchmarks ----
+// Per-function timings for the hot paths in common.hpp, the scheduling
+// passes and the perf tool's framing helpers. Every benchmark is warmed up,
+// calibrated to run for at least --min-ms and then repeated --reps times on
+// a pinned CPU; the median repetition is reported as ns/op, bytes/s and heap
+// allocations per op. --format=csv|json gives one record per benchmark for
+// scripts that compare runs.
+//   g++ -std=c++20 -O2 -pthread bench.cpp -o bench
+
+// ---- allocation counting ----
+COUNT_HEAP_ALLOCATIONS
+
+// keeps the optimiser from dropping work whose result is never used
+template <typename T>
+inline void keep(T const &v)
+{
+    asm volatile("" : : "r,m"(v) : "memory");
+}
+
+struct BenchConfig
+{
+    int cpu = -1; // -1: last CPU
+    int min_ms = 200;
+    int warmup_ms = 100;
+    int reps = 5;
+    std::string filter;
+    std::string format = "text";
+};
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations; // per repetition
+    double ns_per_op, ns_per_op_min;
+    double bytes_per_sec; // 0 when not meaningful
+    double allocs_per_op;
+};
+
+// `body(n)` runs the operation n times
+using BenchBody = std::function<void(uint64_t)>;
+
+struct Benchmark
+{
+    std::string name;
+    size_t bytes_per_op;
+    BenchBody body;
+};
+
+double time_ns(const BenchBody &body, uint64_t n)
+{
+    auto start = std::chrono::steady_clock::now();
+    body(n);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+BenchResult run_benchmark(const Benchmark &b, const BenchConfig &cfg)
+{
+    // warmup, doubling n until one run takes a tenth of --min-ms
+    uint64_t n = 1;
+    auto warm_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(cfg.warmup_ms);
+    double t = time_ns(b.body, n);
+    while (t < cfg.min_ms * 1e5 || std::chrono::steady_clock::now() < warm_until)
+    {
+        if (t < cfg.min_ms * 1e5)
+            n *= 2;
+        t = time_ns(b.body, n);
+    }
+    // calibrate to --min-ms per repetition
+    n = std::max<uint64_t>(1, (uint64_t)(n * (cfg.min_ms * 1e6 / std::max(t, 1.0))));
+
+    std::vector<double> per_op;
+    uint64_t allocs_before = heap_allocation_count.load();
+    for (int r = 0; r < cfg.reps; r++)
+        per_op.push_back(time_ns(b.body, n) / n);
+    uint64_t allocs = heap_allocation_count.load() - allocs_before;
+    std::sort(per_op.begin(), per_op.end());
+
+    BenchResult res;
+    res.name = b.name;
+    res.iterations = n;
+    res.ns_per_op = per_op[per_op.size() / 2];
+    res.ns_per_op_min = per_op.front();
+    res.bytes_per_sec = b.bytes_per_op ? b.bytes_per_op / res.ns_per_op * 1e9 : 0;
+    res.allocs_per_op = (double)allocs / ((double)n * cfg.reps);
+    return res;
+}
+
+int bench_cpu = -1;
+
+void pin_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        std::cerr << "could not pin to CPU " << cpu << ", running unpinned\n";
+    else
+        bench_cpu = cpu;
+}
+
+// helper threads inherit the pin; move them off the measured CPU
+void unpin_peer()
+{
+    int ncpu = std::max(1u, std::thread::hardware_concurrency());
+    if (bench_cpu < 0 || ncpu < 2)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c = 0; c < ncpu; c++)
+        if (c != bench_cpu)
+            CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// ---- message codec ----
+void add_codec(std::vector<Benchmark> &out)
+{
+    for (size_t size : {16, 1024, MSG_LEN})
+    {
+        auto body = std::make_shared<std::string>(size, 'x');
+        auto msg = std::make_shared<message>();
+        auto buf = std::make_shared<std::vector<char>>(sizeof(int32_t) * 2 + MSG_LEN);
+        std::string sz = std::to_string(size);
+
+        out.push_back({"message::set/" + sz, size, [=](uint64_t n)
+                       {
+                           for (uint64_t i = 0; i < n; i++)
+                           {
+                               msg->set(msg_type::TYPE_3, *body);
+                               keep(msg->message[0]);
+                           }
+                       }});
+        out.push_back({"message::printToBuf/" + sz, size, [=](uint64_t n)
+                       {
+                           msg->set(msg_type::TYPE_3, *body);
+                           for (uint64_t i = 0; i < n; i++)
+                               keep(msg->printToBuf(buf->data(), buf->size()));
+                       }});
+        out.push_back({"message::parseFromBuf/" + sz, size, [=](uint64_t n)
+                       {
+                           msg->set(msg_type::TYPE_3, *body);
+                           int len = msg->printToBuf(buf->data(), buf->size());
+                           for (uint64_t i = 0; i < n; i++)
+                               keep(msg->parseFromBuf(buf->data(), len));
+                       }});
+        out.push_back({"encode_message/" + sz, size, [=](uint64_t n)
+                       {
+                           for (uint64_t i = 0; i < n; i++)
+                               keep(encode_message(msg_type::TYPE_3, *body).size());
+                       }});
+    }
+    // the handshake's typed messages, on the stack like the handshake
+    out.push_back({"typed_message<HELLO>::encode", sizeof(KEEPALIVE_HELLO) - 1, [](uint64_t n)
+                   {
+                       typed_message<msg_type::TYPE_1> hello;
+                       hello.set(KEEPALIVE_HELLO);
+                       char buf[hello.max_frame];
+                       for (uint64_t i = 0; i < n; i++)
+                           keep(hello.encode(buf, sizeof(buf)));
+                   }});
+    out.push_back({"typed_message<HELLO>::decode", sizeof(KEEPALIVE_HELLO) - 1, [](uint64_t n)
+                   {
+                       typed_message<msg_type::TYPE_1> hello;
+                       hello.set(KEEPALIVE_HELLO);
+                       char buf[hello.max_frame];
+                       int len = hello.encode(buf, sizeof(buf));
+                       for (uint64_t i = 0; i < n; i++)
+                           keep(hello.decode(buf, len));
+                   }});
+}
+
+// ---- send_all / recv_all ----
+// One side of a connected Unix stream socketpair, with a peer thread on
+// another CPU doing the matching recv_all / send_all; one op is one call.
+void add_framing(std::vector<Benchmark> &out)
+{
+    for (size_t size : {64, 4096, 65536})
+    {
+        std::string sz = std::to_string(size);
+        out.push_back({"send_all/" + sz, size, [size](uint64_t n)
+                       {
+                           int sv[2];
+                           socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+                           std::vector<char> buf(size, 'x');
+                           std::thread peer([&]
+                                            {
+                                                unpin_peer();
+                                                std::vector<char> in(size);
+                                                for (uint64_t i = 0; i < n; i++)
+                                                    recv_all(sv[1], in.data(), size); });
+                           for (uint64_t i = 0; i < n; i++)
+                               send_all(sv[0], buf.data(), size);
+                           peer.join();
+                           close(sv[0]);
+                           close(sv[1]);
+                       }});
+        out.push_back({"recv_all/" + sz, size, [size](uint64_t n)
+                       {
+                           int sv[2];
+                           socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+                           std::vector<char> buf(size);
+                           std::thread peer([&]
+                                            {
+                                                unpin_peer();
+                                                std::vector<char> outb(size, 'x');
+                                                for (uint64_t i = 0; i < n; i++)
+                                                    send_all(sv[1], outb.data(), size); });
+                           for (uint64_t i = 0; i < n; i++)
+                               recv_all(sv[0], buf.data(), size);
+                           peer.join();
+                           close(sv[0]);
+                           close(sv[1]);
+                       }});
+    }
+}
+
+// ---- scheduling passes ----
+// The same shape as the server's ClientInfo as far as the passes care.
+struct BenchClient
+{
+    enum class State
+    {
+        INVALID,
+        NOT_ARRIVED,
+        ARRIVED,
+        DISPATCHED,
+        DONE
+    };
+    std::atomic<State> state = State::NOT_ARRIVED;
+    SessionKey key;
+};
+
+// `every`-th entry arrived (the rest done), one session per entry
+std::shared_ptr<std::deque<BenchClient>> make_ring(size_t n, size_t every)
+{
+    auto ring = std::make_shared<std::deque<BenchClient>>(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        (*ring)[i].state = i % every == 0 ? BenchClient::State::ARRIVED : BenchClient::State::DONE;
+        (*ring)[i].key = SessionKey{0, (uint16_t)i, (uint32_t)i};
+    }
+    return ring;
+}
+
+void add_scheduler(std::vector<Benchmark> &out)
+{
+    for (size_t n : {64, 1024})
+    {
+        std::string sz = std::to_string(n);
+        // fcfs: a run of n arrived entries, taken in one pass
+        auto all = make_ring(n, 1);
+        out.push_back({"fcfs_pass/" + sz, 0, [=](uint64_t iters)
+                       {
+                           size_t taken = 0;
+                           for (uint64_t i = 0; i < iters; i++)
+                           {
+                               size_t cur = 0;
+                               fcfs_pass(*all, cur, [&](size_t)
+                                         { taken++; });
+                           }
+                           keep(taken);
+                       }});
+        // rr: one turn over a ring where a quarter of the entries arrived
+        auto quarter = make_ring(n, 4);
+        auto served = std::make_shared<std::unordered_set<uint16_t>>();
+        out.push_back({"rr_turn/" + sz, 0, [=](uint64_t iters)
+                       {
+                           size_t taken = 0, cur = 0;
+                           for (uint64_t i = 0; i < iters; i++)
+                               rr_turn(*quarter, cur, *served, [&](size_t)
+                                       { taken++; });
+                           keep(taken);
+                       }});
+    }
+}
+
+// ---- ts_print ----
+// Formatting plus the print lock, into a stream that discards everything.
+struct NullBuf : std::streambuf
+{
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+void add_print(std::vector<Benchmark> &out)
+{
+    out.push_back({"ts_print/4args", 0, [](uint64_t n)
+                   {
+                       NullBuf null;
+                       std::streambuf *old = std::cout.rdbuf(&null);
+                       std::string ip = "127.0.0.1";
+                       for (uint64_t i = 0; i < n; i++)
+                           ts_print("[UDP] Dedicated UDP server for ", ip, " on port ", 9080 + (int)(i & 1023), "\n");
+                       std::cout.rdbuf(old);
+                   }});
+}
+
+std::string json_escape(const std::string &s)
+{
+    std::string r;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            r += '\\';
+        r += c;
+    }
+    return r;
+}
+
+void report(const BenchResult &r, const std::string &format)
+{
+    std::ostringstream line;
+    if (format == "csv")
+        line << r.name << "," << r.iterations << "," << r.ns_per_op << "," << r.ns_per_op_min << ","
+             << r.bytes_per_sec << "," << r.allocs_per_op;
+    else if (format == "json")
+        line << "{\"name\":\"" << json_escape(r.name) << "\",\"iterations\":" << r.iterations
+             << ",\"ns_per_op\":" << r.ns_per_op << ",\"ns_per_op_min\":" << r.ns_per_op_min
+             << ",\"bytes_per_sec\":" << r.bytes_per_sec << ",\"allocs_per_op\":" << r.allocs_per_op << "}";
+    else
+    {
+        line << std::left << std::setw(30) << r.name << std::right << std::fixed
+             << std::setprecision(1) << std::setw(12) << r.ns_per_op << " ns/op"
+             << std::setw(12) << r.ns_per_op_min << " min";
+        if (r.bytes_per_sec > 0)
+            line << std::setw(12) << r.bytes_per_sec / (1 << 20) << " MB/s";
+        else
+            line << std::setw(17) << "";
+        line << std::setprecision(2) << std::setw(10) << r.allocs_per_op << " allocs/op";
+    }
+    std::cout << line.str() << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg;
+    bool list = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--cpu")
+            cfg.cpu = std::stoi(val);
+        else if (key == "--min-ms")
+            cfg.min_ms = std::max(1, std::stoi(val));
+        else if (key == "--warmup-ms")
+            cfg.warmup_ms = std::max(0, std::stoi(val));
+        else if (key == "--reps")
+            cfg.reps = std::max(1, std::stoi(val));
+        else if (key == "--filter")
+            cfg.filter = val;
+        else if (key == "--format" && (val == "text" || val == "csv" || val == "json"))
+            cfg.format = val;
+        else if (key == "--list")
+            list = true;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--filter=SUBSTR] [--cpu=N] [--min-ms=MS] [--warmup-ms=MS]\n"
+                      << "       [--reps=N] [--format=text|csv|json] [--list]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Benchmark> all;
+    add_codec(all);
+    add_framing(all);
+    add_scheduler(all);
+    add_print(all);
+
+    if (list)
+    {
+        for (auto &b : all)
+            std::cout << b.name << "\n";
+        return 0;
+    }
+
+    int ncpu = std::max(1u, std::thread::hardware_concurrency());
+    pin_cpu(cfg.cpu >= 0 ? cfg.cpu : ncpu - 1);
+    if (cfg.format == "csv")
+        std::cout << "name,iterations,ns_per_op,ns_per_op_min,bytes_per_sec,allocs_per_op" << std::endl;
+    for (auto &b : all)
+    {
+        if (!cfg.filter.empty() && b.name.find(cfg.filter) == std::string::npos)
+            continue;
+        report(run_benchmark(b, cfg), cfg.format);
+    }
+    return 0;
+}
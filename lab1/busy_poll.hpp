@@ -0,0 +1,139 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// ---- Spin mode ----
+// Trades CPU for latency: a spinning thread polls its non-blocking sockets
+// instead of sleeping in the kernel, the driver queue is polled from the
+// receive path as well (SO_BUSY_POLL / SO_PREFER_BUSY_POLL), the thread
+// stays on one chosen core and memory is locked so the measured path never
+// takes a page fault. Whether that is worth a core is answered by running
+// with and without it and comparing latency against the CPU time used,
+// which CpuMeter reports.
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69 // linux 5.11, older libc headers lack it
+#endif
+
+// false if the kernel refused (unsupported, or raising SO_BUSY_POLL above
+// net.core.busy_read needs CAP_NET_ADMIN); spinning works without it
+inline bool set_busy_poll(int fd, int usecs)
+{
+    int one = 1;
+    bool ok = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0;
+    ok = setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == 0 && ok;
+    return ok;
+}
+
+inline bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// "2,3,6" -> {2, 3, 6}
+inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t comma = list.find(',', pos);
+        cpus.push_back(atoi(list.substr(pos, comma - pos).c_str()));
+        pos = comma == std::string::npos ? list.size() : comma + 1;
+    }
+    return cpus;
+}
+
+// locks current and future pages; `prefault` bytes of stack are touched
+// now so the first deep call does not fault either
+inline bool lock_memory(size_t prefault = 256 << 10)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        perror("mlockall (raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK)");
+        return false;
+    }
+    volatile char *stack = (volatile char *)alloca(prefault);
+    for (size_t i = 0; i < prefault; i += 4096)
+        stack[i] = 0;
+    return true;
+}
+
+// recv/recvfrom that spin on MSG_DONTWAIT instead of blocking; give up
+// with EAGAIN after timeout_ms (0 = never)
+inline ssize_t spin_recvfrom(int fd, void *buf, size_t len, int flags, sockaddr *from,
+                             socklen_t *fromlen, int timeout_ms = 0)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    socklen_t cap = fromlen ? *fromlen : 0;
+    for (unsigned spins = 0;; spins++)
+    {
+        if (fromlen)
+            *fromlen = cap;
+        ssize_t n = recvfrom(fd, buf, len, flags | MSG_DONTWAIT, from, fromlen);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        if (timeout_ms > 0 && (spins & 1023) == 0 && std::chrono::steady_clock::now() > deadline)
+            return -1; // errno is EAGAIN, as for SO_RCVTIMEO
+    }
+}
+
+inline ssize_t spin_recv(int fd, void *buf, size_t len, int flags = 0, int timeout_ms = 0)
+{
+    return spin_recvfrom(fd, buf, len, flags, nullptr, nullptr, timeout_ms);
+}
+
+// Process CPU time against wall time since start(): how many cores the
+// run kept busy.
+class CpuMeter
+{
+public:
+    void start()
+    {
+        wall0 = std::chrono::steady_clock::now();
+        getrusage(RUSAGE_SELF, &ru0);
+    }
+
+    // "cpu 0.98 cores (user 0.41 s, sys 0.57 s over 1.00 s)"
+    std::string report() const
+    {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+        double user = seconds(ru.ru_utime) - seconds(ru0.ru_utime);
+        double sys = seconds(ru.ru_stime) - seconds(ru0.ru_stime);
+        char line[96];
+        snprintf(line, sizeof(line), "cpu %.2f cores (user %.3f s, sys %.3f s over %.3f s)",
+                 wall > 0 ? (user + sys) / wall : 0, user, sys, wall);
+        return line;
+    }
+
+private:
+    static double seconds(const timeval &tv) { return tv.tv_sec + tv.tv_usec / 1e6; }
+
+    std::chrono::steady_clock::time_point wall0;
+    rusage ru0{};
+};
+
+// CPU time a thread has used so far, ns (clock from pthread_getcpuclockid)
+inline uint64_t cpu_clock_ns(clockid_t clock)
+{
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
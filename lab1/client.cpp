@@ -7,9 +7,37 @@
 #include <iostream>
 
 #include "common.hpp"
+#include "async_io.hpp"
+#include "fragment.hpp"
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
+// ---- Request framing ----
+// --payload=BYTES pads the request body, --mtu=BYTES splits any frame
+// larger than BYTES into fragments the server reassembles, instead of
+// leaving that to IP fragmentation.
+size_t payload = 0;
+size_t mtu = 0;
+uint32_t next_frag_id = 0;
+
+std::string request_body()
+{
+    std::string body = "Hello from UDP client!";
+    if (payload > body.size())
+        body.resize(std::min<size_t>(payload, MSG_LEN), '.');
+    return body;
+}
+
+ssize_t send_frame(int sock, const std::string &frame, const sockaddr_in &to)
+{
+    if (mtu == 0 || frame.size() <= mtu)
+        return sendto(sock, frame.data(), frame.size(), 0, (const sockaddr *)&to, sizeof(to));
+    return send_fragmented(sock, (const sockaddr *)&to, sizeof(to), next_frag_id++,
+                           frame.data(), frame.size(), mtu - sizeof(FragHeader));
+}
+
 int udp_conv(int server_port, const char *server_ip)
 {
     int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -25,12 +53,11 @@ int udp_conv(int server_port, const char *server_ip)
     inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
 
     message msg{};
-    msg.set(msg_type::TYPE_3, "Hello from UDP client!");
-    char buf[MSG_LEN];
-    int n = msg.printToBuf(buf, sizeof buf);
+    msg.set(msg_type::TYPE_3, request_body());
+    char buf[sizeof(int32_t) * 2 + MSG_LEN];
     cout<<"sending : "<<msg.print(false)<<"\n";
-    ssize_t sent = sendto(udp_sock, buf, n, 0,
-                          (sockaddr *)&server_addr, sizeof(server_addr));
+    // a body of MSG_LEN bytes leaves msg.message without a terminating NUL
+    ssize_t sent = send_frame(udp_sock, encode_message(msg.type, std::string_view(msg.message, msg.length)), server_addr);
     if (sent < 0)
     {
         perror("sendto");
@@ -41,7 +68,7 @@ int udp_conv(int server_port, const char *server_ip)
     }
 
     socklen_t addrlen = sizeof(server_addr);
-    n = recvfrom(udp_sock, buf, sizeof(buf) - 1, 0,
+    int n = recvfrom(udp_sock, buf, sizeof(buf) - 1, 0,
                          (sockaddr *)&server_addr, &addrlen);
 
     if (n >= 0)
@@ -53,7 +80,78 @@ int udp_conv(int server_port, const char *server_ip)
     close(udp_sock);
     return 0;
 }
-int tcp_handshake(const char*server_ip,int PORT)
+// Keep-alive: `requests` request/ACK exchanges over one session, then an
+// explicit close. Returns the number of requests that were ACKed.
+int keepalive_conv(int server_port, const char *server_ip, int requests, std::vector<double> &rtt_ms)
+{
+    int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sock < 0)
+    {
+        perror("socket");
+        return 0;
+    }
+    timeval tv{3, 0}; // a lost datagram must not stall the whole run
+    setsockopt(udp_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+
+    const std::string body = request_body();
+    char buf[sizeof(int32_t) * 2 + MSG_LEN];
+    int acked = 0;
+    for (int i = 0; i < requests; i++)
+    {
+        // "#<i> " in front, the ACK has to carry the same tag
+        std::string tag = "#" + to_string(i);
+        std::string request = encode_message(msg_type::TYPE_3, (tag + " " + body).substr(0, MSG_LEN));
+        auto sent_at = std::chrono::steady_clock::now();
+        if (send_frame(udp_sock, request, server_addr) < 0)
+        {
+            perror("sendto");
+            break;
+        }
+        bool ok = false;
+        for (;;)
+        {
+            int n = recvfrom(udp_sock, buf, sizeof(buf), 0, nullptr, nullptr);
+            if (n < 0)
+                break; // timed out, the request counts as lost
+            message msg{};
+            if (msg.parseFromBuf(buf, n) >= 0 && ack_matches(msg, tag))
+            {
+                ok = true;
+                break;
+            }
+            // anything else is the late ACK of an earlier request
+        }
+        if (!ok)
+            continue;
+        acked++;
+        rtt_ms.push_back(std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - sent_at)
+                             .count());
+    }
+
+    std::string bye = encode_message(msg_type::TYPE_6, "");
+    sendto(udp_sock, bye.data(), bye.size(), 0, (sockaddr *)&server_addr, sizeof(server_addr));
+    close(udp_sock);
+    return acked;
+}
+
+void print_rtts(std::vector<double> &rtt_ms)
+{
+    if (rtt_ms.empty())
+        return;
+    std::sort(rtt_ms.begin(), rtt_ms.end());
+    auto pct = [&](double p)
+    { return rtt_ms[std::min(rtt_ms.size() - 1, (size_t)(p * rtt_ms.size()))]; };
+    cout << "UDP rtt ms: p50=" << pct(0.5) << " p99=" << pct(0.99)
+         << " max=" << rtt_ms.back() << "\n";
+}
+
+int tcp_handshake(const char*server_ip,int PORT, bool keep_alive = false)
 {
     int sockfd, rv;
     struct addrinfo hints{}, *servinfo, *p;
@@ -95,29 +193,171 @@ int tcp_handshake(const char*server_ip,int PORT)
     }
 
     freeaddrinfo(servinfo); // Done with address info
-    // Receive data
-    int bufsz = 150;
-    char buf[bufsz];
-    message st1;
-    st1.set(msg_type::TYPE_1, "Hi from client");
-
-    rv = client_handshake(sockfd);
+    rv = client_handshake(sockfd, keep_alive);
     close(sockfd);
     return rv;
 }
 
+// ---- Coroutine mode ----
+// Many complete conversations (TCP handshake, then the UDP exchange) at
+// once, each one a straight-line coroutine, all on this thread.
+struct AsyncStats
+{
+    int ok = 0, busy = 0, failed = 0, remaining = 0;
+    int requests = 1; // per session, more than one uses a keep-alive session
+    std::vector<double> rtt_ms; // UDP request -> ACK
+};
+
+Task<void> async_conv(Executor &ex, sockaddr_in server_addr, AsyncStats &st,
+                      CancelToken &stop, CancelToken &watchdog)
+{
+    const IoOptions opt{std::chrono::milliseconds(3000), &stop};
+    int rv = -1;
+    int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_sock >= 0)
+        rv = co_await async_connect(ex, tcp_sock, (sockaddr *)&server_addr, sizeof(server_addr), opt);
+    bool keep_alive = st.requests > 1;
+    if (rv == 0)
+        rv = co_await async_client_handshake(ex, tcp_sock, opt, keep_alive);
+    if (tcp_sock >= 0)
+        close(tcp_sock);
+
+    int udp_sock = -1;
+    if (rv > 0)
+    {
+        co_await ex.sleep_for(std::chrono::seconds(1), &stop); // give server a moment
+        udp_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (udp_sock < 0)
+            perror("socket"); // the session counts as failed
+    }
+    if (udp_sock >= 0)
+    {
+        server_addr.sin_port = htons(rv);
+        const std::string body = request_body();
+        int acked = 0;
+        for (int i = 0; i < st.requests; i++)
+        {
+            // keep-alive requests are tagged like keepalive_conv's
+            std::string tag = "#" + to_string(i);
+            std::string request = encode_message(msg_type::TYPE_3, keep_alive ? (tag + " " + body).substr(0, MSG_LEN) : body);
+            auto sent_at = std::chrono::steady_clock::now();
+            send_frame(udp_sock, request, server_addr);
+            message ack{};
+            sockaddr_in from{};
+            socklen_t fromlen;
+            do
+            {
+                rv = co_await async_recvfrom_message(ex, udp_sock, ack, from, fromlen, opt);
+            } while (rv == 0 && keep_alive && !ack_matches(ack, tag));
+            if (rv == IO_CANCELLED)
+                break;
+            if (rv == 0 && ack.type == msg_type::TYPE_4)
+            {
+                acked++;
+                st.rtt_ms.push_back(std::chrono::duration<double, std::milli>(
+                                        std::chrono::steady_clock::now() - sent_at)
+                                        .count());
+            }
+        }
+        if (keep_alive)
+        {
+            std::string bye = encode_message(msg_type::TYPE_6, "");
+            sendto(udp_sock, bye.data(), bye.size(), 0, (sockaddr *)&server_addr, sizeof(server_addr));
+        }
+        close(udp_sock);
+        if (acked == st.requests)
+            st.ok++;
+        else
+            st.failed++;
+    }
+    else if (rv == -3)
+        st.busy++;
+    else
+        st.failed++;
+
+    if (--st.remaining == 0)
+        watchdog.cancel(); // everyone is done, no need to wait for the deadline
+}
+
+// gives up on whatever is still running after `deadline`
+Task<void> async_deadline(Executor &ex, std::chrono::seconds deadline,
+                          CancelToken &stop, CancelToken &watchdog)
+{
+    int rv = co_await ex.sleep_for(deadline, &watchdog);
+    if (rv != IO_CANCELLED)
+        stop.cancel();
+}
+
+int run_async(const char *server_ip, int server_port, int sessions, int requests)
+{
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0)
+    {
+        cerr << "invalid server ip " << server_ip << "\n";
+        return 1;
+    }
+
+    Executor ex;
+    CancelToken stop(ex), watchdog(ex);
+    AsyncStats st;
+    st.remaining = sessions;
+    st.requests = requests;
+    auto start = std::chrono::steady_clock::now();
+    ex.spawn(async_deadline(ex, std::chrono::seconds(30), stop, watchdog));
+    for (int i = 0; i < sessions; i++)
+        ex.spawn(async_conv(ex, server_addr, st, stop, watchdog));
+    ex.run();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    cout << sessions << " sessions in " << secs << "s: ok=" << st.ok
+         << " busy=" << st.busy << " failed=" << st.failed;
+    if (requests > 1)
+        cout << " (" << st.rtt_ms.size() << "/" << (size_t)sessions * requests << " requests ACKed)";
+    cout << "\n";
+    print_rtts(st.rtt_ms);
+    return st.ok == sessions ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
+    // --keep-alive=N sends N requests over each session
+    int requests = 1;
+    vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--keep-alive=", 0) == 0)
+            requests = std::max(1, atoi(argv[i] + strlen("--keep-alive=")));
+        else if (arg.rfind("--payload=", 0) == 0)
+            payload = std::stoul(arg.substr(strlen("--payload=")));
+        else if (arg.rfind("--mtu=", 0) == 0)
+            mtu = std::max<size_t>(sizeof(FragHeader) + 1, std::stoul(arg.substr(strlen("--mtu="))));
+        else
+            args.push_back(argv[i]);
+    }
+    argc = args.size();
+    argv = args.data();
+
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip> <server_port>\n";
+        std::cerr << "Usage: " << argv[0] << " <server_ip> <server_port> [sessions] [--keep-alive=REQUESTS]"
+                  << " [--payload=BYTES] [--mtu=BYTES]\n";
         return 1;
     }
 
     const char *server_ip = argv[1];
     int server_port = std::stoi(argv[2]);
 
+    // several sessions: run them concurrently as coroutines on this thread
+    if (argc >= 4 && std::stoi(argv[3]) > 1)
+        return run_async(server_ip, server_port, std::stoi(argv[3]), requests);
+
     // Phase 1: TCP handshake (returns the negotiated UDP port)
-    int udp_port = tcp_handshake(server_ip, server_port);
+    int udp_port = tcp_handshake(server_ip, server_port, requests > 1);
 
+    if (udp_port == -3) {
+        std::cerr << "Server busy, try again later\n";
+        return 1;
+    }
     if (udp_port <= 0) {
         std::cerr << "Handshake failed\n";
         return 1;
@@ -126,6 +366,13 @@ int main(int argc, char **argv) {
     sleep(1); // give server a moment (optional)
 
     // Phase 2: UDP conversation
+    if (requests > 1) {
+        std::vector<double> rtt_ms;
+        int acked = keepalive_conv(udp_port, server_ip, requests, rtt_ms);
+        cout << acked << "/" << requests << " requests ACKed over one session\n";
+        print_rtts(rtt_ms);
+        return acked == requests ? 0 : 1;
+    }
     udp_conv(udp_port, server_ip);
 
     return 0;
@@ -1,17 +1,68 @@
+#pragma once
+#include <algorithm>
 #include <string>
 #include <cstdint>
 #include <cstring>     // for memcpy
 #include <arpa/inet.h> // for htonl, ntohl
+#include <sys/socket.h>
+#include <unistd.h>
 #include <chrono>
+#include <iostream>
+#include <mutex>
 #define MSG_LEN 15000
 using namespace std;
+
+// ---- Thread-safe printing ----
+inline std::mutex print_mutex;
+template <typename... Args>
+void ts_print(Args &&...args)
+{
+    std::lock_guard<std::mutex> lock(print_mutex);
+    (std::cout << ... << args);
+}
 enum class msg_type : int32_t
 {
     TYPE_1 = 1,
     TYPE_2,
     TYPE_3,
-    TYPE_4
+    TYPE_4,
+    TYPE_5, // BUSY: server is shedding load, retry later
+    TYPE_6  // CLOSE: client ends its keep-alive session
 };
+
+// HELLO body that asks for a keep-alive session: the UDP port from the
+// WELCOME then takes any number of TYPE_3 requests until TYPE_6 or idle
+#define KEEPALIVE_HELLO "keep-alive"
+
+// ---- Wire frame ----
+// Every message on the wire: big-endian int32 type, big-endian int32
+// length, then `length` body bytes.
+inline constexpr int FRAME_HEADER = 2 * sizeof(int32_t);
+
+constexpr void put_be32(char *p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+constexpr uint32_t get_be32(const char *p)
+{
+    return (uint32_t)(unsigned char)p[0] << 24 | (uint32_t)(unsigned char)p[1] << 16 |
+           (uint32_t)(unsigned char)p[2] << 8 | (uint32_t)(unsigned char)p[3];
+}
+
+constexpr void put_frame_header(char *frame, msg_type tp, int32_t length)
+{
+    put_be32(frame, (uint32_t)tp);
+    put_be32(frame + sizeof(int32_t), (uint32_t)length);
+}
+
+// type and length of a frame with at least FRAME_HEADER bytes
+constexpr msg_type frame_type(const char *frame) { return (msg_type)get_be32(frame); }
+constexpr int32_t frame_length(const char *frame) { return (int32_t)get_be32(frame + sizeof(int32_t)); }
+
 struct message
 {
     msg_type type;
@@ -50,12 +101,8 @@ struct message
             return -1; // not enough space
         }
 
-        int32_t net_type = htonl(static_cast<std::underlying_type_t<msg_type>>(type));
-        int32_t net_len = htonl(length);
-
-        memcpy(buf, &net_type, sizeof(net_type));
-        memcpy(buf + sizeof(net_type), &net_len, sizeof(net_len));
-        memcpy(buf + sizeof(net_type) + sizeof(net_len), message, length);
+        put_frame_header(buf, type, length);
+        memcpy(buf + FRAME_HEADER, message, length);
 
         return req;
     }
@@ -99,6 +146,129 @@ struct message
     }
 };
 
+// ---- Typed messages ----
+// Each type declares the largest body it carries; a typed_message<T> is a
+// stack object of just that size, its frame size known at compile time.
+// Control messages are a few bytes where a `message` is 15 KB; requests
+// keep MSG_LEN. Same frames as message::printToBuf, byte for byte.
+template <msg_type T>
+struct msg_layout
+{
+    static constexpr int max_body = MSG_LEN;
+};
+template <> // HELLO: empty or KEEPALIVE_HELLO
+struct msg_layout<msg_type::TYPE_1> { static constexpr int max_body = 64; };
+template <> // WELCOME: the UDP port in decimal
+struct msg_layout<msg_type::TYPE_2> { static constexpr int max_body = 8; };
+template <> // ACK text
+struct msg_layout<msg_type::TYPE_4> { static constexpr int max_body = 256; };
+template <> // BUSY
+struct msg_layout<msg_type::TYPE_5> { static constexpr int max_body = 0; };
+template <> // CLOSE
+struct msg_layout<msg_type::TYPE_6> { static constexpr int max_body = 0; };
+
+template <msg_type T>
+struct typed_message
+{
+    static constexpr msg_type type = T;
+    static constexpr int max_body = msg_layout<T>::max_body;
+    static constexpr int max_frame = FRAME_HEADER + max_body;
+
+    int32_t length = 0;
+    char body[max_body + 1] = {}; // NUL-terminated, as message::message
+
+    int set(std::string_view b)
+    {
+        if (b.size() > (size_t)max_body)
+            return -1;
+        length = b.size();
+        memcpy(body, b.data(), length);
+        body[length] = '\0';
+        return 0;
+    }
+
+    std::string_view view() const { return {body, (size_t)length}; }
+
+    // frame size, -1 if buf is too small
+    int encode(char *buf, int sz) const
+    {
+        if (sz < FRAME_HEADER + length)
+            return -1;
+        put_frame_header(buf, T, length);
+        memcpy(buf + FRAME_HEADER, body, length);
+        return FRAME_HEADER + length;
+    }
+
+    // -1 short frame, -2 invalid size (over max_body too), -3 another type
+    int decode(const char *buf, int sz)
+    {
+        if (sz < FRAME_HEADER)
+            return -1;
+        if (frame_type(buf) != T)
+            return -3;
+        int32_t len = frame_length(buf);
+        if (len < 0 || len > max_body || sz < FRAME_HEADER + len)
+            return -2;
+        length = len;
+        memcpy(body, buf + FRAME_HEADER, len);
+        body[len] = '\0';
+        return 0;
+    }
+};
+
+static_assert(sizeof(typed_message<msg_type::TYPE_1>) <= 72 && sizeof(typed_message<msg_type::TYPE_5>) <= 8,
+              "handshake messages are small stack objects");
+
+// encode a message straight to its wire frame (for frames that are
+// built once and sent many times)
+inline std::string encode_message(msg_type tp, std::string_view body)
+{
+    if (body.size() > MSG_LEN)
+        return {};
+    std::string frame(FRAME_HEADER + body.size(), '\0');
+    put_frame_header(frame.data(), tp, body.size());
+    memcpy(frame.data() + FRAME_HEADER, body.data(), body.size());
+    return frame;
+}
+
+// ---- Keep-alive request ids ----
+// A keep-alive client numbers its requests by starting each body with
+// "#<id> "; the server appends the same "#<id>" to the ACK, so a reply
+// that turns up after the client gave up waiting is not mistaken for the
+// reply to the next request. Untagged requests get the plain ACK.
+
+// "#<id>" at the start of a body, empty when untagged
+inline std::string_view request_tag(std::string_view body)
+{
+    size_t end = 1;
+    while (end < body.size() && end < 11 && body[end] >= '0' && body[end] <= '9')
+        end++;
+    if (body.empty() || body[0] != '#' || end == 1)
+        return {};
+    return body.substr(0, end);
+}
+
+// the ACK frame for request `req`: plain_ack with the request's tag
+// appended, empty when the request is untagged (send plain_ack as it is)
+inline std::string tagged_ack(const std::string &plain_ack, const message &req)
+{
+    std::string_view tag = request_tag(std::string_view(req.message, std::clamp(req.length, 0, MSG_LEN)));
+    if (tag.empty())
+        return {};
+    std::string body = plain_ack.substr(FRAME_HEADER);
+    body += ' ';
+    body += tag;
+    return encode_message(msg_type::TYPE_4, body);
+}
+
+// true when `ack` is the ACK of the request tagged `tag`
+inline bool ack_matches(const message &ack, std::string_view tag)
+{
+    std::string_view body(ack.message, std::clamp(ack.length, 0, MSG_LEN));
+    return ack.type == msg_type::TYPE_4 && body.size() > tag.size() && body.ends_with(tag) &&
+           body[body.size() - tag.size() - 1] == ' ';
+}
+
 // ---- Handshake helpers ----
 
 // send a message over a TCP socket
@@ -113,6 +283,18 @@ inline int send_message(int sockfd, const message &msg)
     return (sent == n) ? 0 : -1;
 }
 
+template <msg_type T>
+inline int send_message(int sockfd, const typed_message<T> &msg)
+{
+    char buf[typed_message<T>::max_frame];
+    int n = msg.encode(buf, sizeof(buf));
+    if (n < 0)
+        return n;
+
+    int sent = send(sockfd, buf, n, 0);
+    return (sent == n) ? 0 : -1;
+}
+
 // receive a message over a TCP socket
 inline int recv_message(int sockfd, message &msg)
 {
@@ -124,31 +306,80 @@ inline int recv_message(int sockfd, message &msg)
 }
 
 // client handshake: send HELLO, expect WELCOME
-inline int client_handshake(int sockfd)
+inline int client_handshake(int sockfd, bool keep_alive = false)
 {
-    message msg;
-    msg.set(msg_type::TYPE_1, "");
-    if (send_message(sockfd, msg) < 0)
+    typed_message<msg_type::TYPE_1> hello;
+    hello.set(keep_alive ? KEEPALIVE_HELLO : "");
+    if (send_message(sockfd, hello) < 0)
         return -1;
 
-    if (recv_message(sockfd, msg) < 0)
+    char buf[typed_message<msg_type::TYPE_2>::max_frame]; // BUSY is shorter
+    int n = recv(sockfd, buf, sizeof(buf), 0);
+    if (n <= 0)
         return -1;
-    if (msg.type != msg_type::TYPE_2)
+    if (n >= FRAME_HEADER && frame_type(buf) == msg_type::TYPE_5)
+        return -3; // server busy
+    typed_message<msg_type::TYPE_2> welcome;
+    int rv = welcome.decode(buf, n);
+    if (rv == -3)
         return -2;
-    return atoi(msg.message);
+    if (rv < 0)
+        return -1;
+    return atoi(welcome.body);
+}
+
+inline bool wants_keep_alive(const message &hello)
+{
+    return std::string_view(hello.message, hello.length) == KEEPALIVE_HELLO;
+}
+
+inline bool wants_keep_alive(const typed_message<msg_type::TYPE_1> &hello)
+{
+    return hello.view() == KEEPALIVE_HELLO;
 }
 
-// server handshake: expect HELLO, reply WELCOME
+// server handshake: expect HELLO, reply WELCOME; 1 if the client asked
+// for a keep-alive session, 0 for a single request
 inline int server_handshake(int sockfd, const char *UDP_PORT)
 {
-    message msg;
-    if (recv_message(sockfd, msg) < 0)
+    char buf[typed_message<msg_type::TYPE_1>::max_frame];
+    int n = recv(sockfd, buf, sizeof(buf), 0);
+    if (n <= 0)
         return -1;
-    if (msg.type != msg_type::TYPE_1)
+    typed_message<msg_type::TYPE_1> hello;
+    int rv = hello.decode(buf, n);
+    if (rv == -3)
         return -2;
+    if (rv < 0)
+        return -1;
+    int keep_alive = wants_keep_alive(hello);
 
-    msg.set(msg_type::TYPE_2, UDP_PORT);
-    if (send_message(sockfd, msg) < 0)
+    typed_message<msg_type::TYPE_2> welcome;
+    if (welcome.set(UDP_PORT) < 0 || send_message(sockfd, welcome) < 0)
         return -1;
-    return 0;
-}
\ No newline at end of file
+    return keep_alive;
+}
+
+// shed a connection: tell the client to come back later and drop it
+// without ever blocking the caller
+inline void reply_busy(int fd)
+{
+    static const std::string busy_frame = encode_message(msg_type::TYPE_5, "");
+    send(fd, busy_frame.data(), busy_frame.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    // read whatever HELLO already arrived so close() sends a FIN, not a RST
+    char buf[256];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    close(fd);
+}
+
+// A keep-alive session's UDP socket is shared by the session itself and
+// every request still waiting for its ACK; the last owner closes it.
+struct SessionSocket
+{
+    int fd;
+    explicit SessionSocket(int fd) : fd(fd) {}
+    SessionSocket(const SessionSocket &) = delete;
+    SessionSocket &operator=(const SessionSocket &) = delete;
+    ~SessionSocket() { close(fd); }
+};
@@ -0,0 +1,400 @@
+#pragma once
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// ---- UDP fragmentation ----
+// Messages larger than one datagram (or than the path MTU) go out as
+// fragments, each a FragHeader plus a slice of the message. All fragments
+// of a message but the last carry exactly frag_size bytes, so a fragment's
+// index is offset / frag_size. The receiver reassembles them, in any
+// order, into a buffer taken from a BufferPool; a message whose fragments
+// stop arriving is dropped after a timeout, and both the number of
+// messages and the bytes under reassembly are capped.
+// Fragments and plain datagrams can share a socket: a fragment starts with
+// FRAG_MAGIC (never a valid lab1 message type) and must pass the header's
+// consistency checks, anything else is handed back as NOT_FRAGMENT.
+
+#define FRAG_MAGIC 0x46524731u // "FRG1"
+#define UDP_MAX_DATAGRAM 65507 // largest UDP payload over IPv4
+#define FRAG_DEFAULT_SIZE 1400 // payload per fragment, fits a 1500 byte MTU
+
+struct FragHeader
+{
+    uint32_t magic;
+    uint32_t msg_id;
+    uint32_t total_len;
+    uint32_t offset;
+    uint16_t frag_len;
+    uint16_t frag_size; // nominal fragment size of this message
+};
+
+static_assert(sizeof(FragHeader) == 20, "fragment header is part of the wire format");
+
+#define FRAG_MAX_SIZE (UDP_MAX_DATAGRAM - (int)sizeof(FragHeader))
+
+// Sends `len` bytes as fragments of at most frag_size bytes, batched with
+// sendmmsg and without copying the payload. Returns len, or -1 on error.
+inline ssize_t send_fragmented(int fd, const sockaddr *to, socklen_t tolen, uint32_t msg_id,
+                               const char *data, size_t len, size_t frag_size)
+{
+    constexpr int BATCH = 64;
+    FragHeader hdrs[BATCH];
+    iovec iov[BATCH][2];
+    mmsghdr msgs[BATCH];
+    frag_size = std::clamp<size_t>(frag_size, 1, FRAG_MAX_SIZE);
+    size_t off = 0;
+    do
+    {
+        int cnt = 0;
+        for (; cnt < BATCH && (off < len || (len == 0 && cnt == 0)); cnt++)
+        {
+            size_t fl = std::min(frag_size, len - off);
+            hdrs[cnt] = FragHeader{htonl(FRAG_MAGIC), htonl(msg_id), htonl((uint32_t)len),
+                                   htonl((uint32_t)off), htons((uint16_t)fl), htons((uint16_t)frag_size)};
+            iov[cnt][0] = iovec{&hdrs[cnt], sizeof(FragHeader)};
+            iov[cnt][1] = iovec{const_cast<char *>(data + off), fl};
+            msgs[cnt] = mmsghdr{};
+            msgs[cnt].msg_hdr.msg_name = const_cast<sockaddr *>(to);
+            msgs[cnt].msg_hdr.msg_namelen = tolen;
+            msgs[cnt].msg_hdr.msg_iov = iov[cnt];
+            msgs[cnt].msg_hdr.msg_iovlen = 2;
+            off += fl;
+        }
+        for (int done = 0; done < cnt;)
+        {
+            int sent = sendmmsg(fd, msgs + done, cnt - done, 0);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return -1;
+            done += sent;
+        }
+    } while (off < len);
+    return len;
+}
+
+// ---- Buffer pool ----
+// Power-of-two buffers (4 KB and up) that are recycled instead of freed.
+// Once the working set has been allocated (or prefilled) reassembly runs
+// without touching the heap; `cap` bounds what the pool may ever allocate.
+// Buffers come from the aligned operator new, so a program that counts its
+// allocations (perf tool) sees them too.
+// Thread-safe, so sessions on different threads can share one pool.
+class BufferPool
+{
+public:
+    explicit BufferPool(size_t cap_bytes) : cap(cap_bytes)
+    {
+        for (auto &f : free_list)
+            f.reserve(64);
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    ~BufferPool()
+    {
+        for (auto &f : free_list)
+            for (char *p : f)
+                ::operator delete(p, BUF_ALIGN);
+    }
+
+    // a buffer of at least `size` bytes, nullptr once the cap is reached
+    char *acquire(size_t size, size_t &got)
+    {
+        int cls = size_class(size);
+        if (cls < 0)
+            return nullptr;
+        got = (size_t)1 << cls;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!free_list[cls].empty())
+        {
+            char *p = free_list[cls].back();
+            free_list[cls].pop_back();
+            in_use += got;
+            return p;
+        }
+        if (allocated + got > cap)
+            return nullptr;
+        char *p = (char *)::operator new(got, BUF_ALIGN, std::nothrow);
+        if (!p)
+            return nullptr;
+        allocated += got;
+        in_use += got;
+        heap_allocs++;
+        return p;
+    }
+
+    void release(char *p, size_t got)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        free_list[size_class(got)].push_back(p);
+        in_use -= got;
+    }
+
+    // allocate `count` buffers for messages of `size` bytes up front
+    void prefill(size_t size, size_t count)
+    {
+        std::vector<std::pair<char *, size_t>> held;
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t got;
+            if (char *p = acquire(size, got))
+                held.emplace_back(p, got);
+        }
+        for (auto &[p, got] : held)
+            release(p, got);
+    }
+
+    size_t bytes_allocated() const { return allocated; }
+    size_t bytes_in_use() const { return in_use; }
+    uint64_t heap_allocations() const { return heap_allocs; }
+
+private:
+    static constexpr std::align_val_t BUF_ALIGN{64};
+
+    static int size_class(size_t size)
+    {
+        int cls = 12;
+        while (((size_t)1 << cls) < size)
+            if (++cls >= 40)
+                return -1;
+        return cls;
+    }
+
+    std::mutex mtx;
+    std::vector<char *> free_list[40];
+    size_t cap, allocated = 0, in_use = 0;
+    uint64_t heap_allocs = 0;
+};
+
+// A pool buffer that goes back to its pool when dropped.
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool *pool, char *p, size_t cap) : pool(pool), ptr(p), cap(cap) {}
+    PooledBuffer(PooledBuffer &&o) noexcept { *this = std::move(o); }
+    PooledBuffer &operator=(PooledBuffer &&o) noexcept
+    {
+        if (this != &o)
+        {
+            reset();
+            std::swap(pool, o.pool);
+            std::swap(ptr, o.ptr);
+            std::swap(cap, o.cap);
+            std::swap(len, o.len);
+        }
+        return *this;
+    }
+    ~PooledBuffer() { reset(); }
+
+    void reset()
+    {
+        if (ptr)
+            pool->release(ptr, cap);
+        pool = nullptr;
+        ptr = nullptr;
+        cap = len = 0;
+    }
+
+    char *data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t capacity() const { return cap; }
+    void set_size(size_t n) { len = n; }
+
+private:
+    BufferPool *pool = nullptr;
+    char *ptr = nullptr;
+    size_t cap = 0, len = 0;
+};
+
+// ---- Reassembly ----
+struct ReassemblyLimits
+{
+    size_t max_message = 64u << 20;   // larger messages are refused
+    size_t max_inflight = 256u << 20; // bytes of all partial messages together
+    size_t max_messages = 16;         // partial messages at once
+    int timeout_ms = 1000;            // since the message's last fragment
+};
+
+// pool bytes a message of `total` bytes in `frag_size` fragments takes:
+// the message, then one bit per fragment
+inline size_t reassembly_buffer_size(size_t total, size_t frag_size)
+{
+    return total + (total / frag_size + 1 + 7) / 8;
+}
+
+// allocates what `lim` lets messages of up to `message` bytes hold at once,
+// so reassembly does not reach the heap when the first fragments arrive
+inline void prefill_reassembly(BufferPool &pool, const ReassemblyLimits &lim, size_t message,
+                               size_t frag_size = FRAG_DEFAULT_SIZE)
+{
+    size_t need = reassembly_buffer_size(std::min(message, lim.max_message), frag_size);
+    pool.prefill(need, std::min(lim.max_messages, lim.max_inflight / need));
+}
+
+struct ReassemblyStats
+{
+    uint64_t completed = 0, timed_out = 0, dropped_cap = 0, dropped_bad = 0, duplicates = 0;
+};
+
+class Reassembler
+{
+public:
+    enum class Result
+    {
+        NOT_FRAGMENT, // a plain datagram, use it as is
+        PENDING,      // fragment stored, message not complete yet
+        COMPLETE,     // `out` holds the whole message
+        DROPPED       // malformed, or over a limit
+    };
+
+    Reassembler(BufferPool &pool, ReassemblyLimits lim = {})
+        : pool(pool), lim(lim), slots(lim.max_messages) {}
+
+    Result feed(const sockaddr_in &from, const char *dgram, size_t n, PooledBuffer &out)
+    {
+        FragHeader h;
+        if (n < sizeof(h))
+            return Result::NOT_FRAGMENT;
+        memcpy(&h, dgram, sizeof(h));
+        if (ntohl(h.magic) != FRAG_MAGIC)
+            return Result::NOT_FRAGMENT;
+        uint32_t id = ntohl(h.msg_id), total = ntohl(h.total_len), off = ntohl(h.offset);
+        uint32_t fl = ntohs(h.frag_len), fs = ntohs(h.frag_size);
+        if (fs == 0 || fl > fs || off % fs != 0 || (uint64_t)off + fl > total ||
+            n != sizeof(h) + fl || (fl != fs && off + fl != total) || total > lim.max_message)
+        {
+            st.dropped_bad++;
+            return Result::DROPPED;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_sweep > std::chrono::milliseconds(std::max(1, lim.timeout_ms / 4)))
+            expire(now);
+
+        Slot *s = find(from, id);
+        if (s && (s->total != total || s->frag_size != fs))
+        {
+            st.dropped_bad++; // does not belong to the message under that id
+            return Result::DROPPED;
+        }
+        if (!s)
+        {
+            s = start(from, id, total, fs, now);
+            if (!s)
+                return Result::DROPPED;
+        }
+        uint32_t idx = off / fs;
+        uint8_t *bits = (uint8_t *)s->buf.data() + s->total;
+        if (bits[idx / 8] & (1u << (idx % 8)))
+        {
+            st.duplicates++;
+            return Result::PENDING;
+        }
+        bits[idx / 8] |= 1u << (idx % 8);
+        memcpy(s->buf.data() + off, dgram + sizeof(h), fl);
+        s->received += fl;
+        s->last = now;
+        if (s->received < s->total)
+            return Result::PENDING;
+
+        inflight -= s->buf.capacity();
+        s->buf.set_size(s->total);
+        out = std::move(s->buf);
+        s->used = false;
+        st.completed++;
+        return Result::COMPLETE;
+    }
+
+    // drops partial messages that have been silent for the timeout
+    void expire(std::chrono::steady_clock::time_point now)
+    {
+        last_sweep = now;
+        for (auto &s : slots)
+            if (s.used && now - s.last > std::chrono::milliseconds(lim.timeout_ms))
+            {
+                inflight -= s.buf.capacity();
+                s.buf.reset();
+                s.used = false;
+                st.timed_out++;
+            }
+    }
+
+    const ReassemblyStats &stats() const { return st; }
+    const ReassemblyLimits &limits() const { return lim; }
+
+private:
+    struct Slot
+    {
+        bool used = false;
+        in_addr_t ip;
+        uint16_t port;
+        uint32_t msg_id;
+        uint32_t total, received, frag_size;
+        std::chrono::steady_clock::time_point last;
+        PooledBuffer buf; // message bytes, then one bit per fragment
+    };
+
+    Slot *find(const sockaddr_in &from, uint32_t id)
+    {
+        for (auto &s : slots)
+            if (s.used && s.msg_id == id && s.ip == from.sin_addr.s_addr && s.port == from.sin_port)
+                return &s;
+        return nullptr;
+    }
+
+    Slot *start(const sockaddr_in &from, uint32_t id, uint32_t total, uint32_t fs,
+                std::chrono::steady_clock::time_point now)
+    {
+        Slot *s = nullptr;
+        for (auto &c : slots)
+            if (!c.used)
+            {
+                s = &c;
+                break;
+            }
+        size_t frags = total / fs + 1;
+        size_t need = reassembly_buffer_size(total, fs);
+        size_t got = 0;
+        char *p = nullptr;
+        if (s && inflight + need <= lim.max_inflight)
+            p = pool.acquire(need, got);
+        if (!p)
+        {
+            st.dropped_cap++;
+            return nullptr;
+        }
+        memset(p + total, 0, (frags + 7) / 8);
+        inflight += got;
+        s->used = true;
+        s->ip = from.sin_addr.s_addr;
+        s->port = from.sin_port;
+        s->msg_id = id;
+        s->total = total;
+        s->frag_size = fs;
+        s->received = 0;
+        s->last = now;
+        s->buf = PooledBuffer(&pool, p, got);
+        return s;
+    }
+
+    BufferPool &pool;
+    ReassemblyLimits lim;
+    std::vector<Slot> slots;
+    size_t inflight = 0;
+    std::chrono::steady_clock::time_point last_sweep;
+    ReassemblyStats st;
+};
@@ -0,0 +1,501 @@
+#pragma once
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common.hpp"
+#include "busy_poll.hpp"
+
+// ---- Thread-per-core server ----
+// One event loop per core, nothing shared on the hot path:
+//  - every core binds its own SO_REUSEPORT listener, so the kernel spreads
+//    incoming connections over the cores,
+//  - a core owns the sessions it accepted (handshake, UDP socket, timeout)
+//    and binds their UDP sockets to kernel-chosen ports, no global counter,
+//  - datagrams that arrive turn into ACK jobs in that core's ready queue,
+//  - a core with nothing to do sleeps in epoll_wait until its own sockets
+//    or a backed-up core wake it, then steals half of the ready queue of
+//    the most backed-up core. Stolen jobs are self-contained (socket + address), the
+//    owner already dropped the session, so stealing never touches its state.
+//    A keep-alive session stays with its core; its jobs share ownership of
+//    the UDP socket, so a thief never sends on a socket that was closed.
+// The clients list and clients_mtx of the classic mode are not used at all.
+
+struct PerCoreConfig
+{
+    int cores = 1;
+    size_t max_sessions = 0;         // per core, 0 = unlimited
+    int session_timeout_ms = 100000; // waiting for the datagram
+    int idle_timeout_ms = 30000;     // keep-alive session without requests
+    size_t steal_threshold = 2;      // victims with fewer ready jobs are left alone
+    int spin_us = 0;                 // > 0: spin mode, with this SO_BUSY_POLL budget
+    std::vector<int> cpus;           // core i runs on cpus[i % size], empty = not pinned
+    bool lock_memory = false;        // mlockall and preallocate before serving
+};
+
+class PerCoreServer
+{
+public:
+    PerCoreServer(const char *port, PerCoreConfig c, const std::string &ack_msg)
+        : port(port), cfg(c)
+    {
+        ack_frame = encode_message(msg_type::TYPE_4, ack_msg);
+        for (int i = 0; i < cfg.cores; i++)
+        {
+            cores.push_back(std::make_unique<Core>());
+            cores.back()->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+    }
+
+    void run()
+    {
+        // before any core serves, so not even the first requests fault
+        if (cfg.lock_memory)
+            lock_memory();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < cfg.cores; i++)
+            threads.emplace_back(&PerCoreServer::loop, this, i);
+        std::thread(&PerCoreServer::reporter, this).detach();
+        for (auto &t : threads)
+            t.join();
+    }
+
+private:
+    struct ReadyAck
+    {
+        int socket;
+        sockaddr_in addr;
+        socklen_t addrlen;
+        std::shared_ptr<SessionSocket> keep_alive; // socket stays open after the ACK
+        std::chrono::steady_clock::time_point arrived; // request datagram read
+        std::string frame; // tagged ACK of a keep-alive request, empty: ack_frame
+    };
+
+    struct Session
+    {
+        int fd; // TCP during the handshake, UDP afterwards
+        bool udp = false;
+        in_addr_t peer;
+        std::chrono::steady_clock::time_point created; // last request for keep-alive
+        std::shared_ptr<SessionSocket> keep_alive;    // owns fd once set
+    };
+
+    struct alignas(64) Core
+    {
+        std::mutex qmtx; // only contended by thieves
+        std::deque<ReadyAck> ready;
+        std::atomic<size_t> ready_size{0};
+        std::atomic<uint64_t> accepted{0}, served{0}, stolen{0}, shed{0};
+        std::atomic<uint64_t> ack_wait_ns{0}; // request read -> ACK sent, summed over served
+        std::atomic<bool> has_clock{false};
+        std::atomic<bool> idle{false}; // blocked in epoll_wait, wake_fd rouses it
+        int wake_fd = -1;
+        clockid_t cpu_clock; // the core thread's CPU time
+        // owned by the core thread only
+        std::unordered_map<int, Session> sessions;
+    };
+
+    int make_listener()
+    {
+        addrinfo hints{}, *servinfo{}, *ptr{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rv, fd = -1, yes = 1;
+        if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0)
+        {
+            ts_print("[CORE] getaddrinfo : ", gai_strerror(rv), "\n");
+            return -1;
+        }
+        for (ptr = servinfo; ptr != nullptr; ptr = ptr->ai_next)
+        {
+            fd = socket(ptr->ai_family, ptr->ai_socktype | SOCK_NONBLOCK, ptr->ai_protocol);
+            if (fd == -1)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (cfg.spin_us > 0)
+                set_busy_poll(fd, cfg.spin_us);
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1 ||
+                bind(fd, ptr->ai_addr, ptr->ai_addrlen) == -1 ||
+                listen(fd, 128) == -1)
+            {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            break;
+        }
+        freeaddrinfo(servinfo);
+        return fd;
+    }
+
+    // only with --cpus: unpinned cores are left to the scheduler, which
+    // may share CPUs with other processes better than a fixed mapping
+    void pin(int id)
+    {
+        if (cfg.cpus.empty())
+            return;
+        int cpu = cfg.cpus[id % cfg.cpus.size()];
+        if (!pin_thread(cpu))
+            ts_print("[CORE ", id, "] could not pin to CPU ", cpu, "\n");
+    }
+
+    void loop(int id)
+    {
+        pin(id);
+        Core &me = *cores[id];
+        if (pthread_getcpuclockid(pthread_self(), &me.cpu_clock) == 0)
+            me.has_clock = true;
+        if (cfg.lock_memory)
+            me.sessions.reserve(cfg.max_sessions ? cfg.max_sessions : 1024);
+        int lfd = make_listener();
+        int epfd = epoll_create1(0);
+        if (lfd < 0 || epfd < 0)
+        {
+            ts_print("[CORE ", id, "] failed to listen on ", port, "\n");
+            return;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = lfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+        ev.data.fd = me.wake_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, me.wake_fd, &ev);
+        ts_print("[CORE ", id, "] Listening on ", port, "\n");
+
+        epoll_event events[64];
+        auto last_sweep = std::chrono::steady_clock::now();
+        for (;;)
+        {
+            // block only when there is nothing to send or steal; a core
+            // whose backlog gets worth stealing wakes an idle one, the
+            // timeout is only for the expiry sweep. A spinning core never
+            // blocks.
+            int wait_ms = 0;
+            if (me.ready_size == 0 && cfg.spin_us == 0)
+            {
+                me.idle.store(true); // before looking, see wake_idle
+                wait_ms = stealable(id) ? 0 : 1000;
+            }
+            int n = epoll_wait(epfd, events, 64, wait_ms);
+            me.idle.store(false, std::memory_order_relaxed);
+            for (int i = 0; i < n; i++)
+            {
+                int fd = events[i].data.fd;
+                uint64_t wakeups;
+                if (fd == me.wake_fd)
+                    (void)!read(fd, &wakeups, sizeof(wakeups));
+                else if (fd == lfd)
+                    accept_all(me, epfd, lfd);
+                else
+                    on_readable(me, epfd, fd);
+            }
+
+            if (drain(me, me) == 0)
+                steal(id);
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sweep > std::chrono::seconds(1))
+            {
+                expire(me, epfd, now);
+                last_sweep = now;
+            }
+        }
+    }
+
+    void accept_all(Core &me, int epfd, int lfd)
+    {
+        for (;;)
+        {
+            sockaddr_in their_addr{};
+            socklen_t sin_size = sizeof(their_addr);
+            int fd = accept4(lfd, (sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK);
+            if (fd < 0)
+                return; // EAGAIN: backlog drained
+            if (cfg.max_sessions && me.sessions.size() >= cfg.max_sessions)
+            {
+                me.shed++;
+                reply_busy(fd);
+                continue;
+            }
+            me.accepted++;
+            me.sessions[fd] = Session{fd, false, their_addr.sin_addr.s_addr, std::chrono::steady_clock::now(), nullptr};
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    void drop(Core &me, int epfd, int fd)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        auto it = me.sessions.find(fd);
+        if (it != me.sessions.end() && it->second.keep_alive)
+        {
+            me.sessions.erase(it); // the socket closes with its last ACK
+            return;
+        }
+        if (it != me.sessions.end())
+            me.sessions.erase(it);
+        close(fd);
+    }
+
+    void on_readable(Core &me, int epfd, int fd)
+    {
+        auto it = me.sessions.find(fd);
+        if (it == me.sessions.end())
+            return;
+        Session &s = it->second;
+        char buf[sizeof(int32_t) * 2 + MSG_LEN];
+
+        if (!s.udp)
+        {
+            // handshake: expect HELLO, reply WELCOME with our own UDP port
+            int n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EAGAIN)
+                return;
+            typed_message<msg_type::TYPE_1> hello;
+            if (n <= 0 || hello.decode(buf, n) < 0)
+            {
+                drop(me, epfd, fd);
+                return;
+            }
+            bool keep_alive = wants_keep_alive(hello);
+            int udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+            socklen_t alen = sizeof(addr);
+            if (udp < 0 || bind(udp, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+                getsockname(udp, (sockaddr *)&addr, &alen) < 0)
+            {
+                if (udp >= 0)
+                    close(udp);
+                drop(me, epfd, fd);
+                return;
+            }
+            if (cfg.spin_us > 0)
+                set_busy_poll(udp, cfg.spin_us);
+            typed_message<msg_type::TYPE_2> welcome;
+            welcome.set(std::to_string(ntohs(addr.sin_port)));
+            send_message(fd, welcome);
+
+            Session next{udp, true, s.peer, s.created, nullptr};
+            if (keep_alive)
+            {
+                next.created = std::chrono::steady_clock::now();
+                next.keep_alive = std::make_shared<SessionSocket>(udp);
+            }
+            drop(me, epfd, fd);
+            me.sessions[udp] = next;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = udp;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, udp, &ev);
+            return;
+        }
+
+        sockaddr_in client_addr{};
+        socklen_t addrlen = sizeof(client_addr);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&client_addr, &addrlen);
+        if (n < 0)
+            return;
+        auto arrived = std::chrono::steady_clock::now();
+        if (client_addr.sin_addr.s_addr != s.peer)
+            return; // not our client
+        message msg;
+        if (s.keep_alive)
+        {
+            if (msg.parseFromBuf(buf, n) < 0)
+                return;
+            if (msg.type == msg_type::TYPE_6)
+                drop(me, epfd, fd);
+            else if (msg.type == msg_type::TYPE_3)
+            {
+                s.created = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock(me.qmtx);
+                me.ready.push_back(ReadyAck{fd, client_addr, addrlen, s.keep_alive, arrived, tagged_ack(ack_frame, msg)});
+                me.ready_size = me.ready.size();
+                wake_idle(me);
+            }
+            return;
+        }
+        if (msg.parseFromBuf(buf, n) < 0 || msg.type != msg_type::TYPE_3)
+        {
+            drop(me, epfd, fd);
+            return;
+        }
+
+        // hand the socket over to the ready queue, the session is done here
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        me.sessions.erase(fd);
+        std::lock_guard<std::mutex> lock(me.qmtx);
+        me.ready.push_back(ReadyAck{fd, client_addr, addrlen, nullptr, arrived, {}});
+        me.ready_size = me.ready.size();
+        wake_idle(me);
+    }
+
+    // a backlog worth stealing: one idle core is woken to take part of it.
+    // The idle core sets `idle` before checking stealable() and this runs
+    // after ready_size was stored, so one of them always sees the other.
+    void wake_idle(Core &me)
+    {
+        if (me.ready_size < cfg.steal_threshold)
+            return;
+        for (auto &c : cores)
+        {
+            uint64_t one = 1;
+            if (c.get() != &me && c->idle.exchange(false))
+            {
+                (void)!write(c->wake_fd, &one, sizeof(one));
+                return;
+            }
+        }
+    }
+
+    // whether another core has a backlog steal() would take from
+    bool stealable(int id) const
+    {
+        for (int i = 0; i < cfg.cores; i++)
+            if (i != id && cores[i]->ready_size >= cfg.steal_threshold)
+                return true;
+        return false;
+    }
+
+    // sends up to a batch of from's ready ACKs on behalf of me
+    size_t drain(Core &me, Core &from)
+    {
+        ReadyAck jobs[64];
+        size_t cnt = 0;
+        {
+            std::lock_guard<std::mutex> lock(from.qmtx);
+            while (cnt < 64 && !from.ready.empty())
+            {
+                jobs[cnt++] = from.ready.front();
+                from.ready.pop_front();
+            }
+            from.ready_size = from.ready.size();
+        }
+        uint64_t wait_ns = 0;
+        for (size_t i = 0; i < cnt; i++)
+        {
+            const std::string &frame = jobs[i].frame.empty() ? ack_frame : jobs[i].frame;
+            sendto(jobs[i].socket, frame.data(), frame.size(), 0,
+                   (const sockaddr *)&jobs[i].addr, jobs[i].addrlen);
+            wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - jobs[i].arrived)
+                           .count();
+            if (!jobs[i].keep_alive)
+                close(jobs[i].socket);
+            jobs[i].keep_alive.reset();
+        }
+        me.served += cnt;
+        me.ack_wait_ns += wait_ns;
+        return cnt;
+    }
+
+    // take half of the busiest core's backlog
+    void steal(int id)
+    {
+        int victim = -1;
+        size_t most = cfg.steal_threshold - 1;
+        for (int i = 0; i < cfg.cores; i++)
+        {
+            size_t sz = cores[i]->ready_size;
+            if (i != id && sz > most)
+            {
+                most = sz;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return;
+
+        Core &me = *cores[id], &v = *cores[victim];
+        std::unique_lock<std::mutex> vlock(v.qmtx, std::try_to_lock);
+        if (!vlock.owns_lock())
+            return; // the owner is draining it right now
+        size_t take = v.ready.size() / 2;
+        if (take == 0)
+            return;
+        std::vector<ReadyAck> loot(v.ready.end() - take, v.ready.end());
+        v.ready.erase(v.ready.end() - take, v.ready.end());
+        v.ready_size = v.ready.size();
+        vlock.unlock();
+
+        {
+            std::lock_guard<std::mutex> lock(me.qmtx);
+            me.ready.insert(me.ready.end(), loot.begin(), loot.end());
+            me.ready_size = me.ready.size();
+        }
+        me.stolen += take;
+    }
+
+    // close sessions that never finished their handshake or datagram, and
+    // keep-alive sessions that went idle
+    void expire(Core &me, int epfd, std::chrono::steady_clock::time_point now)
+    {
+        std::vector<int> dead;
+        for (auto &[fd, s] : me.sessions)
+            if (now - s.created > std::chrono::milliseconds(s.keep_alive ? cfg.idle_timeout_ms
+                                                                         : cfg.session_timeout_ms))
+                dead.push_back(fd);
+        for (int fd : dead)
+            drop(me, epfd, fd);
+    }
+
+    // per core: counters, CPU busy share and the mean request -> ACK time
+    // over the period, so spin mode's latency gain can be held against the
+    // cores it keeps busy
+    void reporter()
+    {
+        constexpr auto period = std::chrono::seconds(5);
+        uint64_t prev_total = 0;
+        std::vector<uint64_t> prev_cpu(cfg.cores), prev_served(cfg.cores), prev_wait(cfg.cores);
+        for (;;)
+        {
+            std::this_thread::sleep_for(period);
+            uint64_t total = 0;
+            std::string line;
+            for (int i = 0; i < cfg.cores; i++)
+            {
+                Core &c = *cores[i];
+                total += c.served;
+                uint64_t served = c.served, wait = c.ack_wait_ns;
+                uint64_t cpu = c.has_clock ? cpu_clock_ns(c.cpu_clock) : 0;
+                double busy = 100.0 * (cpu - prev_cpu[i]) / std::chrono::nanoseconds(period).count();
+                double ack_us = served > prev_served[i] ? (wait - prev_wait[i]) / 1e3 / (served - prev_served[i]) : 0;
+                prev_cpu[i] = cpu, prev_served[i] = served, prev_wait[i] = wait;
+                line += "[CORE " + std::to_string(i) + "] accepted=" + std::to_string(c.accepted) +
+                        " served=" + std::to_string(served) + " stolen=" + std::to_string(c.stolen) +
+                        " shed=" + std::to_string(c.shed) + " ready=" + std::to_string(c.ready_size) +
+                        " cpu=" + std::to_string((int)busy) + "% ack_us=" + std::to_string(ack_us) + "\n";
+            }
+            if (total == prev_total)
+                continue;
+            double rate = (total - prev_total) / std::chrono::duration<double>(period).count();
+            prev_total = total;
+            ts_print(line, "[CORE] served ", rate, " clients/s on ", cfg.cores, " cores\n");
+        }
+    }
+
+    const char *port;
+    PerCoreConfig cfg;
+    std::string ack_frame;
+    std::vector<std::unique_ptr<Core>> cores;
+};
@@ -1,56 +1,219 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <chrono>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
+#include "perf_common.hpp"
+#include "shm_ring.hpp"
+#include "tcp_info.hpp"
+#include "clock_sync.hpp"
+#include "io_buffers.hpp"
+#include "cpu_cost.hpp"
+#include "intervals.hpp"
+#include "sock_tune.hpp"
+#include "verify.hpp"
 
-// ---------- Message Header ----------
-struct MessageHeader
-{
-    uint64_t send_time_ns;
-    uint32_t payload_size;
-};
+COUNT_HEAP_ALLOCATIONS
 
-// ---------- Time helper ----------
-uint64_t now_ns()
+PerfOptions opts;
+size_t msg_size;
+size_t frag_size = 0; // UDP only: fragment payload size, 0 = only when a message needs it
+// ---------- Stream Client (TCP / UDS / SHM) ----------
+// upload: total_bytes in msg_size messages out of `packet` (header space
+// first, payload already filled in). Returns the bytes sent
+size_t stream_upload(Stream &conn, char *packet, size_t total_bytes, IntervalMeter &iv, PayloadCheck &chk)
 {
-    return std::chrono::duration_cast<std::chrono::nanoseconds>(
-               std::chrono::high_resolution_clock::now().time_since_epoch())
-        .count();
+    size_t sent = 0;
+    for (uint32_t seq = 0; sent < total_bytes; seq++)
+    {
+        uint32_t crc = chk.seal(packet + sizeof(MessageHeader), msg_size, seq);
+        MessageHeader hdr{now_ns(), (uint32_t)msg_size, seq, crc};
+        memcpy(packet, &hdr, sizeof(hdr));
+        if (conn.send_all(packet, sizeof(hdr) + msg_size) <= 0)
+            break;
+        iv.add(hdr.send_time_ns, msg_size);
+        sent += msg_size;
+    }
+    iv.finish();
+    return sent;
 }
 
-// Helper to ensure all bytes are sent
-ssize_t send_all(int sock, const char *buffer, size_t len)
+// download until DONE, into a buffer of cap bytes
+DirectionResult stream_download(Stream &conn, char *payload, size_t cap, IntervalMeter &iv,
+                                PayloadCheck &chk)
 {
-    size_t total_sent = 0;
-    while (total_sent < len)
+    DirectionResult res;
+    while (true)
     {
-        ssize_t n = send(sock, buffer + total_sent, len - total_sent, 0);
-        if (n <= 0)
-            return n;
-        total_sent += n;
+        MessageHeader hdr;
+        if (conn.recv_all((char *)&hdr, sizeof(hdr)) <= 0)
+            break;
+        if (hdr.payload_size == 0)
+            break; // DONE
+        if (chk.recv(conn, hdr, payload, cap) <= 0)
+            break;
+        uint64_t arrival = now_ns();
+        res.add(hdr, arrival);
+        iv.add(arrival, hdr.payload_size);
     }
-    return total_sent;
+    iv.finish();
+    return res;
+}
+
+// "heap allocations in transfer loops: N, buffers on 4k pages"
+std::string alloc_report(const AllocWindow &allocs, const IoBufferPool &bufs)
+{
+    return "heap allocations in transfer loops: " + std::to_string(allocs.total) +
+           ", buffers on " + bufs.backing() + " pages";
 }
 
-// Helper to ensure all bytes are received
-ssize_t recv_all(int sock, char *buffer, size_t len)
+void run_stream(Stream &conn, const char *label, size_t total_kb)
 {
-    size_t total_received = 0;
-    while (total_received < len)
+    size_t total_bytes = total_kb * 1024;
+    IoBufferPool bufs(sizeof(MessageHeader) + msg_size, 2, opts.hugepages);
+    char *packet = bufs.take();  // header written per send
+    char *payload = bufs.take(); // download
+    if (!packet || !payload)
+        return;
+    memset(packet, 'A', bufs.slot_size());
+    PayloadCheck tx(opts), rx(opts); // upload sealed, download checked
+    tx.fill(packet + sizeof(MessageHeader), msg_size);
+    double rx_seconds = 0;
+    AllocWindow allocs;
+    CpuCost cost;
+    uint64_t moved = 0, messages = 0; // both directions, for the cost figures
+    CpuMeter cpu;
+    cpu.start();
+
+    if (opts.autotune_kb)
+    {
+        if (conn.socket_fd() < 0)
+            std::cout << "[" << label << "] autotune: no socket to tune\n";
+        else if (!autotune(conn, conn.socket_fd(), label, msg_size, opts.autotune_kb * 1024, packet,
+                           bufs.slot_size()))
+        {
+            std::cerr << "[" << label << "] autotune probe failed\n";
+            return;
+        }
+    }
+
+    // clock offset before the upload, again after it for the drift
+    ClockSync clock;
+    if (opts.sync_probes && !clock.burst(conn, opts.sync_probes))
+    {
+        std::cerr << "[" << label << "] clock sync failed\n";
+        return;
+    }
+
+    // ----- Upload -----
+    cost.open();
+    IntervalMeter up_iv(label, "upload sent", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    size_t up = stream_upload(conn, packet, total_bytes, up_iv, tx);
+    allocs.close();
+    cost.close();
+    moved += up;
+    messages += up / msg_size;
+    ClockModel model; // client -> server
+    if (opts.sync_probes && clock.burst(conn, opts.sync_probes))
     {
-        ssize_t n = recv(sock, buffer + total_received, len - total_received, 0);
-        if (n <= 0)
-            return n;
-        total_received += n;
+        model = clock.model();
+        MessageHeader mh{now_ns(), SYNC_MODEL};
+        conn.send_all((char *)&mh, sizeof(mh));
+        conn.send_all((char *)&model, sizeof(model));
     }
-    return total_received;
+    // Send DONE
+    MessageHeader done{now_ns(), 0};
+    conn.send_all((char *)&done, sizeof(done));
+
+    // ----- Download -----
+    cost.open();
+    IntervalMeter down_iv(label, "download received", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    DirectionResult down = stream_download(conn, payload, bufs.slot_size(), down_iv, rx);
+    allocs.close();
+    cost.close();
+    moved += down.bytes;
+    messages += down.lat.count;
+    rx_seconds += down.seconds();
+#ifdef TXT
+    std::cout << down.bytes / 1024.0 << " " << down.kb_per_sec() << "\n";
+#else
+    std::cout << "[" << label << "] Download throughput: " << down.kb_per_sec() << " KB/s"
+              << down.lat.report(model.inverse()) << "\n";
+    if (model.valid)
+        std::cout << "[" << label << "] " << clock_report(model) << "\n";
+    up_iv.report();
+    down_iv.report();
+#endif
+
+    // ----- Both at once -----
+    // the download is read on a second thread while this one uploads; the
+    // server reports the upload side
+    if (opts.duplex)
+    {
+        MessageHeader go{now_ns(), DUPLEX_GO};
+        conn.send_all((char *)&go, sizeof(go));
+        DirectionResult both;
+        IntervalMeter dup_up_iv(label, "duplex upload sent", opts.interval_ms, opts.warmup_ms);
+        IntervalMeter dup_down_iv(label, "duplex download received", opts.interval_ms, opts.warmup_ms);
+        std::thread reader([&]()
+                           { both = stream_download(conn, payload, bufs.slot_size(), dup_down_iv, rx); });
+        cost.open();
+        allocs.open();
+        up = stream_upload(conn, packet, total_bytes, dup_up_iv, tx);
+        done.send_time_ns = now_ns();
+        conn.send_all((char *)&done, sizeof(done));
+        reader.join();
+        allocs.close();
+        cost.close();
+        moved += up + both.bytes;
+        messages += up / msg_size + both.lat.count;
+        rx_seconds += both.seconds();
+#ifdef TXT
+        std::cout << both.bytes / 1024.0 << " " << both.kb_per_sec() << "\n";
+#else
+        std::cout << "[" << label << "] Duplex download throughput: " << both.kb_per_sec() << " KB/s"
+                  << both.lat.report(model.inverse()) << "\n"
+                  << "[" << label << "] Duplex download vs alone: " << degradation(down, both) << "\n";
+        dup_up_iv.report();
+        dup_down_iv.report();
+#endif
+    }
+#ifndef TXT
+    std::cout << "[" << label << "] " << cpu.report() << (opts.spin ? ", spinning" : "") << "\n"
+              << "[" << label << "] cost " << cost.report(moved, messages) << "\n"
+              << "[" << label << "] " << alloc_report(allocs, bufs) << "\n";
+    if (tx.enabled())
+        std::cout << "[" << label << "] upload " << tx.report(0) << "\n"
+                  << "[" << label << "] download " << rx.report(rx_seconds) << "\n";
+#endif
 }
-size_t msg_size;
+
+// ---------- TCP_INFO ----------
+
+// writes the sampled series and prints where the connection spent its time
+void report_tcp_info(TcpInfoSampler &sampler, int sock)
+{
+    sampler.stop();
+    if (!opts.tcp_info.empty())
+        sampler.write_csv(opts.tcp_info, "client");
+#ifndef TXT
+    std::cout << "[TCP] " << congestion_control(sock);
+    if (!opts.tcp_info.empty())
+        std::cout << ", " << sampler.summary();
+    std::cout << "\n";
+#else
+    (void)sock;
+#endif
+}
+
 // ---------- TCP Client ----------
 void run_tcp(const char *server_ip, int port, size_t total_kb)
 {
@@ -71,6 +234,15 @@ void run_tcp(const char *server_ip, int port, size_t total_kb)
         return;
     }
 
+    if (!opts.cc.empty() && !set_congestion_control(sockfd, opts.cc))
+    {
+        close(sockfd);
+        return;
+    }
+    // before connect, so the window scale is chosen for the buffer size
+    if (apply_requested_tune(opts, sockfd))
+        std::cout << "[TCP] " << sock_settings(sockfd) << "\n";
+
     if (connect(sockfd, (sockaddr *)&servaddr, sizeof(servaddr)) < 0)
     {
         perror("connect");
@@ -78,62 +250,58 @@ void run_tcp(const char *server_ip, int port, size_t total_kb)
         return;
     }
 
-    size_t total_bytes = total_kb * 1024;
-    std::vector<char> buffer(msg_size);
-    memset(buffer.data(), 'A', msg_size);
+    TcpInfoSampler sampler;
+    if (!opts.tcp_info.empty())
+        sampler.start(sockfd, opts.tcp_info_ms);
+    apply_spin(opts, sockfd);
+    SocketStream conn(sockfd, opts.spin);
+    run_stream(conn, "TCP", total_kb);
+    report_tcp_info(sampler, sockfd);
+    close(sockfd);
+}
 
-    // ----- Upload -----
-    auto start = now_ns();
-    size_t sent = 0;
-    // std::cout << "will send " << total_bytes << std::endl;
-    while (sent < total_bytes)
-    {
-        MessageHeader hdr{now_ns(), (uint32_t)msg_size};
-        std::vector<char> packet(sizeof(hdr) + msg_size);
-        memcpy(packet.data(), &hdr, sizeof(hdr));
-        memcpy(packet.data() + sizeof(hdr), buffer.data(), msg_size);
-        if (send_all(sockfd, packet.data(), packet.size()) <= 0)
-            break;
-        sent += msg_size;
+// ---------- Unix-domain socket Client ----------
+// same host only; the port just selects the socket path
+void run_uds(int port, size_t total_kb)
+{
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return;
     }
-    // Send DONE
-    MessageHeader done{now_ns(), 0};
-    send_all(sockfd, (char *)&done, sizeof(done));
-    auto end = now_ns();
-    double upload_time = (end - start) / 1e9;
-    double upload_tp = (total_bytes / 1024.0) / upload_time; // KB/s
-    // std::cout << "[TCP] Upload throughput: " << upload_tp << " KB/s\n";
 
-    // ----- Download -----
-    size_t received = 0;
-    uint64_t first_recv = 0, last_recv = 0;
-    std::vector<char> recvbuf(msg_size + sizeof(MessageHeader));
-    while (true)
+    sockaddr_un servaddr{};
+    servaddr.sun_family = AF_UNIX;
+    strncpy(servaddr.sun_path, uds_path(port).c_str(), sizeof(servaddr.sun_path) - 1);
+    if (apply_requested_tune(opts, sockfd))
+        std::cout << "[UDS] " << sock_settings(sockfd) << "\n";
+    if (connect(sockfd, (sockaddr *)&servaddr, sizeof(servaddr)) < 0)
     {
-        MessageHeader hdr;
-        if (recv_all(sockfd, (char *)&hdr, sizeof(hdr)) <= 0)
-            break;
-        if (hdr.payload_size == 0)
-            break; // DONE
-        std::vector<char> payload(hdr.payload_size);
-        if (recv_all(sockfd, payload.data(), hdr.payload_size) <= 0)
-            break;
-        if (first_recv == 0)
-            first_recv = now_ns();
-        last_recv = now_ns();
-        received += hdr.payload_size;
-    }
-    double dl_time = (last_recv - first_recv) / 1e9;
-    // std::cout << "client downloaded" << received << "\n";
-    double dl_tp = (received / 1024.0) / dl_time;
-#ifdef TXT
-    std::cout << received / 1024.0 << " " << dl_tp << "\n";
-#else
-    std::cout << "[TCP] Download throughput: " << dl_tp << " KB/s\n";
-#endif
+        perror("connect");
+        close(sockfd);
+        return;
+    }
+
+    apply_spin(opts, sockfd);
+    SocketStream conn(sockfd, opts.spin);
+    run_stream(conn, "UDS", total_kb);
     close(sockfd);
 }
 
+// ---------- Shared-memory Client ----------
+void run_shm(int port, size_t total_kb)
+{
+    ShmStream conn;
+    conn.spin = opts.spin;
+    if (!conn.connect(shm_name(port)))
+    {
+        std::cerr << "shm: no server segment " << shm_name(port) << "\n";
+        return;
+    }
+    run_stream(conn, "SHM", total_kb);
+}
+
 // ---------- UDP Client ----------
 void run_udp(const char *server_ip, int port, size_t total_kb)
 {
@@ -161,68 +329,169 @@ void run_udp(const char *server_ip, int port, size_t total_kb)
     }
 
     size_t total_bytes = total_kb * 1024;
-    std::vector<char> buffer(msg_size);
-    memset(buffer.data(), 'B', msg_size);
-
-    // ----- Upload -----
-    auto start = now_ns();
-    size_t sent = 0;
-    while (sent < total_bytes)
-    {
-        MessageHeader hdr{now_ns(), (uint32_t)msg_size};
-        std::vector<char> packet(sizeof(hdr) + msg_size);
-        memcpy(packet.data(), &hdr, sizeof(hdr));
-        memcpy(packet.data() + sizeof(hdr), buffer.data(), msg_size);
-        sendto(sockfd, packet.data(), packet.size(), 0,
-               (sockaddr *)&servaddr, sizeof(servaddr));
-        sent += msg_size;
+    UdpMessenger udp(sockfd, frag_size, sizeof(MessageHeader) + msg_size);
+    if (opts.autotune_kb)
+        apply_sock_tune(sockfd, SockTune{UDP_AUTOTUNE_BUF, UDP_AUTOTUNE_BUF});
+    if (apply_requested_tune(opts, sockfd) || opts.autotune_kb)
+        std::cout << "[UDP] " << sock_settings(sockfd) << "\n";
+    if (opts.spin)
+    {
+        apply_spin(opts, sockfd);
+        udp.spin(3000);
     }
-    // Send DONE
-    MessageHeader done{now_ns(), 0};
-    sendto(sockfd, &done, sizeof(done), 0, (sockaddr *)&servaddr, sizeof(servaddr));
-    auto end = now_ns();
-    double upload_time = (end - start) / 1e9;
-    double upload_tp = (total_bytes / 1024.0) / upload_time;
+    CpuMeter cpu;
+    cpu.start();
+    IoBufferPool bufs(sizeof(MessageHeader) + msg_size, 1, opts.hugepages);
+    char *packet = bufs.take(); // received messages stay in the messenger's buffers
+    if (!packet)
+    {
+        close(sockfd);
+        return;
+    }
+    memset(packet, 'B', bufs.slot_size());
+    PayloadCheck tx(opts), rx(opts);
+    tx.fill(packet + sizeof(MessageHeader), msg_size);
+    double rx_seconds = 0;
+    AllocWindow allocs;
+    CpuCost cost;
+    uint64_t moved = 0, messages = 0; // both directions, for the cost figures
+
+    auto upload = [&](IntervalMeter &iv)
+    {
+        size_t sent = 0;
+        for (uint32_t seq = 0; sent < total_bytes; seq++)
+        {
+            uint32_t crc = tx.seal(packet + sizeof(MessageHeader), msg_size, seq);
+            MessageHeader hdr{now_ns(), (uint32_t)msg_size, seq, crc};
+            memcpy(packet, &hdr, sizeof(hdr));
+            udp.send(packet, sizeof(hdr) + msg_size, (sockaddr *)&servaddr, sizeof(servaddr));
+            iv.add(hdr.send_time_ns, msg_size);
+            sent += msg_size;
+        }
+        iv.finish();
+        return sent;
+    };
+    // control datagrams go out `copies` times, once the phase is loaded
+    // they are the ones most likely to be dropped
+    auto control = [&](uint32_t what, int copies, uint32_t seq = 0)
+    {
+        MessageHeader ctl{now_ns(), what, seq};
+        for (int i = 0; i < copies; i++)
+            sendto(sockfd, &ctl, sizeof(ctl), 0, (sockaddr *)&servaddr, sizeof(servaddr));
+    };
+    auto download = [&](IntervalMeter &iv)
+    {
+        DirectionResult res;
+        sockaddr_in fromaddr{};
+        socklen_t fromlen = sizeof(fromaddr);
+        uint32_t sent = 0; // from DONE
+        uint64_t first_sent = 0; // send time of the phase's first message
+        while (true)
+        {
+            const char *msg = nullptr;
+            ssize_t n = udp.recv(msg, fromaddr, fromlen);
+            if (n < (ssize_t)sizeof(MessageHeader))
+                break;
+
+            const MessageHeader *hdr = (const MessageHeader *)msg;
+            if (hdr->payload_size == 0 && (!first_sent || hdr->send_time_ns < first_sent))
+                continue; // a spare DONE copy of the previous phase
+            if (hdr->payload_size == 0)
+            {
+                sent = hdr->seq; // DONE
+                break;
+            }
+            uint64_t arrival = now_ns();
+            if (!first_sent)
+                first_sent = hdr->send_time_ns;
+            rx.check(*hdr, msg + sizeof(MessageHeader), n - sizeof(MessageHeader));
+            res.add(*hdr, arrival);
+            iv.add(arrival, hdr->payload_size, hdr->seq);
+        }
+        iv.finish(sent);
+        return res;
+    };
 
-    // std::cout << "[UDP] Upload throughput: " << upload_tp << " KB/s\n";
+    // ----- Upload -----
+    cost.open();
+    IntervalMeter up_iv("UDP", "upload sent", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    size_t up = upload(up_iv);
+    allocs.close();
+    cost.close();
+    moved += up;
+    messages += up / msg_size;
+    control(0, 3, up / msg_size); // DONE with the count sent, spare copies as for the download's
 
     // ----- Download -----
-    size_t received = 0;
-    uint64_t first_recv = 0, last_recv = 0;
-    std::vector<char> recvbuf(msg_size + sizeof(MessageHeader));
-    sockaddr_in fromaddr{};
-    socklen_t fromlen = sizeof(fromaddr);
-    while (true)
-    {
-        ssize_t n = recvfrom(sockfd, recvbuf.data(), recvbuf.size(), 0,
-                             (sockaddr *)&fromaddr, &fromlen);
-        if (n <= 0)
-            break;
+    cost.open();
+    IntervalMeter down_iv("UDP", "download received", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    DirectionResult down = download(down_iv);
+    allocs.close();
+    cost.close();
+    moved += down.bytes;
+    messages += down.lat.count;
+    rx_seconds += down.seconds();
+#ifndef TXT
+    std::cout << "[UDP] Download throughput: " << down.kb_per_sec() << " KB/s\n";
+    up_iv.report();
+    down_iv.report();
+#else
+    std::cout << down.bytes / 1024.0 << " " << down.kb_per_sec() << "\n";
+#endif
 
-        MessageHeader *hdr = (MessageHeader *)recvbuf.data();
-        if (hdr->payload_size == 0)
-            break; // DONE
-        if (first_recv == 0)
-            first_recv = now_ns();
-        last_recv = now_ns();
-        received += hdr->payload_size;
-    }
-    double dl_time = (last_recv - first_recv) / 1e9;
-    double dl_tp = (received / 1024.0) / dl_time;
+    // ----- Both at once -----
+    if (opts.duplex)
+    {
+        DirectionResult both;
+        IntervalMeter dup_up_iv("UDP", "duplex upload sent", opts.interval_ms, opts.warmup_ms);
+        IntervalMeter dup_down_iv("UDP", "duplex download received", opts.interval_ms, opts.warmup_ms);
+        std::thread reader([&]()
+                           { both = download(dup_down_iv); });
+        cost.open();
+        allocs.open();
+        control(DUPLEX_GO, 3);
+        up = upload(dup_up_iv);
+        control(0, 3, up / msg_size);
+        reader.join();
+        allocs.close();
+        cost.close();
+        moved += up + both.bytes;
+        messages += up / msg_size + both.lat.count;
+        rx_seconds += both.seconds();
 #ifndef TXT
-    std::cout << "[UDP] Download throughput: " << dl_tp << " KB/s\n";
+        std::cout << "[UDP] Duplex download throughput: " << both.kb_per_sec() << " KB/s"
+                  << both.lat.report() << "\n"
+                  << "[UDP] Duplex download vs alone: " << degradation(down, both) << "\n";
+        dup_up_iv.report();
+        dup_down_iv.report();
 #else
-    std::cout << received / 1024.0 << " " << dl_tp << "\n";
+        std::cout << both.bytes / 1024.0 << " " << both.kb_per_sec() << "\n";
+#endif
+    }
+#ifndef TXT
+    if (std::string r = udp.report(); !r.empty())
+        std::cout << "[UDP] " << r << "\n";
+    std::cout << "[UDP] " << cpu.report() << (opts.spin ? ", spinning" : "") << "\n"
+              << "[UDP] cost " << cost.report(moved, messages) << "\n"
+              << "[UDP] " << alloc_report(allocs, bufs) << "\n";
+    if (tx.enabled())
+        std::cout << "[UDP] upload " << tx.report(0) << "\n"
+                  << "[UDP] download " << rx.report(rx_seconds) << "\n";
 #endif
     close(sockfd);
 }
 // ---------- Main ----------
 int main(int argc, char *argv[])
 {
-    if (argc < 5)
+    if (!parse_perf_options(argc, argv, opts) || argc < 6)
     {
         std::cerr << "Usage: " << argv[0]
-                  << " <tcp|udp> <server_ip> <port> <msg_sz> <total_kb>\n";
+                  << " <tcp|udp|uds|shm> <server_ip> <port> <msg_sz> <total_kb> [frag_bytes]\n"
+                  << "       " PERF_OPTIONS_USAGE "\n"
+                  << "       (uds and shm are same-host only, the ip is ignored;\n"
+                  << "        udp messages over 64 KB, or all of them with frag_bytes, are fragmented)\n";
         return 1;
     }
 
@@ -231,6 +500,9 @@ int main(int argc, char *argv[])
     int port = std::stoi(argv[3]);
     size_t total_kb = std::stoul(argv[5]);
     msg_size = std::stoul(argv[4]) * 1024;
+    apply_process_options(opts);
+    if (argc > 6)
+        frag_size = std::stoul(argv[6]);
     // Prompt for message size
     if (mode == "tcp")
     {
@@ -242,9 +514,17 @@ int main(int argc, char *argv[])
         // std::cout<<"udp\n";
         run_udp(server_ip, port, total_kb);
     }
+    else if (mode == "uds")
+    {
+        run_uds(port, total_kb);
+    }
+    else if (mode == "shm")
+    {
+        run_shm(port, total_kb);
+    }
     else
     {
-        std::cerr << "Invalid mode: use tcp or udp\n";
+        std::cerr << "Invalid mode: use tcp, udp, uds or shm\n";
         return 1;
     }
     return 0;
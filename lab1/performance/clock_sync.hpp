@@ -0,0 +1,102 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "perf_common.hpp"
+
+// ---------- Clock offset estimation ----------
+// NTP-style: the client sends a probe stamped t1, the server stamps its
+// arrival t2 and its reply t3, the client stamps the reply's arrival t4.
+//   offset = ((t2 - t1) + (t3 - t4)) / 2      (server - client)
+//   delay  = (t4 - t1) - (t3 - t2)
+// Only the minimum-delay probe of a burst is kept, it is the one least
+// disturbed by queueing; the true offset lies within +-delay/2 of it
+// whatever the split between the two directions, which is therefore the
+// error bound. Two bursts (before and after the upload) give the drift,
+// once it exceeds what the error bounds can explain.
+// The probes travel in-band on the stream engine's connection:
+//   probe: MessageHeader{t1, SYNC_PROBE}       -> SyncReply{t1, t2, t3}
+//   model: MessageHeader{now, SYNC_MODEL} + ClockModel (client -> server)
+
+#define SYNC_PROBE 0xFFFFFFFFu // MessageHeader::payload_size values that
+#define SYNC_MODEL 0xFFFFFFFEu // are control messages, not data
+
+struct SyncReply
+{
+    uint64_t t1, t2, t3;
+};
+
+struct SyncSample
+{
+    uint64_t t1, t2, t3, t4;
+    int64_t delay() const { return (int64_t)(t4 - t1) - (int64_t)(t3 - t2); }
+    double offset() const { return ((double)(int64_t)(t2 - t1) + (double)(int64_t)(t3 - t4)) / 2; }
+    uint64_t mid() const { return t1 + (t4 - t1) / 2; }
+};
+
+class ClockSync
+{
+public:
+    // one burst of n ping-pong probes, keeping the best; false on I/O error
+    bool burst(Stream &conn, int n)
+    {
+        SyncSample best{};
+        bool any = false;
+        for (int i = 0; i < n; i++)
+        {
+            MessageHeader probe{now_ns(), SYNC_PROBE};
+            SyncReply r;
+            if (conn.send_all((char *)&probe, sizeof(probe)) <= 0 ||
+                conn.recv_all((char *)&r, sizeof(r)) <= 0)
+                return false;
+            SyncSample s{r.t1, r.t2, r.t3, now_ns()};
+            if (r.t1 != probe.send_time_ns)
+                return false; // out of step with the server
+            if (!any || s.delay() < best.delay())
+                best = s;
+            any = true;
+        }
+        if (any)
+            kept.push_back(best);
+        return true;
+    }
+
+    // client clock -> server clock, from the bursts so far
+    ClockModel model() const
+    {
+        ClockModel m;
+        if (kept.empty())
+            return m;
+        const SyncSample &a = kept.front(), &b = kept.back();
+        m.ref_ns = a.mid();
+        m.offset_ns = a.offset();
+        // a change in offset inside the bursts' error bounds is noise, not drift
+        if (b.mid() > a.mid() && std::abs(b.offset() - a.offset()) > (a.delay() + b.delay()) / 2.0)
+            m.skew = (b.offset() - a.offset()) / (double)(b.mid() - a.mid());
+        m.error_ns = std::max(a.delay(), b.delay()) / 2.0;
+        m.valid = 1;
+        return m;
+    }
+
+private:
+    std::vector<SyncSample> kept;
+};
+
+// server side: answers a probe whose header arrived at t2
+inline bool sync_reply(Stream &conn, const MessageHeader &probe, uint64_t t2)
+{
+    SyncReply r{probe.send_time_ns, t2, now_ns()};
+    return conn.send_all((char *)&r, sizeof(r)) > 0;
+}
+
+// "clock offset X us, drift Y ppm, +- E us"
+inline std::string clock_report(const ClockModel &m)
+{
+    char line[96];
+    snprintf(line, sizeof(line), "clock offset %.1f us, drift %.2f ppm, +- %.1f us",
+             m.offset_ns / 1e3, m.skew * 1e6, m.error_ns / 1e3);
+    return line;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// ---------- CPU cost ----------
+// What a run cost, not just how fast it went: CPU time and context switches
+// from getrusage, and cycles, instructions and cache misses from hardware
+// counters, summed over the same open()/close() windows as AllocWindow and
+// reported per GB moved and per message.
+// The counters count every thread of the process (inherit), a thread's
+// share is added when it exits. perf_event_open needs
+// kernel.perf_event_paranoid <= 1 to include kernel time, where most of a
+// network transfer's cycles go; at 2 only user space is counted and the
+// report says so, above that (or in most containers) there are no counters
+// and only the getrusage figures are printed.
+
+class CpuCost
+{
+public:
+    CpuCost()
+    {
+        static const uint64_t configs[N] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                            PERF_COUNT_HW_CACHE_MISSES};
+        for (int i = 0; i < N; i++)
+        {
+            fds[i] = open_counter(configs[i], false);
+            if (fds[i] < 0 && (fds[i] = open_counter(configs[i], true)) >= 0)
+                user_only = true;
+        }
+    }
+
+    CpuCost(const CpuCost &) = delete;
+    CpuCost &operator=(const CpuCost &) = delete;
+
+    ~CpuCost()
+    {
+        for (int fd : fds)
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    void open()
+    {
+        getrusage(RUSAGE_SELF, &ru0);
+        for (int i = 0; i < N; i++)
+            mark[i] = read_counter(fds[i]);
+    }
+
+    void close()
+    {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        user_s += seconds(ru.ru_utime) - seconds(ru0.ru_utime);
+        sys_s += seconds(ru.ru_stime) - seconds(ru0.ru_stime);
+        switches += (ru.ru_nvcsw - ru0.ru_nvcsw) + (ru.ru_nivcsw - ru0.ru_nivcsw);
+        for (int i = 0; i < N; i++)
+            total[i] += read_counter(fds[i]) - mark[i];
+    }
+
+    // "per GB: 0.41 cpu-s (user 0.10, sys 0.31), 1.2e9 cycles, ... | per message: ..."
+    std::string report(uint64_t bytes, uint64_t messages) const
+    {
+        std::string line;
+        if (bytes)
+            line += "per GB: " + figures(1073741824.0 / bytes, 1);
+        if (messages)
+            line += std::string(bytes ? " | " : "") + "per message: " + figures(1.0 / messages, 1e6);
+        return line.empty() ? "nothing transferred" : line;
+    }
+
+private:
+    enum
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        N
+    };
+
+    static int open_counter(uint64_t config, bool exclude_kernel)
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.inherit = 1;
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    // scaled up for the time the counter was multiplexed out
+    static uint64_t read_counter(int fd)
+    {
+        uint64_t v[3];
+        if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0)
+            return 0;
+        return (uint64_t)((double)v[0] * v[1] / v[2]);
+    }
+
+    static double seconds(const timeval &tv) { return tv.tv_sec + tv.tv_usec / 1e6; }
+
+    // every figure times `scale`; cpu time in seconds times `time_unit`
+    std::string figures(double scale, double time_unit) const
+    {
+        char buf[256];
+        int n = snprintf(buf, sizeof(buf), "%.3g %s (user %.3g, sys %.3g), %.3g ctx-switches",
+                         (user_s + sys_s) * scale * time_unit, time_unit == 1 ? "cpu-s" : "cpu-us",
+                         user_s * scale * time_unit, sys_s * scale * time_unit, switches * scale);
+        if (fds[CYCLES] >= 0)
+            n += snprintf(buf + n, sizeof(buf) - n, ", %.3g cycles", total[CYCLES] * scale);
+        if (fds[INSTRUCTIONS] >= 0)
+            n += snprintf(buf + n, sizeof(buf) - n, ", %.3g instructions", total[INSTRUCTIONS] * scale);
+        if (fds[CYCLES] >= 0 && fds[INSTRUCTIONS] >= 0 && total[CYCLES])
+            n += snprintf(buf + n, sizeof(buf) - n, " (IPC %.2f)", (double)total[INSTRUCTIONS] / total[CYCLES]);
+        if (fds[CACHE_MISSES] >= 0)
+            n += snprintf(buf + n, sizeof(buf) - n, ", %.3g cache-misses", total[CACHE_MISSES] * scale);
+        if (user_only)
+            snprintf(buf + n, sizeof(buf) - n, " [counters user-space only]");
+        return buf;
+    }
+
+    int fds[N];
+    bool user_only = false;
+    uint64_t mark[N] = {}, total[N] = {};
+    rusage ru0{};
+    double user_s = 0, sys_s = 0;
+    uint64_t switches = 0;
+};
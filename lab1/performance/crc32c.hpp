@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// ---------- CRC32C ----------
+// Castagnoli CRC (the one iSCSI, ext4 and SCTP use) with the CPU's CRC
+// instructions where there are some: SSE4.2 crc32 on x86, the ARMv8 CRC
+// extension on arm64, both picked at run time so one binary runs
+// everywhere. Elsewhere slicing-by-8 tables, eight bytes per step.
+// crc32c(0, data) is the standard checksum; passing a previous result as
+// `crc` continues it over the next piece, so a payload read in chunks can
+// be checked chunk by chunk.
+
+namespace crc32c_detail
+{
+constexpr uint32_t POLY = 0x82F63B78u; // reflected 0x1EDC6F41
+
+constexpr std::array<std::array<uint32_t, 256>, 8> make_tables()
+{
+    std::array<std::array<uint32_t, 256>, 8> t{};
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int s = 1; s < 8; s++)
+            t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+    return t;
+}
+
+inline constexpr auto tables = make_tables();
+
+inline uint32_t sw(uint32_t crc, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = ~crc;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8); // little-endian, as the tables assume
+        v ^= c;
+        c = tables[7][v & 0xFF] ^ tables[6][(v >> 8) & 0xFF] ^ tables[5][(v >> 16) & 0xFF] ^
+            tables[4][(v >> 24) & 0xFF] ^ tables[3][(v >> 32) & 0xFF] ^ tables[2][(v >> 40) & 0xFF] ^
+            tables[1][(v >> 48) & 0xFF] ^ tables[0][v >> 56];
+    }
+    while (n--)
+        c = (c >> 8) ^ tables[0][(c ^ *p++) & 0xFF];
+    return ~c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t hw(uint32_t crc, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t c = ~crc;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (n--)
+        c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+
+inline bool hw_available() { return __builtin_cpu_supports("sse4.2"); }
+inline constexpr const char *HW_NAME = "sse4.2";
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) inline uint32_t hw(uint32_t crc, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = ~crc;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    while (n--)
+        c = __crc32cb(c, *p++);
+    return ~c;
+}
+
+inline bool hw_available() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+inline constexpr const char *HW_NAME = "armv8-crc";
+#else
+inline uint32_t hw(uint32_t crc, const void *data, size_t n) { return sw(crc, data, n); }
+inline bool hw_available() { return false; }
+inline constexpr const char *HW_NAME = "none";
+#endif
+
+using Fn = uint32_t (*)(uint32_t, const void *, size_t);
+inline const Fn impl = hw_available() ? hw : sw;
+} // namespace crc32c_detail
+
+inline uint32_t crc32c(uint32_t crc, const void *data, size_t n)
+{
+    return crc32c_detail::impl(crc, data, n);
+}
+
+// "sse4.2", "armv8-crc" or "slicing-by-8"
+inline const char *crc32c_impl_name()
+{
+    return crc32c_detail::impl == crc32c_detail::sw ? "slicing-by-8" : crc32c_detail::HW_NAME;
+}
+
+// ---------- Test payloads ----------
+// Seeded xorshift64* bytes: incompressible, so neither a compressing link
+// nor a lucky constant fill can make corruption look like success, and
+// reproducible from the seed.
+inline void fill_pattern(char *p, size_t n, uint64_t seed)
+{
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1; // never 0
+    for (size_t i = 0; i < n; i += 8)
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        uint64_t v = x * 0x2545F4914F6CDD1Dull;
+        memcpy(p + i, &v, std::min<size_t>(8, n - i));
+    }
+}
@@ -0,0 +1,426 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "perf_common.hpp"
+#include "sock_tune.hpp"
+
+// ---------- One-to-many delivery ----------
+// One sender publishes a numbered stream of UDP messages either to a
+// multicast group (one send per message, the network or the kernel makes
+// the copies) or to N unicast receivers in turn (N sends per message).
+// Every receiver reports what it got: throughput, loss from the sequence
+// numbers and one-way latency. The sender reports its CPU time per
+// message, which is where the two ways of fanning out differ.
+//   local: sender and N receiver threads in this process, on loopback;
+//          --scale repeats it for 1, 2, 4 ... N receivers and prints how
+//          sender cost and receiver loss grow
+//   send / recv: the two halves as separate processes or hosts. Unicast
+//          receiver i listens on port + i; multicast on one host needs
+//          --if=127.0.0.1 on both sides; across hosts the latencies carry
+//          the clock offset between them
+// The closing DONE (payload_size 0) goes out three times and carries the
+// number of messages sent in seq, so a receiver can count losses at the
+// tail. A receiver that hears nothing for RECV_IDLE_S gives up.
+
+#define RECV_IDLE_S 2
+
+struct FanoutOptions
+{
+    std::string group = "239.1.2.3"; // --group=ADDR
+    std::string iface;               // --if=ADDR: multicast interface, local defaults to 127.0.0.1
+    double rate_MBps = 0;            // --rate=MB/s: publication rate, 0 = as fast as it goes
+    bool scale = false;              // --scale: local runs for 1, 2, 4 ... receivers
+    uint32_t rcvbuf = 8u << 20;      // --rcvbuf=B: per receiver
+    int ttl = 1;                     // --ttl=N: multicast hops
+};
+
+FanoutOptions fo;
+
+bool parse_fanout_options(int &argc, char **argv)
+{
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto value = [&](const char *name)
+        { return arg.substr(strlen(name)); };
+        if (arg.rfind("--", 0) != 0)
+            argv[kept++] = argv[i];
+        else if (arg.rfind("--group=", 0) == 0)
+            fo.group = value("--group=");
+        else if (arg.rfind("--if=", 0) == 0)
+            fo.iface = value("--if=");
+        else if (arg.rfind("--rate=", 0) == 0)
+            fo.rate_MBps = std::max(0.0, std::stod(value("--rate=")));
+        else if (arg == "--scale")
+            fo.scale = true;
+        else if (arg.rfind("--rcvbuf=", 0) == 0)
+            fo.rcvbuf = std::stoul(value("--rcvbuf="));
+        else if (arg.rfind("--ttl=", 0) == 0)
+            fo.ttl = std::max(0, std::stoi(value("--ttl=")));
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    argc = kept;
+    return true;
+}
+
+in_addr parse_addr(const std::string &s)
+{
+    in_addr a{};
+    if (s.empty())
+        a.s_addr = htonl(INADDR_ANY);
+    else if (inet_pton(AF_INET, s.c_str(), &a) <= 0)
+        fprintf(stderr, "bad address %s\n", s.c_str());
+    return a;
+}
+
+// ---------- Receiver ----------
+struct ReceiverResult
+{
+    DirectionResult res;
+    uint64_t received = 0, expected = 0; // expected from DONE, else the highest seq + 1
+    uint64_t cpu_ns = 0;                 // this receiver's thread
+    bool done = false;                   // DONE arrived
+
+    uint64_t lost() const { return expected > received ? expected - received : 0; }
+    double loss_pct() const { return expected ? lost() * 100.0 / expected : 0; }
+};
+
+// a bound socket for one receiver: the group's port (shared with the other
+// members) for multicast, port itself for unicast; -1 on error
+int open_receiver(bool mcast, in_addr bind_addr, int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); // group members share the port
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = mcast ? parse_addr(fo.group) : bind_addr; // bound to the group: only its traffic
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (mcast)
+    {
+        ip_mreq mreq{};
+        mreq.imr_multiaddr = parse_addr(fo.group);
+        mreq.imr_interface = parse_addr(fo.iface);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        {
+            perror("IP_ADD_MEMBERSHIP");
+            close(fd);
+            return -1;
+        }
+    }
+    set_buffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, fo.rcvbuf);
+    timeval tv{RECV_IDLE_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// until DONE, or RECV_IDLE_S of silence once the stream has started
+// (before it only if !wait_first)
+ReceiverResult receive_stream(int fd, bool wait_first)
+{
+    ReceiverResult r;
+    std::vector<char> buf(UDP_MAX_DATAGRAM + 1);
+    uint64_t cpu0 = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t next_seq = 0;
+    while (true)
+    {
+        ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_first && r.received == 0)
+            continue;
+        if (n < (ssize_t)sizeof(MessageHeader))
+            break; // idle, or an error
+        const MessageHeader *hdr = (const MessageHeader *)buf.data();
+        if (hdr->payload_size == 0)
+        {
+            r.done = true;
+            r.expected = std::max<uint64_t>(hdr->seq, next_seq);
+            break;
+        }
+        r.res.add(*hdr, now_ns());
+        r.received++;
+        next_seq = std::max<uint64_t>(next_seq, (uint64_t)hdr->seq + 1);
+    }
+    if (!r.done)
+        r.expected = next_seq;
+    r.cpu_ns = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    return r;
+}
+
+void print_receiver(int i, const ReceiverResult &r)
+{
+    printf("[fanout] receiver %d: %.1f KB, %.1f KB/s, lost %llu of %llu (%.2f%%)%s%s, cpu %.2f us/msg\n", i,
+           r.res.bytes / 1024.0, r.received > 1 ? r.res.kb_per_sec() : 0, (unsigned long long)r.lost(),
+           (unsigned long long)r.expected, r.loss_pct(), r.done ? "" : ", no DONE",
+           r.res.lat.report().c_str(), r.received ? r.cpu_ns / 1e3 / r.received : 0);
+}
+
+// ---------- Sender ----------
+struct SenderResult
+{
+    uint64_t messages = 0, sends = 0;
+    double seconds = 0;
+    uint64_t cpu_ns = 0;
+};
+
+// publishes total_bytes of msg_size payloads to every destination (one
+// for multicast), paced to --rate, then DONE
+SenderResult publish(int fd, const std::vector<sockaddr_in> &dests, size_t msg_size, size_t total_bytes)
+{
+    SenderResult s;
+    std::vector<char> packet(sizeof(MessageHeader) + msg_size, 'F');
+    double rate_Bps = fo.rate_MBps * 1e6;
+    uint64_t cpu0 = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t t0 = now_ns();
+    for (size_t sent = 0; sent < total_bytes; sent += msg_size)
+    {
+        if (rate_Bps > 0)
+        {
+            uint64_t due = t0 + (uint64_t)(sent / rate_Bps * 1e9), now = now_ns();
+            if (due > now + 20000) // sleeping, not spinning: the CPU figure stays the sends'
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        MessageHeader hdr{now_ns(), (uint32_t)msg_size, (uint32_t)s.messages};
+        memcpy(packet.data(), &hdr, sizeof(hdr));
+        for (const sockaddr_in &to : dests)
+        {
+            sendto(fd, packet.data(), packet.size(), 0, (const sockaddr *)&to, sizeof(to));
+            s.sends++;
+        }
+        s.messages++;
+    }
+    s.seconds = (now_ns() - t0) / 1e9;
+    s.cpu_ns = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    MessageHeader done{now_ns(), 0, (uint32_t)s.messages};
+    for (int copy = 0; copy < 3; copy++)
+        for (const sockaddr_in &to : dests)
+            sendto(fd, &done, sizeof(done), 0, (const sockaddr *)&to, sizeof(to));
+    return s;
+}
+
+// a sender socket and its destinations: the group, or host:port+i
+int open_sender(bool mcast, int receivers, const char *host, int port, std::vector<sockaddr_in> &dests)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (mcast)
+    {
+        in_addr ifaddr = parse_addr(fo.iface);
+        unsigned char ttl = fo.ttl, loop = 1;
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0)
+            perror("IP_MULTICAST_IF");
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)); // members on this host
+    }
+    dests.clear();
+    for (int i = 0; i < (mcast ? 1 : receivers); i++)
+    {
+        sockaddr_in to{};
+        to.sin_family = AF_INET;
+        to.sin_port = htons(port + (mcast ? 0 : i));
+        to.sin_addr = parse_addr(mcast ? fo.group : host);
+        dests.push_back(to);
+    }
+    return fd;
+}
+
+void print_sender(bool mcast, int receivers, const SenderResult &s, size_t msg_size)
+{
+    double kb = s.messages * msg_size / 1024.0;
+    printf("[fanout] sender (%s to %d): %llu messages, %llu sends, %.1f KB in %.3f s => %.1f KB/s published, "
+           "cpu %.3f s = %.2f us/message, %.3f cpu-s per GB published\n",
+           mcast ? "multicast" : "unicast", receivers, (unsigned long long)s.messages,
+           (unsigned long long)s.sends, kb, s.seconds, s.seconds > 0 ? kb / s.seconds : 0, s.cpu_ns / 1e9,
+           s.messages ? s.cpu_ns / 1e3 / s.messages : 0, kb ? s.cpu_ns / 1e9 / (kb / 1048576) : 0);
+}
+
+// ---------- Local runs ----------
+struct RunSummary
+{
+    int receivers;
+    SenderResult sender;
+    double recv_kbps = 0, loss_avg = 0, loss_max = 0, lat_avg_us = 0;
+};
+
+bool run_local(bool mcast, int receivers, int port, size_t msg_size, size_t total_bytes, RunSummary &sum)
+{
+    in_addr lo = parse_addr("127.0.0.1");
+    std::vector<int> fds;
+    for (int i = 0; i < receivers; i++)
+    {
+        int fd = open_receiver(mcast, lo, port + (mcast ? 0 : i));
+        if (fd < 0)
+        {
+            for (int f : fds)
+                close(f);
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    std::vector<sockaddr_in> dests;
+    int out = open_sender(mcast, receivers, "127.0.0.1", port, dests);
+    if (out < 0)
+    {
+        for (int f : fds)
+            close(f);
+        return false;
+    }
+    std::vector<ReceiverResult> results(receivers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < receivers; i++)
+        threads.emplace_back([&, i]()
+                             { results[i] = receive_stream(fds[i], false); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20)); // receivers into recv()
+    sum.receivers = receivers;
+    sum.sender = publish(out, dests, msg_size, total_bytes);
+    for (std::thread &t : threads)
+        t.join();
+    close(out);
+    for (int f : fds)
+        close(f);
+
+    printf("[fanout] %s, %d receiver%s, %zu B messages\n", mcast ? "multicast" : "unicast", receivers,
+           receivers == 1 ? "" : "s", msg_size);
+    print_sender(mcast, receivers, sum.sender, msg_size);
+    for (int i = 0; i < receivers; i++)
+    {
+        const ReceiverResult &r = results[i];
+        print_receiver(i, r);
+        sum.recv_kbps += r.received > 1 ? r.res.kb_per_sec() / receivers : 0;
+        sum.loss_avg += r.loss_pct() / receivers;
+        sum.loss_max = std::max(sum.loss_max, r.loss_pct());
+        sum.lat_avg_us += r.res.lat.avg_us() / receivers;
+    }
+    return true;
+}
+
+// how sender cost and receiver loss grow with the receivers, against the
+// first (smallest) run
+void print_scaling(bool mcast, const std::vector<RunSummary> &runs, size_t msg_size)
+{
+    if (runs.empty())
+        return;
+    auto cpu_per_msg = [](const SenderResult &s)
+    { return s.messages ? (double)s.cpu_ns / s.messages : 0.0; };
+    double base = cpu_per_msg(runs.front().sender);
+    printf("[fanout] %s scaling, sender cost against %d receiver%s:\n"
+           "  receivers  sender us/msg        published KB/s  per-receiver KB/s  loss avg  loss max  latency avg us\n",
+           mcast ? "multicast" : "unicast", runs.front().receivers, runs.front().receivers == 1 ? "" : "s");
+    for (const RunSummary &r : runs)
+    {
+        double cpu = cpu_per_msg(r.sender);
+        double published = r.sender.seconds > 0 ? r.sender.messages * msg_size / 1024.0 / r.sender.seconds : 0;
+        printf("  %9d  %8.2f (%5.2fx)  %14.1f  %17.1f  %7.2f%%  %7.2f%%  %14.1f\n", r.receivers, cpu / 1e3,
+               base > 0 ? cpu / base : 0, published, r.recv_kbps, r.loss_avg, r.loss_max, r.lat_avg_us);
+    }
+}
+
+// ---------- Main ----------
+int main(int argc, char *argv[])
+{
+    if (!parse_fanout_options(argc, argv) || argc < 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " local <mcast|unicast> <receivers> <port> <msg_bytes> <total_kb>\n"
+                  << "       " << argv[0] << " send <mcast|unicast> <receivers> <port> <msg_bytes> <total_kb> [host]\n"
+                  << "       " << argv[0] << " recv <mcast|unicast> <port>\n"
+                  << "       [--group=ADDR] [--if=ADDR] [--rate=MB/s] [--scale] [--rcvbuf=B] [--ttl=N]\n"
+                  << "       (unicast receiver i listens on port + i; --scale is for local runs)\n";
+        return 1;
+    }
+    std::string role = argv[1], kind = argv[2];
+    if (kind != "mcast" && kind != "unicast")
+    {
+        std::cerr << "Invalid kind: use mcast or unicast\n";
+        return 1;
+    }
+    bool mcast = kind == "mcast";
+
+    if (role == "recv")
+    {
+        int fd = open_receiver(mcast, parse_addr(""), std::stoi(argv[3]));
+        if (fd < 0)
+            return 1;
+        std::cout << "[fanout] receiving on port " << argv[3] << (mcast ? " from " + fo.group : "") << std::endl;
+        ReceiverResult r = receive_stream(fd, true);
+        print_receiver(0, r);
+        close(fd);
+        return 0;
+    }
+
+    if (argc < 7)
+    {
+        std::cerr << "missing arguments, run without any for the usage\n";
+        return 1;
+    }
+    int receivers = std::max(1, std::stoi(argv[3]));
+    int port = std::stoi(argv[4]);
+    size_t msg_size = std::max(1ul, std::stoul(argv[5]));
+    size_t total_bytes = std::stoul(argv[6]) * 1024;
+    if (sizeof(MessageHeader) + msg_size > UDP_MAX_DATAGRAM)
+    {
+        std::cerr << "messages are single datagrams, at most " << UDP_MAX_DATAGRAM - sizeof(MessageHeader)
+                  << " bytes\n";
+        return 1;
+    }
+
+    if (role == "send")
+    {
+        std::vector<sockaddr_in> dests;
+        int fd = open_sender(mcast, receivers, argc > 7 ? argv[7] : "127.0.0.1", port, dests);
+        if (fd < 0)
+            return 1;
+        print_sender(mcast, receivers, publish(fd, dests, msg_size, total_bytes), msg_size);
+        close(fd);
+        return 0;
+    }
+    if (role != "local")
+    {
+        std::cerr << "Invalid role: use local, send or recv\n";
+        return 1;
+    }
+
+    if (fo.iface.empty())
+        fo.iface = "127.0.0.1";
+    std::vector<int> counts;
+    for (int n = fo.scale ? 1 : receivers; n < receivers; n *= 2)
+        counts.push_back(n);
+    counts.push_back(receivers);
+    std::vector<RunSummary> runs;
+    for (int n : counts)
+    {
+        RunSummary sum;
+        if (!run_local(mcast, n, port, msg_size, total_bytes, sum))
+            return 1;
+        runs.push_back(sum);
+    }
+    print_scaling(mcast, runs, msg_size);
+    return 0;
+}
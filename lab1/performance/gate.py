@@ -0,0 +1,156 @@
+"""Regression gate: compares a candidate result set with a baseline.
+
+A result set is a directory of repeated runs in the layout the test
+directories here use: <series><run>.txt (rc1.txt ... rc10.txt,
+rs1.txt ...), each line "<point> <value>" where the point is the run's
+parameter (message size, index). Files without a run number (the rc.txt
+averages) are ignored.
+
+For every series and point present on both sides the runs are compared
+with a two-sided Mann-Whitney U test (normal approximation with tie and
+continuity correction), p-values are Holm-corrected over all points, and
+the effect size is Cliff's delta. A point regresses when the change is
+significant, the effect at least --min-effect and the median worse by at
+least --min-change percent. Throughput series are better higher, series
+matching --lower-better (latency) better lower.
+
+    python3 gate.py BASELINE_DIR CANDIDATE_DIR [--alpha 0.05] ...
+
+Exit status: 0 no regression, 1 regression, 2 nothing to compare.
+"""
+import argparse
+import fnmatch
+import math
+import os
+import re
+import sys
+
+RUN_FILE = re.compile(r"^(.*?)(\d+)\.txt$")
+
+
+def load(directory):
+    """{series: {point: [values, one per run]}}"""
+    sets = {}
+    for name in sorted(os.listdir(directory)):
+        m = RUN_FILE.match(name)
+        if not m:
+            continue
+        series = sets.setdefault(m.group(1), {})
+        with open(os.path.join(directory, name), "r") as f:
+            for line in f:
+                parts = line.strip().split()
+                if len(parts) != 2:
+                    continue
+                try:
+                    point, val = float(parts[0]), float(parts[1])
+                except ValueError:
+                    continue
+                key = int(point) if point.is_integer() else point
+                series.setdefault(key, []).append(val)
+    return sets
+
+
+def median(vals):
+    s = sorted(vals)
+    n = len(s)
+    return s[n // 2] if n % 2 else (s[n // 2 - 1] + s[n // 2]) / 2
+
+
+def mann_whitney(a, b):
+    """(U of a, two-sided p)"""
+    n1, n2 = len(a), len(b)
+    pooled = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    ranks = [0.0] * len(pooled)
+    ties = 0.0
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j + 1 < len(pooled) and pooled[j + 1][0] == pooled[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+    r1 = sum(r for r, (_, side) in zip(ranks, pooled) if side == 0)
+    u1 = r1 - n1 * (n1 + 1) / 2
+    n = n1 + n2
+    var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return u1, 1.0  # every value the same
+    z = (abs(u1 - n1 * n2 / 2) - 0.5) / math.sqrt(var)
+    return u1, min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+
+def cliffs_delta(a, b):
+    """P(b > a) - P(b < a): +1 when every candidate run beats the baseline"""
+    gt = sum(1 for x in a for y in b if y > x)
+    lt = sum(1 for x in a for y in b if y < x)
+    return (gt - lt) / (len(a) * len(b))
+
+
+def holm(pvals):
+    order = sorted(range(len(pvals)), key=lambda i: pvals[i])
+    adj = [1.0] * len(pvals)
+    running = 0.0
+    for rank, i in enumerate(order):
+        running = max(running, min(1.0, (len(pvals) - rank) * pvals[i]))
+        adj[i] = running
+    return adj
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Compare a candidate result set with a baseline.")
+    ap.add_argument("baseline")
+    ap.add_argument("candidate")
+    ap.add_argument("--alpha", type=float, default=0.05, help="significance after Holm correction")
+    ap.add_argument("--min-effect", type=float, default=0.33,
+                    help="smallest |Cliff's delta| that counts (0.33 is a medium effect)")
+    ap.add_argument("--min-change", type=float, default=5.0,
+                    help="smallest change of the median that counts, percent")
+    ap.add_argument("--lower-better", default="*lat*",
+                    help="glob of series where lower values are better")
+    ap.add_argument("--series", default="*", help="glob of series to compare")
+    args = ap.parse_args()
+
+    base, cand = load(args.baseline), load(args.candidate)
+    rows = []
+    for series in sorted(set(base) & set(cand)):
+        if not fnmatch.fnmatch(series, args.series):
+            continue
+        lower = fnmatch.fnmatch(series, args.lower_better)
+        for point in sorted(set(base[series]) & set(cand[series])):
+            a, b = base[series][point], cand[series][point]
+            _, p = mann_whitney(a, b)
+            rows.append([series, point, a, b, p, cliffs_delta(a, b), lower])
+    if not rows:
+        print("no series/points in common", file=sys.stderr)
+        return 2
+
+    regressions = 0
+    print(f"{'series':<8} {'point':>8} {'runs':>7} {'base med':>12} {'cand med':>12} "
+          f"{'change':>8} {'p(holm)':>8} {'delta':>6}  verdict")
+    for row, p_adj in zip(rows, holm([r[4] for r in rows])):
+        series, point, a, b, _, delta, lower = row
+        mb, mc = median(a), median(b)
+        change = (mc - mb) / mb * 100 if mb else 0.0
+        worse = -change if not lower else change  # percent, positive = worse
+        effect = -delta if not lower else delta  # positive = worse
+        if min(len(a), len(b)) < 3:
+            verdict = "too few runs"
+        elif p_adj < args.alpha and effect >= args.min_effect and worse >= args.min_change:
+            verdict = "REGRESSION"
+            regressions += 1
+        elif p_adj < args.alpha and -effect >= args.min_effect and -worse >= args.min_change:
+            verdict = "improved"
+        else:
+            verdict = "ok"
+        print(f"{series:<8} {point:>8} {len(a):>3}/{len(b):<3} {mb:>12.6g} {mc:>12.6g} "
+              f"{change:>+7.1f}% {p_adj:>8.3g} {delta:>+6.2f}  {verdict}")
+
+    print(f"{regressions} regression(s) in {len(rows)} points")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
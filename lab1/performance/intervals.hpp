@@ -0,0 +1,159 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "perf_common.hpp"
+
+// ---------- Interval reports ----------
+// One rate over a whole transfer hides slow start, receive-buffer stalls
+// and bursts of UDP loss. An IntervalMeter sits in a send or receive loop
+// and prints a line per period: bytes, rate, messages and, on a receiver
+// of sequenced messages, how many went missing. A period in which nothing
+// moved still gets its line, a stall shows up as a run of zeros.
+// The summary leaves out the warmup and gives the mean rate of the full
+// periods after it with their spread.
+// Lines go out with printf from a stack buffer, the loops stay free of
+// heap allocations.
+
+class IntervalMeter
+{
+public:
+    // period_ms 0 turns the meter off; warmup_ms < 0 means one period
+    IntervalMeter(const char *label, const char *what, int period_ms, int warmup_ms)
+        : label(label), what(what), period_ns((uint64_t)period_ms * 1000000),
+          warmup_ns(warmup_ms < 0 ? period_ns : (uint64_t)warmup_ms * 1000000) {}
+
+    bool enabled() const { return period_ns != 0; }
+
+    // a message sent, or received without sequence numbers
+    void add(uint64_t now, size_t bytes)
+    {
+        if (!period_ns)
+            return;
+        advance(now);
+        cur_bytes += bytes;
+        cur_msgs++;
+        last = now;
+    }
+
+    // a received message carrying MessageHeader::seq
+    void add(uint64_t now, size_t bytes, uint32_t seq)
+    {
+        if (!period_ns)
+            return;
+        add(now, bytes);
+        sequenced = true;
+        if (seq >= next_seq)
+        {
+            cur_lost += seq - next_seq;
+            next_seq = seq + 1;
+        }
+        else if (lost_total + cur_lost > 0)
+            cur_lost--; // late, it was counted as lost (the period may go negative)
+    }
+
+    // closes the last, partial period at the last message, so the idle
+    // time before DONE (clock probes, say) is not reported as a stall.
+    // `sent`, the count a UDP DONE carries, makes the messages lost after
+    // the last one received count too
+    void finish(uint32_t sent = 0)
+    {
+        if (!period_ns)
+            return;
+        if (sent > next_seq)
+        {
+            cur_lost += sent - next_seq;
+            next_seq = sent;
+            sequenced = true;
+        }
+        if (t0 && last > edge - period_ns)
+            emit(last - (edge - period_ns));
+        lost_total += cur_lost;
+        cur_lost = 0;
+    }
+
+    // prints the summary if the meter is on
+    void report() const
+    {
+        if (period_ns)
+            printf("%s\n", summary().c_str());
+    }
+
+    // "steady state after 100 ms: 8 periods, mean X KB/s, stddev Y (Z%), min A, max B"
+    std::string summary() const
+    {
+        char line[224];
+        int n = snprintf(line, sizeof(line), "[%s] %s steady state after %.0f ms: ", label, what,
+                         warmup_ns / 1e6);
+        if (steady < 2)
+            n += snprintf(line + n, sizeof(line) - n, "%llu full periods, too short to tell",
+                          (unsigned long long)steady);
+        else
+        {
+            double sd = std::sqrt(m2 / (steady - 1));
+            n += snprintf(line + n, sizeof(line) - n,
+                          "%llu periods, mean %.1f KB/s, stddev %.1f (%.1f%%), min %.1f, max %.1f",
+                          (unsigned long long)steady, mean, sd, mean > 0 ? sd / mean * 100 : 0,
+                          min_rate, max_rate);
+        }
+        if (sequenced)
+            snprintf(line + n, sizeof(line) - n, "; lost %lld of %llu (%.2f%%)",
+                     (long long)lost_total, (unsigned long long)next_seq,
+                     next_seq ? lost_total * 100.0 / next_seq : 0);
+        return line;
+    }
+
+private:
+    // emits every period that ended before `now`
+    void advance(uint64_t now)
+    {
+        if (!t0)
+        {
+            t0 = now;
+            edge = now + period_ns;
+        }
+        while (now >= edge)
+        {
+            emit(period_ns);
+            edge += period_ns;
+        }
+    }
+
+    void emit(uint64_t len_ns)
+    {
+        uint64_t start = edge - period_ns - t0;
+        double rate = (cur_bytes / 1024.0) / (len_ns / 1e9);
+        char line[160];
+        int n = snprintf(line, sizeof(line), "[%s] %s %7.3f-%7.3f s %10.1f KB %12.1f KB/s %8llu msgs",
+                         label, what, start / 1e9, (start + len_ns) / 1e9, cur_bytes / 1024.0, rate,
+                         (unsigned long long)cur_msgs);
+        if (sequenced)
+            snprintf(line + n, sizeof(line) - n, " %6lld lost", (long long)cur_lost);
+        printf("%s\n", line);
+        // full periods past the warmup feed the summary (Welford)
+        if (len_ns == period_ns && start >= warmup_ns)
+        {
+            steady++;
+            double d = rate - mean;
+            mean += d / steady;
+            m2 += d * (rate - mean);
+            min_rate = steady == 1 ? rate : std::min(min_rate, rate);
+            max_rate = std::max(max_rate, rate);
+        }
+        lost_total += cur_lost;
+        cur_bytes = cur_msgs = 0;
+        cur_lost = 0;
+    }
+
+    const char *label, *what;
+    uint64_t period_ns, warmup_ns;
+    uint64_t t0 = 0, edge = 0, last = 0;
+    uint64_t cur_bytes = 0, cur_msgs = 0;
+    int64_t cur_lost = 0, lost_total = 0;
+    uint32_t next_seq = 0;
+    bool sequenced = false;
+    uint64_t steady = 0;
+    double mean = 0, m2 = 0, min_rate = 0, max_rate = 0;
+};
@@ -0,0 +1,139 @@
+#pragma once
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// ---------- I/O buffer pool ----------
+// Every buffer a transfer loop touches comes out of one mapping made before
+// the run: slots of a fixed size, page aligned, prefaulted, and backed by
+// huge pages when asked for (explicit hugetlb pages if the system has some
+// reserved, transparent huge pages otherwise). The loops then run without
+// the heap and without page faults.
+
+class IoBufferPool
+{
+public:
+    IoBufferPool(size_t slot_bytes, size_t slots, bool huge = false)
+        : slot(round_up(std::max<size_t>(slot_bytes, 1), 4096))
+    {
+        len = slot * slots;
+        if (huge)
+        {
+            len = round_up(len, HUGE_PAGE);
+            base = map(len, MAP_HUGETLB);
+            if (base)
+                kind = "hugetlb";
+        }
+        if (!base)
+        {
+            base = map(len, 0);
+            if (base && huge && madvise(base, len, MADV_HUGEPAGE) == 0)
+                kind = "thp";
+        }
+        if (!base)
+        {
+            perror("mmap I/O buffers");
+            return;
+        }
+        free_slots.reserve(slots);
+        for (size_t i = slots; i-- > 0;)
+            free_slots.push_back(base + i * slot);
+    }
+
+    IoBufferPool(const IoBufferPool &) = delete;
+    IoBufferPool &operator=(const IoBufferPool &) = delete;
+
+    ~IoBufferPool()
+    {
+        if (base)
+            munmap(base, len);
+    }
+
+    // a slot of slot_size() bytes, nullptr when all are taken
+    char *take()
+    {
+        if (free_slots.empty())
+            return nullptr;
+        char *p = free_slots.back();
+        free_slots.pop_back();
+        return p;
+    }
+
+    void give(char *p) { free_slots.push_back(p); } // capacity reserved up front
+
+    size_t slot_size() const { return slot; }
+    // "hugetlb", "thp" or "4k"
+    const char *backing() const { return kind; }
+
+private:
+    static constexpr size_t HUGE_PAGE = 2u << 20;
+
+    static size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+    static char *map(size_t n, int extra)
+    {
+        void *p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | extra, -1, 0);
+        return p == MAP_FAILED ? nullptr : (char *)p;
+    }
+
+    size_t slot, len = 0;
+    char *base = nullptr;
+    const char *kind = "4k";
+    std::vector<char *> free_slots;
+};
+
+// ---------- Allocation accounting ----------
+// Counts every operator new of the process. The replacement operators can
+// only be defined once per program, so the file with main() expands
+// COUNT_HEAP_ALLOCATIONS at namespace scope; without it the count stays 0.
+// (GCC takes the free() in the replaced deletes for a mismatch once they
+// are inlined next to a new, hence the pragma.)
+
+inline std::atomic<uint64_t> heap_allocation_count{0};
+
+#define COUNT_HEAP_ALLOCATIONS                                                              \
+    _Pragma("GCC diagnostic push")                                                          \
+    _Pragma("GCC diagnostic ignored \"-Wmismatched-new-delete\"")                         \
+    void *operator new(size_t n)                                                            \
+    {                                                                                       \
+        heap_allocation_count.fetch_add(1, std::memory_order_relaxed);                      \
+        if (void *p = malloc(n ? n : 1))                                                    \
+            return p;                                                                       \
+        throw std::bad_alloc();                                                             \
+    }                                                                                       \
+    void *operator new[](size_t n) { return operator new(n); }                              \
+    void *operator new(size_t n, std::align_val_t al)                                       \
+    {                                                                                       \
+        heap_allocation_count.fetch_add(1, std::memory_order_relaxed);                      \
+        size_t a = (size_t)al;                                                              \
+        if (void *p = aligned_alloc(a, (std::max<size_t>(n, 1) + a - 1) / a * a))           \
+            return p;                                                                       \
+        throw std::bad_alloc();                                                             \
+    }                                                                                       \
+    void *operator new[](size_t n, std::align_val_t al) { return operator new(n, al); }     \
+    void operator delete(void *p) noexcept { free(p); }                                     \
+    void operator delete[](void *p) noexcept { free(p); }                                   \
+    void operator delete(void *p, size_t) noexcept { free(p); }                             \
+    void operator delete[](void *p, size_t) noexcept { free(p); }                           \
+    void operator delete(void *p, std::align_val_t) noexcept { free(p); }                   \
+    void operator delete[](void *p, std::align_val_t) noexcept { free(p); }                 \
+    void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }           \
+    void operator delete[](void *p, size_t, std::align_val_t) noexcept { free(p); }         \
+    _Pragma("GCC diagnostic pop")
+
+// Allocations made inside the measured parts of a run: open() before a
+// transfer loop, close() after it, as often as there are loops.
+struct AllocWindow
+{
+    uint64_t total = 0, mark = 0;
+
+    void open() { mark = heap_allocation_count.load(std::memory_order_relaxed); }
+    void close() { total += heap_allocation_count.load(std::memory_order_relaxed) - mark; }
+};
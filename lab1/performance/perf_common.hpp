@@ -0,0 +1,409 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../fragment.hpp"
+#include "../busy_poll.hpp"
+
+// ---------- Options ----------
+// `--name=value` flags shared by client and server. They are taken out of
+// argv so the positional arguments keep their places.
+struct PerfOptions
+{
+    std::string tcp_info; // --tcp-info=FILE: TCP_INFO time series, CSV
+    int tcp_info_ms = 100; // --tcp-info-ms=N: sampling period
+    std::string cc;       // --cc=ALGO: congestion control for this run
+    int sync_probes = 16; // --sync=N: clock probes per burst, 0 assumes a shared clock
+    bool spin = false;    // --spin[=US]: busy-poll receives, US is the SO_BUSY_POLL budget
+    int busy_poll_us = 50;
+    int cpu = -1;         // --cpu=N: pin the transfer thread
+    bool mlock = false;   // --mlock: lock memory before the transfer
+    bool duplex = false;  // --duplex: after the usual run, both directions at once
+    bool hugepages = false; // --hugepages: back the I/O buffers with huge pages
+    int interval_ms = 0;  // --interval=MS: per-period reports from sender and receiver
+    int warmup_ms = -1;   // --warmup=MS: left out of the steady-state summary, default one period
+    uint32_t sndbuf = 0, rcvbuf = 0; // --sndbuf=B --rcvbuf=B: socket buffers (sock_tune.hpp)
+    uint32_t notsent_lowat = 0;      // --notsent-lowat=B: TCP unsent backlog
+    bool nodelay = false;            // --nodelay: TCP_NODELAY
+    size_t autotune_kb = 0;          // --autotune[=PROBE_KB]: buffers and options from a BDP probe
+    bool verify = false;             // --verify[=SEED]: seeded payloads, CRC32C checked (verify.hpp)
+    uint64_t verify_seed = 1;
+};
+
+#define PERF_OPTIONS_USAGE "[--tcp-info=FILE] [--tcp-info-ms=N] [--cc=ALGO] [--sync=N]\n" \
+                           "       [--spin[=BUSY_POLL_US]] [--cpu=N] [--mlock] [--duplex] [--hugepages]\n" \
+                           "       [--interval=MS] [--warmup=MS] [--sndbuf=B] [--rcvbuf=B] [--nodelay]\n" \
+                           "       [--notsent-lowat=B] [--autotune[=PROBE_KB]] [--verify[=SEED]]"
+
+inline bool parse_perf_options(int &argc, char **argv, PerfOptions &opt)
+{
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto value = [&](const char *name)
+        { return arg.substr(strlen(name)); };
+        if (arg.rfind("--", 0) != 0)
+            argv[kept++] = argv[i];
+        else if (arg.rfind("--tcp-info=", 0) == 0)
+            opt.tcp_info = value("--tcp-info=");
+        else if (arg.rfind("--tcp-info-ms=", 0) == 0)
+            opt.tcp_info_ms = std::max(1, std::stoi(value("--tcp-info-ms=")));
+        else if (arg.rfind("--cc=", 0) == 0)
+            opt.cc = value("--cc=");
+        else if (arg.rfind("--sync=", 0) == 0)
+            opt.sync_probes = std::max(0, std::stoi(value("--sync=")));
+        else if (arg == "--spin")
+            opt.spin = true;
+        else if (arg.rfind("--spin=", 0) == 0)
+        {
+            opt.spin = true;
+            opt.busy_poll_us = std::max(0, std::stoi(value("--spin=")));
+        }
+        else if (arg.rfind("--cpu=", 0) == 0)
+            opt.cpu = std::stoi(value("--cpu="));
+        else if (arg == "--mlock")
+            opt.mlock = true;
+        else if (arg == "--duplex")
+            opt.duplex = true;
+        else if (arg == "--hugepages")
+            opt.hugepages = true;
+        else if (arg.rfind("--interval=", 0) == 0)
+            opt.interval_ms = std::max(0, std::stoi(value("--interval=")));
+        else if (arg.rfind("--warmup=", 0) == 0)
+            opt.warmup_ms = std::max(0, std::stoi(value("--warmup=")));
+        else if (arg.rfind("--sndbuf=", 0) == 0)
+            opt.sndbuf = std::stoul(value("--sndbuf="));
+        else if (arg.rfind("--rcvbuf=", 0) == 0)
+            opt.rcvbuf = std::stoul(value("--rcvbuf="));
+        else if (arg.rfind("--notsent-lowat=", 0) == 0)
+            opt.notsent_lowat = std::stoul(value("--notsent-lowat="));
+        else if (arg == "--nodelay")
+            opt.nodelay = true;
+        else if (arg == "--autotune")
+            opt.autotune_kb = 4096;
+        else if (arg.rfind("--autotune=", 0) == 0)
+            opt.autotune_kb = std::max(1ul, std::stoul(value("--autotune=")));
+        else if (arg == "--verify")
+            opt.verify = true;
+        else if (arg.rfind("--verify=", 0) == 0)
+        {
+            opt.verify = true;
+            opt.verify_seed = std::stoull(value("--verify="));
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    argc = kept;
+    return true;
+}
+
+// pins and locks the calling (transfer) thread as the options ask
+inline void apply_process_options(const PerfOptions &opt)
+{
+    if (opt.cpu >= 0 && !pin_thread(opt.cpu))
+        fprintf(stderr, "could not pin to CPU %d, running unpinned\n", opt.cpu);
+    if (opt.mlock)
+        lock_memory();
+}
+
+// spin mode for one socket; the busy-poll options are a bonus, spinning on
+// non-blocking receives works without them
+inline void apply_spin(const PerfOptions &opt, int fd)
+{
+    if (opt.spin && opt.busy_poll_us > 0 && !set_busy_poll(fd, opt.busy_poll_us))
+        perror("SO_BUSY_POLL");
+}
+
+// ---------- Message Header ----------
+// The same header struct is used on both client and server
+struct MessageHeader
+{
+    uint64_t send_time_ns;
+    uint32_t payload_size; // 0 => DONE
+    uint32_t seq = 0;      // per phase from 0, UDP receivers count gaps as loss;
+                           // a UDP DONE carries the number of messages sent
+    uint32_t crc = 0;      // CRC32C of the payload with --verify
+    uint32_t reserved = 0; // keeps the size a multiple of 8 with no unnamed padding
+};
+
+// The top payload_size values are control messages (see also
+// clock_sync.hpp). DUPLEX_GO: the client starts the full-duplex phase,
+// the server starts its download while the upload is still arriving.
+#define DUPLEX_GO 0xFFFFFFFDu
+
+// ---------- Time helper ----------
+// Steady clock, so timestamps never jump; the two ends of a cross-host run
+// are related by the ClockModel that clock_sync.hpp estimates.
+inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Helper to ensure all bytes are sent
+inline ssize_t send_all(int sock, const char *buffer, size_t len)
+{
+    size_t total_sent = 0;
+    while (total_sent < len)
+    {
+        ssize_t n = send(sock, buffer + total_sent, len - total_sent, 0);
+        if (n <= 0)
+            return n;
+        total_sent += n;
+    }
+    return total_sent;
+}
+
+// Helper to ensure all bytes are received
+inline ssize_t recv_all(int sock, char *buffer, size_t len, bool spin = false)
+{
+    size_t total_received = 0;
+    while (total_received < len)
+    {
+        ssize_t n = spin ? spin_recv(sock, buffer + total_received, len - total_received)
+                         : recv(sock, buffer + total_received, len - total_received, 0);
+        if (n <= 0)
+            return n;
+        total_received += n;
+    }
+    return total_received;
+}
+
+// ---------- Byte streams ----------
+// A connected, reliable byte stream the stream engine runs over: a TCP or
+// Unix-domain socket, or the shared-memory ring pair (shm_ring.hpp).
+struct Stream
+{
+    virtual ssize_t send_all(const char *buffer, size_t len) = 0;
+    virtual ssize_t recv_all(char *buffer, size_t len) = 0;
+    virtual int socket_fd() const { return -1; } // none for shared memory
+    virtual ~Stream() = default;
+};
+
+struct SocketStream : Stream
+{
+    int fd;
+    bool spin; // poll with non-blocking receives instead of sleeping
+    explicit SocketStream(int fd, bool spin = false) : fd(fd), spin(spin) {}
+    ssize_t send_all(const char *buffer, size_t len) override { return ::send_all(fd, buffer, len); }
+    ssize_t recv_all(char *buffer, size_t len) override { return ::recv_all(fd, buffer, len, spin); }
+    int socket_fd() const override { return fd; }
+};
+
+// an n-byte payload into a buffer of cap bytes; what does not fit is read
+// over the same bytes and dropped, so the buffer never has to grow
+inline ssize_t recv_payload(Stream &conn, char *buf, size_t cap, size_t n)
+{
+    for (size_t left = n; left > 0;)
+    {
+        size_t chunk = std::min(left, cap);
+        if (conn.recv_all(buf, chunk) <= 0)
+            return -1;
+        left -= chunk;
+    }
+    return n;
+}
+
+// Unix-domain socket path / shared-memory name for a given "port", so
+// local transports are addressed like the network ones
+inline std::string uds_path(int port)
+{
+    return "/tmp/netlab_perf_" + std::to_string(port) + ".sock";
+}
+
+inline std::string shm_name(int port)
+{
+    return "/netlab_perf_" + std::to_string(port);
+}
+
+// ---------- One-way latency ----------
+// Maps the sender's clock onto the receiver's:
+//   receiver ~= sender + offset_ns + skew * (sender - ref_ns)
+// exact to within +-error_ns. The default model (same host, same clock)
+// is the identity with an unknown error.
+struct ClockModel
+{
+    uint64_t ref_ns = 0;
+    double offset_ns = 0, skew = 0, error_ns = 0;
+    uint32_t valid = 0; // estimated rather than assumed
+
+    double offset_at(uint64_t sender_ns) const
+    {
+        return offset_ns + skew * ((double)sender_ns - (double)ref_ns);
+    }
+    // the same relation seen from the other end
+    ClockModel inverse() const
+    {
+        return ClockModel{(uint64_t)(ref_ns + offset_ns), -offset_ns, -skew / (1 + skew), error_ns, valid};
+    }
+};
+
+// Receivers stamp arrivals against MessageHeader::send_time_ns and apply
+// a ClockModel when reporting; min and max are corrected at the instant
+// they occurred.
+struct LatencyStats
+{
+    uint64_t count = 0;
+    double sum_ns = 0, sum_send_ns = 0;
+    int64_t min_ns = INT64_MAX, max_ns = INT64_MIN;
+    uint64_t min_at = 0, max_at = 0;
+
+    void add(uint64_t send_time_ns, uint64_t arrival_ns)
+    {
+        int64_t d = (int64_t)(arrival_ns - send_time_ns);
+        sum_ns += d;
+        sum_send_ns += send_time_ns;
+        if (d < min_ns)
+            min_ns = d, min_at = send_time_ns;
+        if (d > max_ns)
+            max_ns = d, max_at = send_time_ns;
+        count++;
+    }
+
+    double avg_us(const ClockModel &m = {}) const
+    {
+        if (!count)
+            return 0;
+        return (sum_ns / count - m.offset_ns - m.skew * (sum_send_ns / count - (double)m.ref_ns)) / 1e3;
+    }
+    double min_us(const ClockModel &m = {}) const { return count ? (min_ns - m.offset_at(min_at)) / 1e3 : 0; }
+    double max_us(const ClockModel &m = {}) const { return count ? (max_ns - m.offset_at(max_at)) / 1e3 : 0; }
+
+    // ", one-way latency avg A us (min B, max C) +- E us"
+    std::string report(const ClockModel &m = {}) const
+    {
+        char line[160];
+        int n = snprintf(line, sizeof(line), ", one-way latency avg %.1f us (min %.1f, max %.1f)",
+                         avg_us(m), min_us(m), max_us(m));
+        if (m.valid)
+            snprintf(line + n, sizeof(line) - n, " +- %.1f us", m.error_ns / 1e3);
+        return line;
+    }
+};
+
+// ---------- Per-direction results ----------
+struct DirectionResult
+{
+    size_t bytes = 0;
+    uint64_t first_ns = 0, last_ns = 0; // first and last arrival
+    LatencyStats lat;
+
+    void add(const MessageHeader &hdr, uint64_t arrival_ns)
+    {
+        if (first_ns == 0)
+            first_ns = arrival_ns;
+        last_ns = arrival_ns;
+        lat.add(hdr.send_time_ns, arrival_ns);
+        bytes += hdr.payload_size;
+    }
+    double seconds() const { return (last_ns - first_ns) / 1e9; }
+    double kb_per_sec() const { return (bytes / 1024.0) / seconds(); }
+};
+
+// "throughput -12.3%, latency avg +41.0%" of the duplex run against the
+// same direction running alone
+inline std::string degradation(const DirectionResult &alone, const DirectionResult &duplex)
+{
+    auto change = [](double before, double after)
+    { return before > 0 ? (after - before) / before * 100 : 0.0; };
+    char line[96];
+    snprintf(line, sizeof(line), "throughput %+.1f%%, latency avg %+.1f%%",
+             change(alone.kb_per_sec(), duplex.kb_per_sec()),
+             change(alone.lat.avg_us(), duplex.lat.avg_us()));
+    return line;
+}
+
+// ---------- UDP messages ----------
+// A message (header + payload) goes out as one datagram when it fits and
+// no fragment size was asked for, otherwise as fragments. The receiving
+// side accepts both and hands out whole messages only. With fragments in
+// play the reassembly buffers for messages of up to `max_message` bytes
+// are allocated up front.
+class UdpMessenger
+{
+public:
+    UdpMessenger(int fd, size_t frag_size, size_t max_message)
+        : fd(fd), frag_size(frag_size), pool(512u << 20), reasm(pool)
+    {
+        int rcvbuf = 8 << 20; // a burst of fragments must not overflow the socket
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (frag_size || max_message > UDP_MAX_DATAGRAM)
+            prefill_reassembly(pool, reasm.limits(), max_message, frag_size ? frag_size : FRAG_DEFAULT_SIZE);
+    }
+
+    ssize_t send(const char *buf, size_t len, const sockaddr *to, socklen_t tolen)
+    {
+        if (frag_size == 0 && len <= UDP_MAX_DATAGRAM)
+            return sendto(fd, buf, len, 0, to, tolen);
+        return send_fragmented(fd, to, tolen, next_id++, buf, len, frag_size ? frag_size : FRAG_DEFAULT_SIZE);
+    }
+
+    // next whole message; valid until the next call. Returns its length,
+    // <= 0 on error or timeout
+    // poll instead of blocking, giving up after timeout_ms (0 = never)
+    void spin(int timeout_ms)
+    {
+        spinning = true;
+        spin_timeout_ms = timeout_ms;
+    }
+
+    ssize_t recv(const char *&msg, sockaddr_in &from, socklen_t &fromlen)
+    {
+        for (;;)
+        {
+            fromlen = sizeof(from);
+            ssize_t n = spinning ? spin_recvfrom(fd, dgram, sizeof(dgram), 0, (sockaddr *)&from, &fromlen, spin_timeout_ms)
+                                 : recvfrom(fd, dgram, sizeof(dgram), 0, (sockaddr *)&from, &fromlen);
+            if (n <= 0)
+                return n;
+            switch (reasm.feed(from, dgram, n, whole))
+            {
+            case Reassembler::Result::NOT_FRAGMENT:
+                msg = dgram;
+                return n;
+            case Reassembler::Result::COMPLETE:
+                msg = whole.data();
+                return whole.size();
+            default:
+                continue;
+            }
+        }
+    }
+
+    // one line on fragment traffic, empty if there was none
+    std::string report() const
+    {
+        const ReassemblyStats &st = reasm.stats();
+        if (st.completed + st.timed_out + st.dropped_cap + st.dropped_bad == 0)
+            return "";
+        return "reassembled " + std::to_string(st.completed) + " messages, " +
+               std::to_string(st.timed_out) + " timed out, " +
+               std::to_string(st.dropped_cap + st.dropped_bad) + " dropped; pool " +
+               std::to_string(pool.bytes_allocated() >> 10) + " KB in " +
+               std::to_string(pool.heap_allocations()) + " allocations";
+    }
+
+private:
+    int fd;
+    size_t frag_size;
+    uint32_t next_id = 0;
+    bool spinning = false;
+    int spin_timeout_ms = 0;
+    BufferPool pool;
+    Reassembler reasm;
+    PooledBuffer whole;
+    char dgram[UDP_MAX_DATAGRAM + 1];
+};
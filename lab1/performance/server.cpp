@@ -1,54 +1,227 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <iostream>
 #include <cstring>
 #include <chrono>
+#include <thread>
 #include <vector>
-// ---------- Message Header ----------
-// The same header struct is used on both client and server
-struct MessageHeader
-{
-    uint64_t send_time_ns;
-    uint32_t payload_size; // 0 => DONE
-};
+#include "perf_common.hpp"
+#include "shm_ring.hpp"
+#include "tcp_info.hpp"
+#include "clock_sync.hpp"
+#include "io_buffers.hpp"
+#include "cpu_cost.hpp"
+#include "intervals.hpp"
+#include "sock_tune.hpp"
+#include "verify.hpp"
+
+COUNT_HEAP_ALLOCATIONS
+
+PerfOptions opts;
+
+// ---------------- Stream engine (TCP / UDS / SHM) ----------------
+// Upload until DONE, then send the download, over any connected stream.
+// With --duplex the client then sends DUPLEX_GO and both directions run
+// again at the same time, the download from a second thread.
 
-// ---------- Time helper ----------
-uint64_t now_ns()
+// receives until DONE into a buffer of cap bytes, answering clock and
+// autotune probes and taking the client's clock model and socket settings
+// on the way
+DirectionResult stream_receive(Stream &conn, char *payload, size_t cap, ClockModel &clock,
+                               IntervalMeter &iv, PayloadCheck &chk)
 {
-    return std::chrono::duration_cast<std::chrono::nanoseconds>(
-               std::chrono::high_resolution_clock::now().time_since_epoch())
-        .count();
+    DirectionResult res;
+    while (true)
+    {
+        MessageHeader hdr;
+        if (conn.recv_all((char *)&hdr, sizeof(hdr)) <= 0)
+            break;
+        uint64_t arrival = now_ns();
+        if (hdr.payload_size == 0)
+            break; // DONE
+        if (hdr.payload_size == SYNC_PROBE)
+        {
+            if (!sync_reply(conn, hdr, arrival))
+                break;
+            continue;
+        }
+        if (hdr.payload_size == SYNC_MODEL)
+        {
+            if (conn.recv_all((char *)&clock, sizeof(clock)) <= 0)
+                break;
+            continue;
+        }
+        if (hdr.payload_size == TUNE_PROBE)
+        {
+            if (!autotune_probe_reply(conn, hdr, arrival, payload, cap))
+                break;
+            continue;
+        }
+        if (hdr.payload_size == TUNE_APPLY)
+        {
+            SockTune t;
+            if (conn.recv_all((char *)&t, sizeof(t)) <= 0)
+                break;
+            if (conn.socket_fd() >= 0)
+            {
+                apply_sock_tune(conn.socket_fd(), t);
+                printf("autotune from the client: %s\n", sock_settings(conn.socket_fd()).c_str());
+            }
+            continue;
+        }
+
+        if (chk.recv(conn, hdr, payload, cap) <= 0)
+            break;
+        arrival = now_ns();
+        res.add(hdr, arrival);
+        iv.add(arrival, hdr.payload_size);
+    }
+    iv.finish();
+    return res;
 }
 
-// ---------------- TCP ----------------
-// Helper to ensure all bytes are sent
-ssize_t send_all(int sock, const char *buffer, size_t len)
+// sends the download, then DONE; returns the payload bytes sent
+size_t stream_send(Stream &conn, char *send_buffer, size_t msg_size, size_t total_kb, IntervalMeter &iv,
+                   PayloadCheck &chk)
 {
-    size_t total_sent = 0;
-    while (total_sent < len)
+    size_t total_bytes = total_kb * 1024;
+    size_t sent = 0;
+    for (uint32_t seq = 0; sent < total_bytes; seq++)
     {
-        ssize_t n = send(sock, buffer + total_sent, len - total_sent, 0);
-        if (n <= 0)
-            return n;
-        total_sent += n;
+        uint32_t crc = chk.seal(send_buffer + sizeof(MessageHeader), msg_size, seq);
+        MessageHeader hdr{now_ns(), (uint32_t)msg_size, seq, crc};
+        memcpy(send_buffer, &hdr, sizeof(hdr));
+        if (conn.send_all(send_buffer, sizeof(hdr) + msg_size) <= 0)
+            break;
+        iv.add(hdr.send_time_ns, msg_size);
+        sent += msg_size;
     }
-    return total_sent;
+    iv.finish();
+    // send DONE
+    MessageHeader done{now_ns(), 0};
+    conn.send_all((char *)&done, sizeof(done));
+    return sent;
 }
 
-// Helper to ensure all bytes are received
-ssize_t recv_all(int sock, char *buffer, size_t len)
+// "heap allocations in transfer loops: N, buffers on 4k pages"
+std::string alloc_report(const AllocWindow &allocs, const IoBufferPool &bufs)
 {
-    size_t total_received = 0;
-    while (total_received < len)
+    return "heap allocations in transfer loops: " + std::to_string(allocs.total) +
+           ", buffers on " + bufs.backing() + " pages";
+}
+
+void stream_server(Stream &conn, const char *label, size_t msg_size, size_t total_kb)
+{
+    ClockModel clock; // client -> server, sent by the client before DONE
+    IoBufferPool bufs(msg_size + sizeof(MessageHeader), 2, opts.hugepages);
+    char *payload = bufs.take();
+    char *send_buffer = bufs.take();
+    if (!payload || !send_buffer)
+        return;
+    memset(send_buffer, 'X', bufs.slot_size());
+    PayloadCheck rx(opts), tx(opts); // upload checked, download sealed
+    tx.fill(send_buffer + sizeof(MessageHeader), msg_size);
+    double rx_seconds = 0;
+    AllocWindow allocs;
+    CpuCost cost;
+    uint64_t moved = 0, messages = 0; // both directions, for the cost figures
+    CpuMeter cpu;
+    cpu.start();
+
+    // ---- Receive upload ----
+    cost.open();
+    IntervalMeter up_iv(label, "upload received", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    DirectionResult up = stream_receive(conn, payload, bufs.slot_size(), clock, up_iv, rx);
+    allocs.close();
+    cost.close();
+    moved += up.bytes;
+    messages += up.lat.count;
+    rx_seconds += up.seconds();
+#ifdef TXT
+    std::cout << up.bytes / 1024.0 << " " << up.kb_per_sec() << "\n";
+#else
+    std::cout << "[" << label << "] Upload: " << up.bytes / 1024.0
+              << " KB in " << up.seconds() << "s => "
+              << up.kb_per_sec() << " KB/s"
+              << up.lat.report(clock) << "\n";
+    up_iv.report();
+#endif
+
+    // ---- Send download ----
+    IntervalMeter down_iv(label, "download sent", opts.interval_ms, opts.warmup_ms);
+    cost.open();
+    allocs.open();
+    size_t down = stream_send(conn, send_buffer, msg_size, total_kb, down_iv, tx);
+    allocs.close();
+    cost.close();
+    moved += down;
+    messages += down / msg_size;
+#ifndef TXT
+    down_iv.report();
+#endif
+
+    // ---- Both at once ----
+    if (opts.duplex)
     {
-        ssize_t n = recv(sock, buffer + total_received, len - total_received, 0);
-        if (n <= 0)
-            return n;
-        total_received += n;
+        MessageHeader go;
+        if (conn.recv_all((char *)&go, sizeof(go)) <= 0 || go.payload_size != DUPLEX_GO)
+        {
+            std::cerr << "[" << label << "] client did not start the duplex phase (run it with --duplex)\n";
+            return;
+        }
+        IntervalMeter dup_up_iv(label, "duplex upload received", opts.interval_ms, opts.warmup_ms);
+        IntervalMeter dup_down_iv(label, "duplex download sent", opts.interval_ms, opts.warmup_ms);
+        std::thread writer([&]()
+                           { down = stream_send(conn, send_buffer, msg_size, total_kb, dup_down_iv, tx); });
+        cost.open();
+        allocs.open();
+        DirectionResult both = stream_receive(conn, payload, bufs.slot_size(), clock, dup_up_iv, rx);
+        writer.join();
+        allocs.close();
+        cost.close();
+        moved += both.bytes + down;
+        messages += both.lat.count + down / msg_size;
+        rx_seconds += both.seconds();
+#ifdef TXT
+        std::cout << both.bytes / 1024.0 << " " << both.kb_per_sec() << "\n";
+#else
+        std::cout << "[" << label << "] Duplex upload: " << both.bytes / 1024.0
+                  << " KB in " << both.seconds() << "s => " << both.kb_per_sec() << " KB/s"
+                  << both.lat.report(clock) << "\n"
+                  << "[" << label << "] Duplex upload vs alone: " << degradation(up, both) << "\n";
+        dup_up_iv.report();
+        dup_down_iv.report();
+#endif
     }
-    return total_received;
+#ifndef TXT
+    std::cout << "[" << label << "] " << cpu.report() << (opts.spin ? ", spinning" : "") << "\n"
+              << "[" << label << "] cost " << cost.report(moved, messages) << "\n"
+              << "[" << label << "] " << alloc_report(allocs, bufs) << "\n";
+    if (rx.enabled())
+        std::cout << "[" << label << "] upload " << rx.report(rx_seconds) << "\n"
+                  << "[" << label << "] download " << tx.report(0) << "\n";
+#endif
+}
+
+// ---------------- TCP ----------------
+// writes the sampled series and prints where the connection spent its time
+void report_tcp_info(TcpInfoSampler &sampler, int sock)
+{
+    sampler.stop();
+    if (!opts.tcp_info.empty())
+        sampler.write_csv(opts.tcp_info, "server");
+#ifndef TXT
+    std::cout << "[TCP] " << congestion_control(sock);
+    if (!opts.tcp_info.empty())
+        std::cout << ", " << sampler.summary();
+    std::cout << "\n";
+#else
+    (void)sock;
+#endif
 }
 
 void tcp_server(int port, size_t msg_size, size_t total_kb)
@@ -61,6 +234,14 @@ void tcp_server(int port, size_t msg_size, size_t total_kb)
     }
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (!opts.cc.empty() && !set_congestion_control(server_fd, opts.cc))
+    {
+        close(server_fd);
+        return;
+    }
+    // on the listener, so accepted connections start with them
+    if (apply_requested_tune(opts, server_fd))
+        std::cout << "[TCP] " << sock_settings(server_fd) << "\n";
 
     sockaddr_in address{};
     address.sin_family = AF_INET;
@@ -90,63 +271,83 @@ void tcp_server(int port, size_t msg_size, size_t total_kb)
         return;
     }
 
-    char *buffer = new char[msg_size + sizeof(MessageHeader)];
-    uint64_t first_send_time = 0, last_arrival_time = 0;
-    size_t total_payload = 0;
+    TcpInfoSampler sampler;
+    if (!opts.tcp_info.empty())
+        sampler.start(sock, opts.tcp_info_ms);
+    apply_spin(opts, sock);
+    SocketStream conn(sock, opts.spin);
+    stream_server(conn, "TCP", msg_size, total_kb);
+    report_tcp_info(sampler, sock);
+    close(sock);
+    close(server_fd);
+}
 
-    // ---- Receive upload ----
-    while (true)
+// ---------------- Unix-domain socket ----------------
+void uds_server(int port, size_t msg_size, size_t total_kb)
+{
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0)
     {
-        MessageHeader hdr;
-        if (recv_all(sock, (char *)&hdr, sizeof(hdr)) <= 0)
-            break;
-        if (hdr.payload_size == 0)
-            break; // DONE
+        perror("socket");
+        return;
+    }
 
-        std::vector<char> payload(hdr.payload_size);
-        if (recv_all(sock, payload.data(), hdr.payload_size) <= 0)
-            break;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::string path = uds_path(port);
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (apply_requested_tune(opts, server_fd))
+        std::cout << "[UDS] " << sock_settings(server_fd) << "\n";
 
-        if (first_send_time == 0)
-            first_send_time = now_ns();
-        // if (first_send_time == 0) first_send_time = hdr.send_time_ns;
-        last_arrival_time = now_ns();
-        total_payload += hdr.payload_size;
+    if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("bind");
+        close(server_fd);
+        return;
     }
-
-    double dur = (last_arrival_time - first_send_time) / 1e9;
-#ifdef TXT
-    std::cout << total_payload / 1024.0 << " " << (total_payload / 1024.0) / dur << "\n";
-#else
-    std::cout << "[TCP] Upload: " << total_payload / 1024.0
-              << " KB in " << dur << "s => "
-              << (total_payload / 1024.0) / dur << " KB/s\n";
+    if (listen(server_fd, 1) < 0)
+    {
+        perror("listen");
+        close(server_fd);
+        unlink(path.c_str());
+        return;
+    }
+#ifndef TXT
+    std::cout << "[UDS] Waiting for connection on " << path << "...\n";
 #endif
-
-    // ---- Send download ----
-    size_t total_bytes = total_kb * 1024;
-    size_t sent = 0;
-    std::vector<char> send_buffer(msg_size + sizeof(MessageHeader));
-    while (sent < total_bytes)
+    int sock = accept(server_fd, nullptr, nullptr);
+    if (sock < 0)
     {
-        MessageHeader hdr{now_ns(), (uint32_t)msg_size};
-        memcpy(send_buffer.data(), &hdr, sizeof(hdr));
-        memset(send_buffer.data() + sizeof(hdr), 'X', msg_size);
-        if (send_all(sock, send_buffer.data(), sizeof(hdr) + msg_size) <= 0)
-            break;
-        sent += msg_size;
+        perror("accept");
+        close(server_fd);
+        unlink(path.c_str());
+        return;
     }
-    // send DONE
-    MessageHeader done{now_ns(), 0};
-    send_all(sock, (char *)&done, sizeof(done));
 
+    apply_spin(opts, sock);
+    SocketStream conn(sock, opts.spin);
+    stream_server(conn, "UDS", msg_size, total_kb);
     close(sock);
     close(server_fd);
-    delete[] buffer;
+    unlink(path.c_str());
+}
+
+// ---------------- Shared memory ----------------
+void shm_server(int port, size_t msg_size, size_t total_kb)
+{
+    ShmStream conn;
+    conn.spin = opts.spin;
+#ifndef TXT
+    std::cout << "[SHM] Waiting for client on " << shm_name(port) << "...\n";
+#endif
+    if (!conn.listen(shm_name(port)))
+        return;
+    stream_server(conn, "SHM", msg_size, total_kb);
 }
 
 // ---------------- UDP ----------------
-void udp_server(int port, size_t msg_size, size_t total_kb)
+void udp_server(int port, size_t msg_size, size_t total_kb, size_t frag_size)
 {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0)
@@ -169,79 +370,208 @@ void udp_server(int port, size_t msg_size, size_t total_kb)
 #ifndef TXT
     std::cout << "[UDP Server] Listening on port " << port << "...\n";
 #endif
-    char *buffer = new char[msg_size + sizeof(MessageHeader)];
+    // recv timeout: once data flows, this much silence ends a phase whose
+    // DONE copies were all lost
+    struct timeval tv;
+    tv.tv_sec = 3;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    UdpMessenger udp(sock, frag_size, sizeof(MessageHeader) + msg_size);
+    if (opts.autotune_kb)
+        apply_sock_tune(sock, SockTune{UDP_AUTOTUNE_BUF, UDP_AUTOTUNE_BUF});
+    if (apply_requested_tune(opts, sock) || opts.autotune_kb)
+        std::cout << "[UDP] " << sock_settings(sock) << "\n";
+    if (opts.spin)
+    {
+        apply_spin(opts, sock);
+        udp.spin(3000);
+    }
+    IoBufferPool bufs(msg_size + sizeof(MessageHeader), 1, opts.hugepages);
+    char *buffer = bufs.take(); // received messages stay in the messenger's buffers
+    if (!buffer)
+    {
+        close(sock);
+        return;
+    }
+    memset(buffer, 'X', bufs.slot_size());
+    PayloadCheck rx(opts), tx(opts);
+    tx.fill(buffer + sizeof(MessageHeader), msg_size);
+    double rx_seconds = 0;
+    AllocWindow allocs;
+    CpuCost cost;
+    uint64_t moved = 0, messages = 0; // both directions, for the cost figures
+    CpuMeter cpu;
     socklen_t clen = sizeof(client);
 
-    uint64_t first_send_time = 0, last_arrival_time = 0;
-    size_t total_payload = 0;
-
-    // ---- Receive upload phase ----
-    while (true)
+    bool cpu_started = false;
+    // until DONE; the sender's address ends up in client/clen
+    auto receive = [&](IntervalMeter &iv)
     {
-        ssize_t n = recvfrom(sock, buffer, msg_size + sizeof(MessageHeader), 0,
-                             (sockaddr *)&client, &clen);
-        if (n <= 0)
-            continue; // ignore errors
+        DirectionResult res;
+        uint32_t sent = 0; // from DONE
+        while (true)
+        {
+            const char *msg = nullptr;
+            ssize_t n = udp.recv(msg, client, clen);
+            if (n < (ssize_t)sizeof(MessageHeader))
+            {
+                if (n < 0 && res.bytes > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break; // timed out mid-phase, take what arrived
+                continue; // ignore errors, and wait for the client to start
+            }
 
-        MessageHeader *hdr = (MessageHeader *)buffer;
-        if (hdr->payload_size == 0)
-            break; // DONE from client
+            const MessageHeader *hdr = (const MessageHeader *)msg;
+            if (hdr->payload_size == 0)
+            {
+                sent = hdr->seq; // DONE from client
+                break;
+            }
+            if (hdr->payload_size == DUPLEX_GO)
+                continue; // a spare copy
 
-        if (first_send_time == 0)
-            first_send_time = now_ns();
-        last_arrival_time = now_ns();
-        total_payload += hdr->payload_size;
-    }
+            if (!cpu_started)
+            {
+                cpu.start(); // not the idle wait for the client
+                cpu_started = true;
+            }
+            uint64_t arrival = now_ns();
+            rx.check(*hdr, msg + sizeof(MessageHeader), n - sizeof(MessageHeader));
+            res.add(*hdr, arrival);
+            iv.add(arrival, hdr->payload_size, hdr->seq);
+        }
+        iv.finish(sent);
+        return res;
+    };
+    auto send_download = [&](sockaddr_in to, socklen_t tolen, IntervalMeter &iv)
+    {
+        size_t total_bytes = total_kb * 1024;
+        size_t sent = 0;
+        for (uint32_t seq = 0; sent < total_bytes; seq++)
+        {
+            uint32_t crc = tx.seal(buffer + sizeof(MessageHeader), msg_size, seq);
+            MessageHeader hdr{now_ns(), (uint32_t)msg_size, seq, crc};
+            memcpy(buffer, &hdr, sizeof(hdr));
+            udp.send(buffer, sizeof(hdr) + msg_size, (sockaddr *)&to, tolen);
+            iv.add(hdr.send_time_ns, msg_size);
+            sent += msg_size;
+        }
+        iv.finish();
+        // send DONE with the count sent, three times like the client's
+        // control datagrams: a lost one would leave the client waiting
+        // for its receive timeout
+        MessageHeader done{now_ns(), 0, (uint32_t)(sent / msg_size)};
+        for (int i = 0; i < 3; i++)
+            sendto(sock, &done, sizeof(done), 0, (sockaddr *)&to, tolen);
+        return sent;
+    };
 
-    double dur = (last_arrival_time - first_send_time) / 1e9;
+    // ---- Receive upload phase ----
+    cost.open();
+    IntervalMeter up_iv("UDP", "upload received", opts.interval_ms, opts.warmup_ms);
+    allocs.open();
+    DirectionResult up = receive(up_iv);
+    allocs.close();
+    cost.close();
+    moved += up.bytes;
+    messages += up.lat.count;
+    rx_seconds += up.seconds();
     #ifndef TXT
-    std::cout << "[UDP] Upload: " << total_payload / 1024.0
-              << " KB in " << dur << "s => "
-              << (total_payload / 1024.0) / dur << " KB/s\n";
+    std::cout << "[UDP] Upload: " << up.bytes / 1024.0
+              << " KB in " << up.seconds() << "s => "
+              << up.kb_per_sec() << " KB/s\n";
+    up_iv.report();
     #else 
-    std::cout<<total_payload/1024.0<<" "<<(total_payload / 1024.0) / dur<<"\n";
+    std::cout<<up.bytes/1024.0<<" "<<up.kb_per_sec()<<"\n";
     #endif 
     // ---- Send download phase ----
-    size_t total_bytes = total_kb * 1024;
-    size_t sent = 0;
-    while (sent < total_bytes)
+    IntervalMeter down_iv("UDP", "download sent", opts.interval_ms, opts.warmup_ms);
+    cost.open();
+    allocs.open();
+    size_t down = send_download(client, clen, down_iv);
+    allocs.close();
+    cost.close();
+    moved += down;
+    messages += down / msg_size;
+#ifndef TXT
+    down_iv.report();
+#endif
+
+    // ---- Both at once ----
+    // the client sends DUPLEX_GO (three times, any stray DONE copies are
+    // skipped); the download then runs on a second thread
+    if (opts.duplex)
     {
-        MessageHeader hdr{now_ns(), (uint32_t)msg_size};
-        memcpy(buffer, &hdr, sizeof(hdr));
-        memset(buffer + sizeof(hdr), 'X', msg_size);
-        sendto(sock, buffer, sizeof(hdr) + msg_size, 0,
-               (sockaddr *)&client, clen);
-        sent += msg_size;
+        while (true)
+        {
+            const char *msg = nullptr;
+            if (udp.recv(msg, client, clen) >= (ssize_t)sizeof(MessageHeader) &&
+                ((const MessageHeader *)msg)->payload_size == DUPLEX_GO)
+                break;
+        }
+        IntervalMeter dup_up_iv("UDP", "duplex upload received", opts.interval_ms, opts.warmup_ms);
+        IntervalMeter dup_down_iv("UDP", "duplex download sent", opts.interval_ms, opts.warmup_ms);
+        std::thread writer([&, to = client, tolen = clen]()
+                           { down = send_download(to, tolen, dup_down_iv); });
+        cost.open();
+        allocs.open();
+        DirectionResult both = receive(dup_up_iv);
+        writer.join();
+        allocs.close();
+        cost.close();
+        moved += both.bytes + down;
+        messages += both.lat.count + down / msg_size;
+        rx_seconds += both.seconds();
+#ifndef TXT
+        std::cout << "[UDP] Duplex upload: " << both.bytes / 1024.0
+                  << " KB in " << both.seconds() << "s => " << both.kb_per_sec() << " KB/s"
+                  << both.lat.report() << "\n"
+                  << "[UDP] Duplex upload vs alone: " << degradation(up, both) << "\n";
+        dup_up_iv.report();
+        dup_down_iv.report();
+#else
+        std::cout << both.bytes / 1024.0 << " " << both.kb_per_sec() << "\n";
+#endif
     }
-    // send DONE
-    MessageHeader done{now_ns(), 0};
-    sendto(sock, &done, sizeof(done), 0, (sockaddr *)&client, clen);
 #ifndef TXT
+    if (std::string r = udp.report(); !r.empty())
+        std::cout << "[UDP] " << r << "\n";
+    std::cout << "[UDP] " << cpu.report() << (opts.spin ? ", spinning" : "") << "\n";
+    std::cout << "[UDP] cost " << cost.report(moved, messages) << "\n";
+    std::cout << "[UDP] " << alloc_report(allocs, bufs) << "\n";
+    if (rx.enabled())
+        std::cout << "[UDP] upload " << rx.report(rx_seconds) << "\n"
+                  << "[UDP] download " << tx.report(0) << "\n";
     std::cout << "[UDP] Finished session with client.\n";
 #endif
     close(sock);
-    delete[] buffer;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 5)
+    if (!parse_perf_options(argc, argv, opts) || (argc != 5 && argc != 6))
     {
-        std::cerr << "Usage: ./server tcp|udp port msg_size_kb total_kb\n";
+        std::cerr << "Usage: ./server tcp|udp|uds|shm port msg_size_kb total_kb [frag_bytes]\n"
+                  << "       " PERF_OPTIONS_USAGE "\n";
         return 1;
     }
     std::string mode = argv[1];
     int port = std::stoi(argv[2]);
     size_t msg_size = std::stoul(argv[3]) * 1024;
     size_t total_kb = std::stoul(argv[4]);
+    apply_process_options(opts);
+    size_t frag_size = argc == 6 ? std::stoul(argv[5]) : 0; // udp only
 
     if (mode == "tcp")
         tcp_server(port, msg_size, total_kb);
     else if (mode == "udp")
-        udp_server(port, msg_size, total_kb);
+        udp_server(port, msg_size, total_kb, frag_size);
+    else if (mode == "uds")
+        uds_server(port, msg_size, total_kb);
+    else if (mode == "shm")
+        shm_server(port, msg_size, total_kb);
     else
     {
-        std::cerr << "Invalid mode: use tcp or udp\n";
+        std::cerr << "Invalid mode: use tcp, udp, uds or shm\n";
         return 1;
     }
     return 0;
@@ -0,0 +1,242 @@
+#pragma once
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include "perf_common.hpp"
+
+// ---------- Shared-memory transport ----------
+// Two lock-free single-producer/single-consumer byte rings (one per
+// direction) in a POSIX shared-memory segment. The data path is plain
+// memcpy plus an acquire/release index update; a side that finds its ring
+// empty (or full) spins briefly and then sleeps on a futex in the segment,
+// the other side only issues FUTEX_WAKE when someone is actually asleep.
+// This leaves the kernel network stack out entirely, as a lower bound for
+// what the same framing costs over TCP/UDS.
+
+#define SHM_RING_SIZE (4u << 20) // bytes per direction, power of two
+#define SHM_SPIN 2000            // polls before sleeping on the futex
+
+inline long futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const timespec *ts = nullptr)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), op, val, ts, nullptr, 0);
+}
+
+struct ShmRing
+{
+    alignas(64) std::atomic<uint64_t> head; // bytes ever written (producer)
+    alignas(64) std::atomic<uint64_t> tail; // bytes ever read (consumer)
+    alignas(64) std::atomic<uint32_t> data_seq;  // futex: bumped when data is added
+    std::atomic<uint32_t> consumer_waiting;
+    alignas(64) std::atomic<uint32_t> space_seq; // futex: bumped when space is freed
+    std::atomic<uint32_t> producer_waiting;
+    alignas(64) std::atomic<uint32_t> closed;
+    alignas(64) char data[SHM_RING_SIZE];
+
+    // Blocks until `pred` holds. `seq` is the futex word the other side
+    // bumps, `waiting` announces that we are about to sleep on it. With
+    // `spin` it never sleeps.
+    template <typename Pred>
+    bool wait_for(Pred pred, std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting, bool spin)
+    {
+        for (int i = 0; spin || i < SHM_SPIN; i += !spin) // spin mode never counts
+        {
+            if (pred())
+                return true;
+            if (spin && closed.load(std::memory_order_acquire))
+                return pred();
+        }
+        const timespec tick{0, 100 * 1000 * 1000}; // re-check closed every 100 ms
+        while (!pred())
+        {
+            if (closed.load(std::memory_order_acquire))
+                return pred();
+            waiting.store(1, std::memory_order_seq_cst);
+            uint32_t s = seq.load(std::memory_order_seq_cst);
+            if (!pred())
+                futex(&seq, FUTEX_WAIT, s, &tick);
+            waiting.store(0, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    static void notify(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_seq_cst))
+        {
+            seq.fetch_add(1, std::memory_order_seq_cst);
+            futex(&seq, FUTEX_WAKE, INT_MAX);
+        }
+    }
+
+    // producer side, same contract as send_all()
+    ssize_t write_all(const char *buf, size_t len, bool spin = false)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            uint64_t free_space = 0;
+            if (!wait_for([&]
+                          { free_space = SHM_RING_SIZE - (h - tail.load(std::memory_order_acquire));
+                            return free_space > 0; },
+                          space_seq, producer_waiting, spin))
+                return -1;
+            if (closed.load(std::memory_order_acquire))
+                return -1;
+            size_t n = std::min<uint64_t>(len - done, free_space);
+            size_t off = h & (SHM_RING_SIZE - 1);
+            size_t first = std::min<size_t>(n, SHM_RING_SIZE - off);
+            memcpy(data + off, buf + done, first);
+            memcpy(data, buf + done + first, n - first);
+            head.store(h + n, std::memory_order_release);
+            notify(data_seq, consumer_waiting);
+            done += n;
+        }
+        return done;
+    }
+
+    // consumer side, same contract as recv_all() (0 = peer closed)
+    ssize_t read_all(char *buf, size_t len, bool spin = false)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            uint64_t avail = 0;
+            if (!wait_for([&]
+                          { avail = head.load(std::memory_order_acquire) - t;
+                            return avail > 0; },
+                          data_seq, consumer_waiting, spin))
+                return 0;
+            size_t n = std::min<uint64_t>(len - done, avail);
+            size_t off = t & (SHM_RING_SIZE - 1);
+            size_t first = std::min<size_t>(n, SHM_RING_SIZE - off);
+            memcpy(buf + done, data + off, first);
+            memcpy(buf + done + first, data, n - first);
+            tail.store(t + n, std::memory_order_release);
+            notify(space_seq, producer_waiting);
+            done += n;
+        }
+        return done;
+    }
+
+    void close_ring()
+    {
+        closed.store(1, std::memory_order_release);
+        data_seq.fetch_add(1);
+        space_seq.fetch_add(1);
+        futex(&data_seq, FUTEX_WAKE, INT_MAX);
+        futex(&space_seq, FUTEX_WAKE, INT_MAX);
+    }
+};
+
+struct ShmSegment
+{
+    std::atomic<uint32_t> ready;     // server finished initialising
+    std::atomic<uint32_t> connected; // futex: client attached
+    ShmRing up;                      // client -> server
+    ShmRing down;                    // server -> client
+};
+
+// Stream over a mapped segment; the server creates (and unlinks) it, the
+// client attaches to an existing one.
+struct ShmStream : Stream
+{
+    ShmSegment *seg = nullptr;
+    ShmRing *tx = nullptr, *rx = nullptr;
+    std::string name;
+    bool owner = false;
+    bool spin = false; // never sleep on the futex
+
+    static ShmSegment *map(int fd)
+    {
+        void *p = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        return p == MAP_FAILED ? nullptr : (ShmSegment *)p;
+    }
+
+    // server: create the segment and wait for a client to attach
+    bool listen(const std::string &nm)
+    {
+        name = nm;
+        owner = true;
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ftruncate(fd, sizeof(ShmSegment)) < 0)
+        {
+            perror("shm_open");
+            return false;
+        }
+        seg = map(fd);
+        if (!seg)
+            return false;
+        // a fresh shm object is zero-filled, which is a valid empty state
+        tx = &seg->down;
+        rx = &seg->up;
+        seg->ready.store(1, std::memory_order_release);
+        while (seg->connected.load(std::memory_order_acquire) == 0)
+            futex(&seg->connected, FUTEX_WAIT, 0);
+        return true;
+    }
+
+    // client: attach to the server's segment, waiting for it to appear
+    bool connect(const std::string &nm, int timeout_ms = 5000)
+    {
+        name = nm;
+        for (int waited = 0;; waited += 10)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd >= 0)
+            {
+                struct stat st;
+                if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmSegment))
+                {
+                    seg = map(fd);
+                    if (seg && seg->ready.load(std::memory_order_acquire))
+                        break;
+                    if (seg)
+                        munmap(seg, sizeof(ShmSegment));
+                    seg = nullptr;
+                }
+                else
+                    close(fd);
+            }
+            if (waited >= timeout_ms)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        tx = &seg->up;
+        rx = &seg->down;
+        seg->connected.store(1, std::memory_order_release);
+        futex(&seg->connected, FUTEX_WAKE, INT_MAX);
+        return true;
+    }
+
+    ssize_t send_all(const char *buffer, size_t len) override { return tx->write_all(buffer, len, spin); }
+    ssize_t recv_all(char *buffer, size_t len) override { return rx->read_all(buffer, len, spin); }
+
+    ~ShmStream() override
+    {
+        if (!seg)
+            return;
+        // both directions: a blocked peer wakes up instead of waiting on a
+        // process that is gone (already buffered data stays readable)
+        tx->close_ring();
+        rx->close_ring();
+        munmap(seg, sizeof(ShmSegment));
+        if (owner)
+            shm_unlink(name.c_str());
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <netinet/in.h>
+#include <linux/tcp.h> // as tcp_info.hpp; netinet/tcp.h clashes with it
+#include <sys/socket.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "perf_common.hpp"
+#include "clock_sync.hpp"
+
+// ---------- Socket options and BDP auto-tuning ----------
+// Buffer sizes and TCP options for a run come either from the command line
+// (--sndbuf, --rcvbuf, --nodelay, --notsent-lowat) or from --autotune: the
+// client measures the round trip with a clock-probe burst and the
+// bottleneck rate with a bulk probe the server times, derives the
+// bandwidth-delay product and applies matching settings on both ends.
+//   probe: MessageHeader{now, TUNE_PROBE, seq = length} + length bytes
+//                                                  -> TuneReply{rate}
+//   apply: MessageHeader{now, TUNE_APPLY} + SockTune (client -> server)
+// Buffers are only ever raised: a fixed SO_RCVBUF switches off Linux's
+// receive autotuning, so a BDP below what the kernel already grants is
+// left to the kernel. TCP's window scale is fixed at the handshake; with
+// the usual tcp_rmem it already allows far more than any of these sizes.
+// Everything applied is read back and printed, the kernel silently caps
+// SO_*BUF at net.core.[rw]mem_max (SO_*BUFFORCE lifts that with
+// CAP_NET_ADMIN, and is tried first).
+
+#define TUNE_PROBE 0xFFFFFFFCu
+#define TUNE_APPLY 0xFFFFFFFBu
+
+struct SockTune
+{
+    uint32_t sndbuf = 0, rcvbuf = 0; // bytes, 0 = kernel default
+    uint32_t notsent_lowat = 0;      // TCP only, 0 = unset
+    uint32_t nodelay = 0;            // TCP only
+};
+
+struct TuneReply
+{
+    double rate_Bps; // receive rate of the probe at the server
+};
+
+inline bool is_tcp(int fd)
+{
+    int domain = 0, type = 0;
+    socklen_t len = sizeof(domain);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    len = sizeof(type);
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+    return (domain == AF_INET || domain == AF_INET6) && type == SOCK_STREAM;
+}
+
+inline int sock_int(int fd, int level, int name)
+{
+    int v = -1;
+    socklen_t len = sizeof(v);
+    getsockopt(fd, level, name, &v, &len);
+    return v;
+}
+
+// sets a buffer size, above net.core.*mem_max if the process may
+inline void set_buffer(int fd, int name, int force_name, uint32_t bytes)
+{
+    int v = (int)std::min<uint32_t>(bytes, INT32_MAX / 2);
+    if (setsockopt(fd, SOL_SOCKET, force_name, &v, sizeof(v)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, name, &v, sizeof(v)) < 0)
+        perror(name == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF");
+}
+
+inline void apply_sock_tune(int fd, const SockTune &t)
+{
+    if (t.sndbuf)
+        set_buffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, t.sndbuf);
+    if (t.rcvbuf)
+        set_buffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, t.rcvbuf);
+    if (!is_tcp(fd))
+        return;
+    int one = 1, lowat = (int)t.notsent_lowat;
+    if (t.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+        perror("TCP_NODELAY");
+    if (t.notsent_lowat && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        perror("TCP_NOTSENT_LOWAT");
+}
+
+// what the socket ended up with: "sndbuf 425984, rcvbuf 131072, nodelay 1, notsent_lowat 262144"
+// (the kernel reports SO_*BUF doubled, for its bookkeeping overhead)
+inline std::string sock_settings(int fd)
+{
+    std::string s = "sndbuf " + std::to_string(sock_int(fd, SOL_SOCKET, SO_SNDBUF)) +
+                    ", rcvbuf " + std::to_string(sock_int(fd, SOL_SOCKET, SO_RCVBUF));
+    if (is_tcp(fd))
+    {
+        int lowat = sock_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+        s += ", nodelay " + std::to_string(sock_int(fd, IPPROTO_TCP, TCP_NODELAY)) +
+             ", notsent_lowat " + (lowat > 0 && lowat != INT32_MAX ? std::to_string(lowat) : std::string("-"));
+    }
+    return s;
+}
+
+// the settings given on the command line
+inline SockTune requested_tune(const PerfOptions &opt)
+{
+    return SockTune{opt.sndbuf, opt.rcvbuf, opt.notsent_lowat, opt.nodelay};
+}
+
+// applies the command-line settings to a socket (a listening socket
+// passes them on to the connections it accepts); true if there were any
+inline bool apply_requested_tune(const PerfOptions &opt, int fd)
+{
+    SockTune t = requested_tune(opt);
+    if (!t.sndbuf && !t.rcvbuf && !t.notsent_lowat && !t.nodelay)
+        return false;
+    apply_sock_tune(fd, t);
+    return true;
+}
+
+// UDP has no window to size from a BDP; --autotune there makes the
+// buffers as large as the host allows so bursts are not dropped at the
+// receiver, and the printout shows where net.core.rmem_max stopped it
+#define UDP_AUTOTUNE_BUF (32u << 20)
+
+// settings for a measured rate and round trip: buffers of two BDPs (one
+// in flight, one being drained), raised only; an unsent backlog of one
+// BDP, at least 128 KB and two messages, so a blocked sender is woken in
+// batches; Nagle off for messages smaller than a segment, which would
+// otherwise wait for the previous ACK
+inline SockTune tune_for_bdp(int fd, double rate_Bps, double rtt_s, size_t msg_size)
+{
+    SockTune t;
+    double bdp = rate_Bps * rtt_s;
+    uint32_t want = (uint32_t)std::clamp(2 * bdp, 64.0 * 1024, 1024.0 * 1024 * 1024);
+    // getsockopt reports twice what was set
+    if (want > (uint32_t)sock_int(fd, SOL_SOCKET, SO_SNDBUF) / 2)
+        t.sndbuf = want;
+    if (want > (uint32_t)sock_int(fd, SOL_SOCKET, SO_RCVBUF) / 2)
+        t.rcvbuf = want;
+    t.notsent_lowat = (uint32_t)std::max({bdp, 128.0 * 1024, 2.0 * (msg_size + sizeof(MessageHeader))});
+    t.nodelay = msg_size + sizeof(MessageHeader) < 1448;
+    return t;
+}
+
+// client side of --autotune; probe_bytes of bulk data. Prints what it
+// found and applied, false on I/O error
+inline bool autotune(Stream &conn, int fd, const char *label, size_t msg_size, size_t probe_bytes,
+                     char *buf, size_t cap)
+{
+    ClockSync rtt;
+    if (!rtt.burst(conn, 8))
+        return false;
+    double rtt_s = 2 * rtt.model().error_ns / 1e9; // min delay of the burst
+
+    MessageHeader probe{now_ns(), TUNE_PROBE, (uint32_t)probe_bytes};
+    if (conn.send_all((char *)&probe, sizeof(probe)) <= 0)
+        return false;
+    for (size_t left = probe_bytes; left > 0;)
+    {
+        size_t chunk = std::min(left, cap);
+        if (conn.send_all(buf, chunk) <= 0)
+            return false;
+        left -= chunk;
+    }
+    TuneReply reply;
+    if (conn.recv_all((char *)&reply, sizeof(reply)) <= 0)
+        return false;
+
+    SockTune t = tune_for_bdp(fd, reply.rate_Bps, rtt_s, msg_size);
+    apply_sock_tune(fd, t);
+    MessageHeader apply{now_ns(), TUNE_APPLY};
+    if (conn.send_all((char *)&apply, sizeof(apply)) <= 0 || conn.send_all((char *)&t, sizeof(t)) <= 0)
+        return false;
+    printf("[%s] autotune: rtt %.1f us, bottleneck %.1f MB/s, BDP %.0f KB; %s\n", label, rtt_s * 1e6,
+           reply.rate_Bps / 1e6, reply.rate_Bps * rtt_s / 1024, sock_settings(fd).c_str());
+    return true;
+}
+
+// server side of a TUNE_PROBE whose header arrived at t0
+inline bool autotune_probe_reply(Stream &conn, const MessageHeader &probe, uint64_t t0, char *buf,
+                                 size_t cap)
+{
+    if (recv_payload(conn, buf, cap, probe.seq) < 0)
+        return false;
+    double secs = (now_ns() - t0) / 1e9;
+    TuneReply r{secs > 0 ? probe.seq / secs : 0};
+    return conn.send_all((char *)&r, sizeof(r)) > 0;
+}
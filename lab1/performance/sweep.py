@@ -0,0 +1,123 @@
+"""Socket option sweep: runs server and client on this host over every
+combination of the given buffer sizes and TCP options, repeats each a few
+times, and reports the best configuration per message size.
+
+    python3 sweep.py --mode tcp --msg 1,64 --total 20480 --runs 3 \\
+        --sndbuf 0,262144,4194304 --rcvbuf 0,262144,4194304 \\
+        --nodelay 0,1 --notsent-lowat 0,131072 --autotune
+
+0 means "leave to the kernel". The score is the median over the runs of
+the mean of upload (server side) and download (client side) throughput;
+runs that fail or time out count as 0. The binaries are the non-TXT
+builds of client.cpp and server.cpp.
+"""
+import argparse
+import itertools
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+UPLOAD = re.compile(r"\] Upload: .*=> ([0-9.e+]+) KB/s")
+DOWNLOAD = re.compile(r"\] Download throughput: ([0-9.e+]+) KB/s")
+
+
+def ints(text):
+    return [int(v) for v in text.split(",") if v != ""]
+
+
+def flags(combo):
+    sndbuf, rcvbuf, nodelay, lowat, auto = combo
+    out = []
+    if auto:
+        out.append("--autotune")
+    if sndbuf:
+        out.append(f"--sndbuf={sndbuf}")
+    if rcvbuf:
+        out.append(f"--rcvbuf={rcvbuf}")
+    if nodelay:
+        out.append("--nodelay")
+    if lowat:
+        out.append(f"--notsent-lowat={lowat}")
+    return out
+
+
+def run_once(args, port, msg_kb, combo):
+    """(upload KB/s, download KB/s), 0 for a side that did not report"""
+    opts = flags(combo)
+    # over a stream autotune is driven by the client and the server follows
+    # what it is sent; a UDP server gets nothing in-band and has to enlarge
+    # its own receive buffer, so it keeps the flag
+    server_opts = opts if args.mode == "udp" else [o for o in opts if o != "--autotune"]
+    server = subprocess.Popen([args.server, args.mode, str(port), str(msg_kb), str(args.total)] + server_opts,
+                              stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    time.sleep(0.3)
+    try:
+        client = subprocess.run([args.client, args.mode, args.host, str(port), str(msg_kb), str(args.total)] + opts,
+                                stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True,
+                                timeout=args.timeout)
+        client_out = client.stdout
+    except subprocess.TimeoutExpired:
+        client_out = ""
+    try:
+        server_out, _ = server.communicate(timeout=args.timeout)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server_out, _ = server.communicate()
+    up = UPLOAD.search(server_out)
+    down = DOWNLOAD.search(client_out)
+    return (float(up.group(1)) if up else 0.0, float(down.group(1)) if down else 0.0)
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Sweep socket options and report the best per message size.")
+    ap.add_argument("--client", default="./client")
+    ap.add_argument("--server", default="./server")
+    ap.add_argument("--mode", default="tcp", choices=["tcp", "udp", "uds"])
+    ap.add_argument("--host", default="127.0.0.1")
+    ap.add_argument("--port", type=int, default=7300, help="first port, one per run")
+    ap.add_argument("--msg", default="1,64", help="message sizes, KB")
+    ap.add_argument("--total", type=int, default=20480, help="KB per direction")
+    ap.add_argument("--runs", type=int, default=3)
+    ap.add_argument("--timeout", type=float, default=60)
+    ap.add_argument("--sndbuf", default="0")
+    ap.add_argument("--rcvbuf", default="0")
+    ap.add_argument("--nodelay", default="0", help="0,1 to try both (tcp)")
+    ap.add_argument("--notsent-lowat", default="0", help="bytes (tcp)")
+    ap.add_argument("--autotune", action="store_true", help="also try the client's --autotune")
+    args = ap.parse_args()
+
+    tcp = args.mode == "tcp"
+    combos = list(itertools.product(ints(args.sndbuf), ints(args.rcvbuf),
+                                    ints(args.nodelay) if tcp else [0],
+                                    ints(args.notsent_lowat) if tcp else [0], [0]))
+    if args.autotune:
+        combos.append((0, 0, 0, 0, 1))
+
+    port = args.port
+    for msg_kb in ints(args.msg):
+        print(f"== {args.mode}, {msg_kb} KB messages, {args.total} KB each way, {args.runs} runs")
+        results = []
+        for combo in combos:
+            scores, ups, downs = [], [], []
+            for _ in range(args.runs):
+                up, down = run_once(args, port, msg_kb, combo)
+                port += 1
+                ups.append(up)
+                downs.append(down)
+                scores.append((up + down) / 2)
+            score = statistics.median(scores)
+            results.append((score, combo))
+            print(f"  {' '.join(flags(combo)) or '(kernel defaults)':<60} "
+                  f"up {statistics.median(ups):>12.0f}  down {statistics.median(downs):>12.0f}  "
+                  f"score {score:>12.0f} KB/s")
+        best = max(results, key=lambda r: r[0])
+        base = next((s for s, c in results if not any(c)), None)
+        gain = f" ({(best[0] - base) / base * 100:+.1f}% over defaults)" if base else ""
+        print(f"  best for {msg_kb} KB: {' '.join(flags(best[1])) or '(kernel defaults)'}{gain}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
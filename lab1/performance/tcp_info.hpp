@@ -0,0 +1,172 @@
+#pragma once
+#include <linux/tcp.h> // glibc's netinet/tcp.h lacks the newer tcp_info fields
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ---------- TCP_INFO sampling ----------
+// A background thread reads getsockopt(TCP_INFO) on a connected socket at a
+// fixed period for the length of a transfer, so a throughput number comes
+// with the cwnd/rtt/retransmit/limit history that explains it. Fields the
+// running kernel does not fill in stay zero.
+
+struct TcpSample
+{
+    double t_ms; // since sampling started
+    uint32_t cwnd, ssthresh, srtt_us, rttvar_us;
+    uint32_t retransmits, total_retrans, unacked;
+    uint64_t delivery_rate, pacing_rate;                   // bytes/s
+    uint64_t busy_us, rwnd_limited_us, sndbuf_limited_us; // cumulative
+    uint64_t bytes_acked, bytes_received;
+};
+
+inline bool read_tcp_info(int fd, TcpSample &s)
+{
+    tcp_info ti{};
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+        return false;
+    s.cwnd = ti.tcpi_snd_cwnd;
+    s.ssthresh = ti.tcpi_snd_ssthresh;
+    s.srtt_us = ti.tcpi_rtt;
+    s.rttvar_us = ti.tcpi_rttvar;
+    s.retransmits = ti.tcpi_retransmits;
+    s.total_retrans = ti.tcpi_total_retrans;
+    s.unacked = ti.tcpi_unacked;
+    s.delivery_rate = ti.tcpi_delivery_rate;
+    s.pacing_rate = ti.tcpi_pacing_rate;
+    s.busy_us = ti.tcpi_busy_time;
+    s.rwnd_limited_us = ti.tcpi_rwnd_limited;
+    s.sndbuf_limited_us = ti.tcpi_sndbuf_limited;
+    s.bytes_acked = ti.tcpi_bytes_acked;
+    s.bytes_received = ti.tcpi_bytes_received;
+    return true;
+}
+
+// Selects the congestion control algorithm of a socket (inherited by the
+// connections a listening socket accepts).
+inline bool set_congestion_control(int fd, const std::string &name)
+{
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name.c_str(), name.size()) == 0)
+        return true;
+    perror(("TCP_CONGESTION " + name).c_str());
+    fprintf(stderr, "  (see /proc/sys/net/ipv4/tcp_available_congestion_control)\n");
+    return false;
+}
+
+inline std::string congestion_control(int fd)
+{
+    char name[16] = {}; // TCP_CA_NAME_MAX
+    socklen_t len = sizeof(name);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) < 0)
+        return "?";
+    return std::string(name, strnlen(name, len));
+}
+
+class TcpInfoSampler
+{
+public:
+    ~TcpInfoSampler() { stop(); }
+
+    void start(int fd, int period_ms)
+    {
+        samples.reserve(4096);
+        t0 = std::chrono::steady_clock::now();
+        worker = std::thread([this, fd, period_ms]()
+                             {
+                                 std::unique_lock<std::mutex> lock(mtx);
+                                 do
+                                     sample(fd);
+                                 while (!cv.wait_for(lock, std::chrono::milliseconds(period_ms),
+                                                     [this]() { return stopping; }));
+                                 sample(fd); // the state the transfer ended in
+                             });
+    }
+
+    void stop()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    // appends the series to a CSV file, writing the column header first
+    // when the file is new
+    bool write_csv(const std::string &path, const std::string &label) const
+    {
+        FILE *f = fopen(path.c_str(), "a");
+        if (!f)
+        {
+            perror(path.c_str());
+            return false;
+        }
+        if (ftell(f) == 0)
+            fprintf(f, "label,t_ms,cwnd,ssthresh,srtt_us,rttvar_us,retransmits,total_retrans,unacked,"
+                       "delivery_rate_Bps,pacing_rate_Bps,busy_us,rwnd_limited_us,sndbuf_limited_us,"
+                       "bytes_acked,bytes_received\n");
+        for (const TcpSample &s : samples)
+            fprintf(f, "%s,%.3f,%u,%u,%u,%u,%u,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                    label.c_str(), s.t_ms, s.cwnd, s.ssthresh, s.srtt_us, s.rttvar_us,
+                    s.retransmits, s.total_retrans, s.unacked,
+                    (unsigned long long)s.delivery_rate, (unsigned long long)s.pacing_rate,
+                    (unsigned long long)s.busy_us, (unsigned long long)s.rwnd_limited_us,
+                    (unsigned long long)s.sndbuf_limited_us, (unsigned long long)s.bytes_acked,
+                    (unsigned long long)s.bytes_received);
+        fclose(f);
+        return true;
+    }
+
+    // one line: cwnd range, srtt, retransmits and where the sender was limited
+    std::string summary() const
+    {
+        if (samples.empty())
+            return "no TCP_INFO samples";
+        uint32_t cwnd_min = UINT32_MAX, cwnd_max = 0, srtt_max = 0;
+        double srtt_sum = 0;
+        for (const TcpSample &s : samples)
+        {
+            cwnd_min = std::min(cwnd_min, s.cwnd);
+            cwnd_max = std::max(cwnd_max, s.cwnd);
+            srtt_max = std::max(srtt_max, s.srtt_us);
+            srtt_sum += s.srtt_us;
+        }
+        const TcpSample &last = samples.back();
+        auto pct = [&](uint64_t us)
+        { return last.busy_us ? std::to_string(100 * us / last.busy_us) + "%" : std::string("-"); };
+        return std::to_string(samples.size()) + " samples, cwnd " + std::to_string(cwnd_min) + ".." +
+               std::to_string(cwnd_max) + ", srtt avg " + std::to_string((int)(srtt_sum / samples.size())) +
+               " us max " + std::to_string(srtt_max) + " us, " + std::to_string(last.total_retrans) +
+               " retransmits, busy " + std::to_string(last.busy_us / 1000) + " ms (rwnd-limited " +
+               pct(last.rwnd_limited_us) + ", sndbuf-limited " + pct(last.sndbuf_limited_us) + ")";
+    }
+
+private:
+    void sample(int fd)
+    {
+        TcpSample s{};
+        s.t_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (read_tcp_info(fd, s))
+            samples.push_back(s);
+    }
+
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::chrono::steady_clock::time_point t0;
+    std::vector<TcpSample> samples;
+};
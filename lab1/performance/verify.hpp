@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "perf_common.hpp"
+#include "crc32c.hpp"
+
+// ---------- Payload verification ----------
+// With --verify[=SEED] the sender fills its buffer with the seeded
+// pattern, writes the sequence number over the first payload bytes of
+// every message (so no two are alike) and puts the CRC32C of the payload
+// in MessageHeader::crc; the receiver recomputes it, chunk by chunk when
+// the payload is larger than its buffer, and counts mismatches. The time
+// spent in the CRC is measured on both ends, which is what verification
+// costs the transfer. One PayloadCheck per direction and thread.
+
+class PayloadCheck
+{
+public:
+    explicit PayloadCheck(const PerfOptions &opt) : on(opt.verify), seed(opt.verify_seed) {}
+
+    bool enabled() const { return on; }
+
+    // sender: the pattern into a payload buffer, once
+    void fill(char *payload, size_t n) const
+    {
+        if (on)
+            fill_pattern(payload, n, seed);
+    }
+
+    // sender, per message: stamps seq and returns the CRC for the header
+    // (0 when off)
+    uint32_t seal(char *payload, size_t n, uint32_t seq)
+    {
+        if (!on)
+            return 0;
+        uint64_t t0 = now_ns();
+        memcpy(payload, &seq, std::min(sizeof(seq), n));
+        uint32_t crc = crc32c(0, payload, n);
+        account(t0, n);
+        sealed++;
+        return crc;
+    }
+
+    // receiver, payload in one piece (UDP)
+    void check(const MessageHeader &hdr, const char *payload, size_t n)
+    {
+        if (!on)
+            return;
+        uint64_t t0 = now_ns();
+        uint32_t crc = crc32c(0, payload, n);
+        account(t0, n);
+        verdict(hdr, n == hdr.payload_size && crc == hdr.crc);
+    }
+
+    // receiver, stream: recv_payload with the CRC taken over each chunk
+    ssize_t recv(Stream &conn, const MessageHeader &hdr, char *buf, size_t cap)
+    {
+        if (!on)
+            return recv_payload(conn, buf, cap, hdr.payload_size);
+        uint32_t crc = 0;
+        for (size_t left = hdr.payload_size; left > 0;)
+        {
+            size_t chunk = std::min(left, cap);
+            if (conn.recv_all(buf, chunk) <= 0)
+                return -1;
+            uint64_t t0 = now_ns();
+            crc = crc32c(crc, buf, chunk);
+            account(t0, chunk);
+            left -= chunk;
+        }
+        verdict(hdr, crc == hdr.crc);
+        return hdr.payload_size;
+    }
+
+    // "verify (sse4.2, seed 1): 1024 checked, 0 corrupt; crc 12.1 ms for 64.0 MB
+    // (5.3 GB/s), 4.1% of 0.29 s" -- seconds 0 leaves out the share, messages
+    // sealed rather than checked on a sender
+    std::string report(double seconds) const
+    {
+        char line[224];
+        int n = snprintf(line, sizeof(line), "verify (%s, seed %llu): ", crc32c_impl_name(),
+                         (unsigned long long)seed);
+        if (checked)
+            n += snprintf(line + n, sizeof(line) - n, "%llu checked, %llu corrupt",
+                          (unsigned long long)checked, (unsigned long long)corrupt);
+        else
+            n += snprintf(line + n, sizeof(line) - n, "%llu sealed", (unsigned long long)sealed);
+        n += snprintf(line + n, sizeof(line) - n, "; crc %.1f ms for %.1f MB (%.2f GB/s)", busy_ns / 1e6,
+                      bytes / 1048576.0, busy_ns ? bytes / (double)busy_ns : 0);
+        if (seconds > 0)
+            snprintf(line + n, sizeof(line) - n, ", %.1f%% of %.2f s", busy_ns / 1e7 / seconds, seconds);
+        return line;
+    }
+
+private:
+    void account(uint64_t t0, size_t n)
+    {
+        busy_ns += now_ns() - t0;
+        bytes += n;
+    }
+
+    // the first few mismatches are named, a broken link would flood the output
+    void verdict(const MessageHeader &hdr, bool ok)
+    {
+        checked++;
+        if (ok)
+            return;
+        if (++corrupt <= 5)
+            fprintf(stderr, "verify: message %u (%u bytes) corrupt, crc %08x expected\n", hdr.seq,
+                    hdr.payload_size, hdr.crc);
+    }
+
+    bool on;
+    uint64_t seed;
+    uint64_t checked = 0, corrupt = 0;
+    uint64_t sealed = 0, bytes = 0, busy_ns = 0;
+};
@@ -0,0 +1,400 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "common.hpp"
+#include "async_io.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+// ---- Open-loop trace replay ----
+// Every session of the trace is started at its recorded connect time,
+// whether or not earlier sessions have finished, so a slow server cannot
+// slow the offered load down. Latency is measured from the moment a request
+// *should* have been sent (connect time + recorded handshake and UDP gap),
+// not from when it actually was: time a request spends waiting behind a
+// slow handshake or a previous request of its keep-alive session is counted
+// (coordinated-omission correction). The uncorrected service time is
+// reported next to it.
+
+using replay_clock = std::chrono::steady_clock;
+
+struct ReplaySession
+{
+    uint64_t connect_ns;
+    uint32_t handshake_us;
+    uint32_t session;
+    bool keep_alive;
+    std::vector<const TraceRecord *> requests; // by udp_gap_us
+    const TraceRecord *end = nullptr;          // TRACE_SESSION record, if any
+};
+
+struct ReplayStats
+{
+    int sessions = 0, busy = 0, failed = 0;
+    int sent = 0, acked = 0, lost = 0, unanswered = 0; // unanswered: non-TYPE_3, no ACK expected
+    std::vector<double> corrected_ms, service_ms, launch_lag_ms;
+};
+
+struct ReplayConfig
+{
+    double speed = 1.0; // > 1 compresses the trace's timeline
+    std::chrono::milliseconds ack_timeout{3000};
+};
+
+// records grouped back into sessions, ordered by connect time
+std::vector<ReplaySession> plan_sessions(const TraceFile &trace)
+{
+    std::vector<ReplaySession> plan;
+    std::vector<const TraceRecord *> recs;
+    for (const TraceRecord *r = trace.begin(); r != trace.end(); r++)
+        recs.push_back(r);
+    std::sort(recs.begin(), recs.end(), [](const TraceRecord *a, const TraceRecord *b)
+              { return std::tie(a->connect_ns, a->session, a->udp_gap_us) <
+                       std::tie(b->connect_ns, b->session, b->udp_gap_us); });
+    // the replay starts with the first connect, not with the recording
+    uint64_t first = recs.empty() ? 0 : recs.front()->connect_ns;
+    for (const TraceRecord *r : recs)
+    {
+        if (plan.empty() || plan.back().connect_ns != r->connect_ns - first ||
+            plan.back().session != r->session)
+            plan.push_back(ReplaySession{r->connect_ns - first, r->handshake_us, r->session,
+                                         (r->flags & TRACE_KEEPALIVE) != 0, {}});
+        if (r->flags & TRACE_SESSION)
+            plan.back().end = r;
+        else
+            plan.back().requests.push_back(r);
+    }
+    return plan;
+}
+
+size_t count_datagrams(const std::vector<ReplaySession> &plan)
+{
+    size_t n = 0;
+    for (const ReplaySession &s : plan)
+        n += s.requests.size();
+    return n;
+}
+
+replay_clock::duration scaled(uint64_t ns, double speed)
+{
+    return std::chrono::duration_cast<replay_clock::duration>(std::chrono::nanoseconds((uint64_t)(ns / speed)));
+}
+
+double ms_between(replay_clock::time_point from, replay_clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// the executor's timers have millisecond resolution: round up so nothing
+// goes out early, the lateness that adds shows up in the launch lag
+Task<void> sleep_until(Executor &ex, replay_clock::time_point t)
+{
+    auto d = std::chrono::ceil<std::chrono::milliseconds>(t - replay_clock::now());
+    if (d.count() > 0)
+        co_await ex.sleep_for(d);
+}
+
+Task<void> replay_session(Executor &ex, sockaddr_in server_addr, const ReplaySession &s,
+                          replay_clock::time_point start, const ReplayConfig &cfg, ReplayStats &st)
+{
+    const IoOptions opt{std::chrono::milliseconds(10000)};
+    int rv = -1;
+    int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_sock >= 0)
+        rv = co_await async_connect(ex, tcp_sock, (sockaddr *)&server_addr, sizeof(server_addr), opt);
+    if (rv == 0)
+        rv = co_await async_client_handshake(ex, tcp_sock, opt, s.keep_alive);
+    if (tcp_sock >= 0)
+        close(tcp_sock);
+
+    if (rv <= 0)
+    {
+        if (rv == -3)
+            st.busy++;
+        else
+            st.failed++;
+        st.lost += s.requests.size();
+        co_return;
+    }
+
+    int udp_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    server_addr.sin_port = htons(rv);
+    char buf[sizeof(int32_t) * 2 + MSG_LEN];
+    std::string body;
+    auto at = [&](uint32_t since_welcome_us)
+    { return start + scaled(s.connect_ns + ((uint64_t)s.handshake_us + since_welcome_us) * 1000, cfg.speed); };
+    for (size_t i = 0; i < s.requests.size(); i++)
+    {
+        const TraceRecord *r = s.requests[i];
+        auto intended = at(r->udp_gap_us);
+        co_await sleep_until(ex, intended);
+
+        // keep-alive requests are tagged like keepalive_conv's, the
+        // recorded length already counts the tag
+        std::string tag = "#" + to_string(i);
+        body = s.keep_alive ? tag + " " : "";
+        body.resize(std::min<size_t>(std::max<size_t>(r->payload, body.size()), MSG_LEN), 'x');
+        message msg{};
+        msg.set((msg_type)r->type, body);
+        int n = msg.printToBuf(buf, sizeof buf);
+        auto sent_at = replay_clock::now();
+        sendto(udp_sock, buf, n, 0, (sockaddr *)&server_addr, sizeof(server_addr));
+        st.sent++;
+        if (msg.type != msg_type::TYPE_3)
+        {
+            st.unanswered++;
+            continue;
+        }
+
+        message ack{};
+        sockaddr_in from{};
+        socklen_t fromlen;
+        // a late ACK of an earlier request is skipped
+        do
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(sent_at + cfg.ack_timeout - replay_clock::now());
+            rv = co_await async_recvfrom_message(ex, udp_sock, ack, from, fromlen,
+                                                 IoOptions{std::max(left, std::chrono::milliseconds(1))});
+        } while (rv == 0 && s.keep_alive && !ack_matches(ack, tag));
+        auto now = replay_clock::now();
+        if (rv == 0 && ack.type == msg_type::TYPE_4)
+        {
+            st.acked++;
+            st.corrected_ms.push_back(ms_between(intended, now));
+            st.service_ms.push_back(ms_between(sent_at, now));
+        }
+        else
+            st.lost++;
+    }
+    // hold the session as long as the recorded one lasted
+    if (s.end)
+        co_await sleep_until(ex, at(s.end->udp_gap_us));
+    if (s.keep_alive)
+    {
+        message bye{};
+        bye.set(msg_type::TYPE_6, "");
+        int n = bye.printToBuf(buf, sizeof buf);
+        sendto(udp_sock, buf, n, 0, (sockaddr *)&server_addr, sizeof(server_addr));
+    }
+    close(udp_sock);
+    st.sessions++;
+}
+
+// starts every session at its own time and never waits for one to finish
+Task<void> launcher(Executor &ex, sockaddr_in server_addr, const std::vector<ReplaySession> &plan,
+                    replay_clock::time_point start, const ReplayConfig &cfg, ReplayStats &st)
+{
+    for (const ReplaySession &s : plan)
+    {
+        auto intended = start + scaled(s.connect_ns, cfg.speed);
+        co_await sleep_until(ex, intended);
+        st.launch_lag_ms.push_back(ms_between(intended, replay_clock::now()));
+        ex.spawn(replay_session(ex, server_addr, s, start, cfg, st));
+    }
+}
+
+void print_percentiles(const char *label, std::vector<double> &v)
+{
+    if (v.empty())
+        return;
+    std::sort(v.begin(), v.end());
+    auto pct = [&](double p)
+    { return v[std::min(v.size() - 1, (size_t)(p * v.size()))]; };
+    cout << label << " p50=" << pct(0.5) << " p90=" << pct(0.9) << " p99=" << pct(0.99)
+         << " p99.9=" << pct(0.999) << " max=" << v.back() << "\n";
+}
+
+int run_replay(const char *server_ip, int server_port, const std::string &path, const ReplayConfig &cfg)
+{
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0)
+    {
+        cerr << "invalid server ip " << server_ip << "\n";
+        return 1;
+    }
+    TraceFile trace;
+    std::string why;
+    if (!trace.open(path, why))
+    {
+        cerr << why << "\n";
+        return 1;
+    }
+    std::vector<ReplaySession> plan = plan_sessions(trace);
+    if (plan.empty())
+    {
+        cerr << path << " has no records\n";
+        return 1;
+    }
+
+    Executor ex;
+    ReplayStats st;
+    auto start = replay_clock::now();
+    ex.spawn(launcher(ex, server_addr, plan, start, cfg, st));
+    ex.run();
+    double secs = std::chrono::duration<double>(replay_clock::now() - start).count();
+    double span = scaled(plan.back().connect_ns, cfg.speed).count() / 1e9;
+
+    cout << "replayed " << plan.size() << " sessions / " << count_datagrams(plan) << " datagrams in "
+         << secs << "s (trace span " << span << "s at speed " << cfg.speed << ")\n";
+    cout << "sessions ok=" << st.sessions << " busy=" << st.busy << " failed=" << st.failed
+         << " | requests sent=" << st.sent << " acked=" << st.acked << " lost=" << st.lost
+         << " no-ack-expected=" << st.unanswered << "\n";
+    print_percentiles("latency ms (from intended send):", st.corrected_ms);
+    print_percentiles("service ms (from actual send):  ", st.service_ms);
+    print_percentiles("launch lag ms:                  ", st.launch_lag_ms);
+    return st.failed == 0 && st.lost == 0 ? 0 : 1;
+}
+
+// ---- Synthetic traces ----
+// Bursty arrivals: bursts start as a Poisson process and carry a
+// geometrically distributed number of sessions (mean `burst`) that connect
+// within a fraction of a millisecond of each other. burst=1 is plain Poisson.
+struct GenConfig
+{
+    double burst = 1;
+    uint32_t gap_ms = 10;     // handshake -> first datagram, and between requests
+    uint32_t requests = 1;    // per session, > 1 makes keep-alive sessions
+    uint32_t payload = 22;
+    uint64_t seed = 1;
+};
+
+int generate(const std::string &path, size_t sessions, double rate, const GenConfig &g)
+{
+    TraceWriter out;
+    if (!out.open(path))
+    {
+        cerr << "cannot write " << path << "\n";
+        return 1;
+    }
+    std::mt19937_64 rng(g.seed);
+    std::exponential_distribution<double> next_burst(rate / g.burst);
+    std::geometric_distribution<int> extra(1.0 / g.burst);
+    std::exponential_distribution<double> spread(1.0 / 200e-6); // within a burst
+    double t = 0;
+    for (size_t i = 0; i < sessions;)
+    {
+        t += next_burst(rng);
+        double u = t;
+        for (int k = 1 + extra(rng); k > 0 && i < sessions; k--, i++)
+        {
+            for (uint32_t r = 0; r < g.requests; r++)
+                out.record(TraceRecord{(uint64_t)(u * 1e9), 200, (r + 1) * g.gap_ms * 1000, g.payload,
+                                       (int32_t)msg_type::TYPE_3, (uint32_t)i,
+                                       g.requests > 1 ? TRACE_KEEPALIVE : 0u});
+            // a keep-alive session closes one gap after its last request
+            if (g.requests > 1)
+                out.record(TraceRecord{(uint64_t)(u * 1e9), 200, (g.requests + 1) * g.gap_ms * 1000, 0, 0,
+                                       (uint32_t)i, TRACE_SESSION | TRACE_KEEPALIVE});
+            u += spread(rng);
+        }
+    }
+    cout << "wrote " << sessions << " sessions spanning " << t << "s to " << path << "\n";
+    return 0;
+}
+
+// arrival statistics of a trace: rate, burstiness, busiest 100 ms
+int dump(const std::string &path)
+{
+    TraceFile trace;
+    std::string why;
+    if (!trace.open(path, why))
+    {
+        cerr << why << "\n";
+        return 1;
+    }
+    std::vector<ReplaySession> plan = plan_sessions(trace);
+    cout << path << ": " << count_datagrams(plan) << " datagrams, " << plan.size() << " sessions\n";
+    if (plan.size() < 2)
+        return 0;
+    double span = (plan.back().connect_ns - plan.front().connect_ns) / 1e9;
+    std::vector<double> gaps;
+    for (size_t i = 1; i < plan.size(); i++)
+        gaps.push_back((plan[i].connect_ns - plan[i - 1].connect_ns) / 1e6);
+    double mean = 0, var = 0;
+    for (double g : gaps)
+        mean += g;
+    mean /= gaps.size();
+    for (double g : gaps)
+        var += (g - mean) * (g - mean);
+    var /= gaps.size();
+    size_t peak = 0;
+    for (size_t i = 0, j = 0; i < plan.size(); i++)
+    {
+        while (plan[i].connect_ns - plan[j].connect_ns > 100000000)
+            j++;
+        peak = std::max(peak, i - j + 1);
+    }
+    size_t keep_alive = std::count_if(plan.begin(), plan.end(), [](const ReplaySession &s)
+                                      { return s.keep_alive; });
+    cout << "span " << span << "s, mean rate " << (plan.size() - 1) / span << " sessions/s"
+         << ", inter-arrival cv " << (mean > 0 ? sqrt(var) / mean : 0)
+         << " (1 = Poisson, higher = burstier)"
+         << ", peak " << peak * 10 << " sessions/s over 100 ms"
+         << ", keep-alive sessions " << keep_alive << "\n";
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // --key=value options, the rest is positional
+    ReplayConfig cfg;
+    GenConfig gen;
+    vector<char *> args;
+    for (int i = 0; i < argc; i++)
+    {
+        string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == string::npos)
+        {
+            args.push_back(argv[i]);
+            continue;
+        }
+        string key = arg.substr(2, eq - 2), val = arg.substr(eq + 1);
+        if (key == "speed")
+            cfg.speed = std::max(1e-3, stod(val));
+        else if (key == "ack-timeout")
+            cfg.ack_timeout = std::chrono::milliseconds(stoi(val));
+        else if (key == "burst")
+            gen.burst = std::max(1.0, stod(val));
+        else if (key == "gap-ms")
+            gen.gap_ms = stoul(val);
+        else if (key == "keep-alive")
+            gen.requests = std::max(1ul, stoul(val));
+        else if (key == "payload")
+            gen.payload = std::min<unsigned long>(MSG_LEN, stoul(val));
+        else if (key == "seed")
+            gen.seed = stoull(val);
+        else
+        {
+            cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
+    if (argc >= 3 && string(argv[1]) == "dump")
+        return dump(argv[2]);
+    if (argc >= 5 && string(argv[1]) == "gen")
+        return generate(argv[2], stoul(argv[3]), stod(argv[4]), gen);
+    if (argc >= 4)
+        return run_replay(argv[1], stoi(argv[2]), argv[3], cfg);
+
+    cerr << "Usage: " << argv[0] << " <server_ip> <server_port> <trace> [--speed=F] [--ack-timeout=MS]\n"
+         << "       " << argv[0] << " gen <trace> <sessions> <sessions_per_sec> [--burst=K] [--gap-ms=MS]\n"
+         << "             [--keep-alive=REQUESTS] [--payload=BYTES] [--seed=N]\n"
+         << "       " << argv[0] << " dump <trace>\n"
+         << "Record a trace from real clients with: server PORT ... --trace=FILE\n";
+    return 1;
+}
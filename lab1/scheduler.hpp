@@ -0,0 +1,112 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <unordered_set>
+
+// ---- Scheduling passes ----
+// The selection logic of the fcfs and rr policies, kept apart from the
+// server's globals so bench.cpp can time it on its own. `Clients` is an
+// indexable container whose entries have a `state` (Entry::State) and a
+// `key.port`; `take(i)` hands entry i to the dispatch stage. The caller
+// holds whatever lock guards the container.
+
+// ---- Client window ----
+// The server's client list. Every registered client gets the next index,
+// which stays its id for good (dispatch jobs, session keys); finished
+// entries are dropped from the front, so only the clients still in flight
+// are kept however long the server runs. An entry is dropped only once it
+// and every entry before it are finished. deque keeps the addresses of the
+// remaining entries stable.
+template <typename T>
+class ClientWindow
+{
+public:
+    using value_type = T;
+
+    T &operator[](size_t i) { return items[i - base]; }
+    size_t first() const { return base; }               // oldest index still held
+    size_t size() const { return base + items.size(); } // one past the newest index
+    bool empty() const { return items.empty(); }
+    T &emplace_back() { return items.emplace_back(); }
+
+    // drops the finished prefix, returns how many entries went
+    template <typename Finished>
+    size_t reclaim(Finished &&finished)
+    {
+        size_t n = 0;
+        for (; !items.empty() && finished(items.front()); n++)
+        {
+            items.pop_front();
+            base++;
+        }
+        return n;
+    }
+
+private:
+    std::deque<T> items;
+    size_t base = 0;
+};
+
+// index of the oldest entry, 0 for plain containers
+template <typename Clients>
+size_t first_index(const Clients &clients)
+{
+    if constexpr (requires { clients.first(); })
+        return clients.first();
+    else
+        return 0;
+}
+
+enum class FcfsStep
+{
+    IDLE,    // nothing registered past cur
+    SKIPPED, // cur was invalid and has been skipped
+    TOOK,    // a run of arrived entries was taken
+    WAITING  // cur has not arrived yet
+};
+
+// One fcfs decision at position cur: skips an invalid entry or takes the
+// whole run of consecutive arrived entries.
+template <typename Clients, typename Take>
+FcfsStep fcfs_pass(Clients &clients, size_t &cur, Take &&take)
+{
+    using State = typename Clients::value_type::State;
+    if (cur < first_index(clients))
+        cur = first_index(clients); // skipped entries were reclaimed
+    if (cur >= clients.size())
+        return FcfsStep::IDLE;
+    if (clients[cur].state == State::INVALID)
+    {
+        ++cur; // timed out or sent garbage, nothing to wait for
+        return FcfsStep::SKIPPED;
+    }
+    if (clients[cur].state != State::ARRIVED)
+        return FcfsStep::WAITING;
+    while (cur < clients.size() && clients[cur].state == State::ARRIVED)
+        take(cur++);
+    return FcfsStep::TOOK;
+}
+
+// One full turn of the rr ring starting at cur, giving every session with
+// an arrived request its "time quantum" (one send per turn); the further
+// requests of a keep-alive session wait for the next turn. `served` is
+// scratch space, empty on entry and on return. Returns the number taken.
+template <typename Clients, typename Take>
+size_t rr_turn(Clients &clients, size_t &cur, std::unordered_set<uint16_t> &served, Take &&take)
+{
+    using State = typename Clients::value_type::State;
+    size_t first = first_index(clients), n = clients.size() - first, taken = 0;
+    for (size_t k = 0; k < n; k++, cur++)
+    {
+        cur = first + (cur >= first ? (cur - first) % n : 0);
+        if (clients[cur].state == State::ARRIVED &&
+            served.insert(clients[cur].key.port).second)
+        {
+            take(cur);
+            taken++;
+        }
+    }
+    served.clear();
+    return taken;
+}
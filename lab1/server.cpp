@@ -5,12 +5,25 @@
 #include <iostream>
 #include <unistd.h>
 #include "common.hpp"
+#include "session_index.hpp"
+#include "admission.hpp"
+#include "percore.hpp"
+#include "async_io.hpp"
+#include "trace.hpp"
+#include "scheduler.hpp"
+#include "fragment.hpp"
 #include <thread>
 #include <vector>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <unordered_set>
 using namespace std;
 
-#define BACKLOGS 10
 
 struct ClientInfo
 {
@@ -19,29 +32,40 @@ struct ClientInfo
         INVALID,
         NOT_ARRIVED,
         ARRIVED,
+        DISPATCHED, // handed to the dispatch stage, ACK not sent yet
         DONE
     };
-    uint16_t socket;
+    int socket;
     std::string ip; // client IP address
     uint16_t port;  // client UDP port
     message msg;    // the Type 3 message payload
-    State state = ClientInfo::State::NOT_ARRIVED;
+    // written by the arrival path without clients_mtx; the fields above are
+    // published by the store to ARRIVED
+    std::atomic<State> state = ClientInfo::State::NOT_ARRIVED;
     sockaddr_in addr;
     socklen_t addrlen;
+    SessionKey key;
+    // set for the requests of a keep-alive session: `socket` is shared and
+    // stays open after the ACK, and the session keeps its admission slot
+    std::shared_ptr<SessionSocket> keep_alive;
+    // when the TCP connection was accepted and the WELCOME went out
+    std::chrono::steady_clock::time_point accepted, welcomed;
 };
 
-vector<ClientInfo> clients;
+// the window keeps element addresses stable, so the session index can
+// point into it while new clients are appended and served ones reclaimed;
+// clients_mtx only guards the container itself (appends, reclaiming and
+// indexed access by the scheduler)
+ClientWindow<ClientInfo> clients;
 mutex clients_mtx;
+SessionIndex<ClientInfo> sessions;
+AdmissionControl admission;
+TraceWriter tracer; // --trace=FILE, records every datagram that arrives and how sessions end
+void end_session();
 
 constexpr int timeout = 100000;
-std::mutex print_mutex;
+int idle_timeout = 30000; // ms a keep-alive session may stay silent
 string ack_msg = "ACK FROM SERVER!!";
-template <typename... Args>
-void ts_print(Args &&...args)
-{
-    std::lock_guard<std::mutex> lock(print_mutex);
-    (std::cout << ... << args);
-}
 
 // get socket address IPv4 / IPv6
 void *get_in_addr(sockaddr *sa)
@@ -53,16 +77,14 @@ void *get_in_addr(sockaddr *sa)
     return &(((sockaddr_in6 *)sa)->sin6_addr);
 }
 
-uint16_t UDP_PORT = 9080;
+std::atomic<uint16_t> UDP_PORT = 9080;
 
-int udp_for_client(std::string ip, uint16_t udp_port)
+// UDP socket bound to a session's dedicated port, -1 on failure
+int bind_udp(uint16_t udp_port)
 {
     int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (udp_sock < 0)
-    {
-        ts_print("[UDP] Socket creation failed for client ", ip, "\n");
         return -1;
-    }
 
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
@@ -71,106 +93,510 @@ int udp_for_client(std::string ip, uint16_t udp_port)
 
     if (bind(udp_sock, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
-        ts_print("[UDP] bind failed on port ", udp_port, "\n");
         close(udp_sock);
         return -1;
     }
+    return udp_sock;
+}
+
+uint32_t trace_us(std::chrono::steady_clock::duration d)
+{
+    return (uint32_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+
+// Appends a client's datagram to the arrival trace, if one is recorded.
+void trace_datagram(const ClientInfo &cli)
+{
+    if (!tracer.enabled())
+        return;
+    tracer.record(TraceRecord{tracer.since_start_ns(cli.accepted), trace_us(cli.welcomed - cli.accepted),
+                              trace_us(cli.msg.arrive_time - cli.welcomed), (uint32_t)cli.msg.length,
+                              (int32_t)cli.msg.type, cli.key.port,
+                              cli.keep_alive ? TRACE_KEEPALIVE : 0u});
+}
+
+// Appends the end of a session: every keep-alive session, and one-shot
+// sessions that never sent their datagram, which would leave no trace else.
+void trace_session_end(std::chrono::steady_clock::time_point accepted,
+                       std::chrono::steady_clock::time_point welcomed, uint16_t port, bool keep_alive)
+{
+    if (!tracer.enabled())
+        return;
+    tracer.record(TraceRecord{tracer.since_start_ns(accepted), trace_us(welcomed - accepted),
+                              trace_us(std::chrono::steady_clock::now() - welcomed), 0, 0, port,
+                              TRACE_SESSION | (keep_alive ? TRACE_KEEPALIVE : 0u)});
+}
+
+// the session ends without an ACK: invalidate it and free its slot
+void abandon_session(const SessionKey &key, int udp_sock)
+{
+    sessions.with(key, [](ClientInfo &i)
+                  {
+        if (i.state == ClientInfo::State::NOT_ARRIVED)
+            trace_session_end(i.accepted, i.welcomed, i.key.port, false);
+        i.state = ClientInfo::State::INVALID; });
+    sessions.erase(key);
+    if (udp_sock >= 0)
+        close(udp_sock);
+    end_session();
+}
+
+// Hands a session's datagram to the scheduler. Returns 0 once the session
+// is ARRIVED (udp_sock now belongs to the dispatch stage), -1 if the
+// datagram was invalid or the session unknown (the session is closed).
+int deliver_datagram(const SessionKey &key, const message &msg,
+                     const sockaddr_in &client_addr, socklen_t addrlen, int udp_sock)
+{
+    bool invalid = false;
+    bool found = sessions.with(key, [&](ClientInfo &i)
+                               {
+        if (i.state != ClientInfo::State::NOT_ARRIVED)
+            return;
+        i.msg = msg;
+        i.port = ntohs(client_addr.sin_port);
+        i.addr = client_addr;
+        i.addrlen = addrlen;
+        i.socket = udp_sock; // set FD before ARRIVED
+        trace_datagram(i);
+        if (msg.type != msg_type::TYPE_3)
+        {
+            invalid = true;
+            i.state = ClientInfo::State::INVALID;
+            ts_print("Invalidated : ", i.ip, ":", i.port, "\n");
+        }
+        else
+            i.state = ClientInfo::State::ARRIVED; });
+    if (!found)
+    {
+        ts_print("No client for session ", key.session, "\n");
+        close(udp_sock);
+        end_session();
+        return -1;
+    }
+    if (invalid)
+    {
+        sessions.erase(key);
+        close(udp_sock);
+        end_session();
+        return -1;
+    }
+    return 0; // do NOT close udp_sock here, FCFS will
+}
+
+// ---- Fragmented requests ----
+// A client may split a frame into fragments (client --mtu) rather than
+// leave it to IP fragmentation; each session reassembles them into buffers
+// from one shared pool. A lab1 frame never exceeds 8 + MSG_LEN bytes.
+#define DGRAM_BUF 65536
+BufferPool frag_pool(64u << 20);
+const ReassemblyLimits frag_limits{sizeof(int32_t) * 2 + MSG_LEN, 1u << 20, 4, 1000};
+
+// 1 once msg holds a frame, 0 while fragments are missing (or were
+// dropped), -1 for a frame that does not parse
+int datagram_to_message(Reassembler &ra, const sockaddr_in &from, const char *dgram, size_t n, message &msg)
+{
+    PooledBuffer whole;
+    switch (ra.feed(from, dgram, n, whole))
+    {
+    case Reassembler::Result::NOT_FRAGMENT:
+        return msg.parseFromBuf(dgram, n) < 0 ? -1 : 1;
+    case Reassembler::Result::COMPLETE:
+        return msg.parseFromBuf(whole.data(), whole.size()) < 0 ? -1 : 1;
+    default:
+        return 0;
+    }
+}
+
+int udp_for_client(std::string ip, SessionKey key)
+{
+    uint16_t udp_port = key.port;
+    int udp_sock = bind_udp(udp_port);
+    if (udp_sock < 0)
+    {
+        ts_print("[UDP] bind failed on port ", udp_port, "\n");
+        abandon_session(key, -1);
+        return -1;
+    }
+
+    // a client that never sends must not hold its admission slot forever
+    timeval tv{timeout / 1000, 0};
+    setsockopt(udp_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     ts_print("[UDP] Dedicated UDP server for ", ip, " on port ", udp_port, "\n");
 
-    char buf[1024];
+    char buf[DGRAM_BUF];
+    Reassembler ra(frag_pool, frag_limits);
     while (true)
     {
         sockaddr_in client_addr{};
         socklen_t addrlen = sizeof(client_addr);
-        ssize_t n = recvfrom(udp_sock, buf, sizeof(buf) - 1, 0,
+        ssize_t n = recvfrom(udp_sock, buf, sizeof(buf), 0,
                              (sockaddr *)&client_addr, &addrlen);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            ts_print("[UDP] ", ip, " on port ", udp_port, " timed out\n");
+            abandon_session(key, udp_sock);
+            return -1;
+        }
         if (n < 0)
         {
             ts_print("[UDP] recvfrom error for ", ip, "\n");
             continue;
         }
 
+        if (client_addr.sin_addr.s_addr != key.ip)
+        {
+            ts_print("[UDP] Ignoring datagram from foreign host on port ", udp_port, "\n");
+            continue;
+        }
+
         message msg{};
-        msg.parseFromBuf(buf, n);
+        int rv = datagram_to_message(ra, client_addr, buf, n, msg);
+        if (rv == 0)
+            continue;
+        if (rv < 0)
+            msg.type = msg_type{}; // unparsable, gets invalidated
+        return deliver_datagram(key, msg, client_addr, addrlen, udp_sock);
+    }
+}
+
+// The ACK never changes, so its TYPE_4 frame is encoded once up front
+// instead of building a 15 KB message for every client served.
+const std::string ack_frame = encode_message(msg_type::TYPE_4, ack_msg);
 
+struct AckJob
+{
+    uint64_t seq;  // position in the policy's decision order
+    size_t client; // index into clients
+    int socket;
+    std::string frame; // tagged ACK of a keep-alive request, empty: ack_frame
+    sockaddr_in addr;
+    socklen_t addrlen;
+    std::shared_ptr<SessionSocket> keep_alive;
+};
+
+#define ACK_BATCH 64
+
+// Sends the pre-encoded ACK (or the job's tagged one) for every job and closes each socket once
+// (keep-alive sockets are left to their session). Jobs that share a socket
+// go out in a single sendmmsg, the rest fall back to sendto. Returns the
+// number of send syscalls issued.
+int udp_send_batch_and_close(const AckJob *jobs, size_t n)
+{
+    iovec iov[ACK_BATCH];
+    mmsghdr msgs[ACK_BATCH];
+    bool done[ACK_BATCH] = {};
+    int calls = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (done[i])
+            continue;
+        int udp_sock = jobs[i].socket;
+        unsigned cnt = 0;
+        for (size_t j = i; j < n; j++)
         {
-            std::lock_guard<std::mutex> lock(clients_mtx);
-            for (auto &i : clients)
+            if (done[j] || jobs[j].socket != udp_sock)
+                continue;
+            done[j] = true;
+            const std::string &frame = jobs[j].frame.empty() ? ack_frame : jobs[j].frame;
+            iov[cnt] = iovec{const_cast<char *>(frame.data()), frame.size()};
+            msgs[cnt] = mmsghdr{};
+            msgs[cnt].msg_hdr.msg_name = const_cast<sockaddr_in *>(&jobs[j].addr);
+            msgs[cnt].msg_hdr.msg_namelen = jobs[j].addrlen;
+            msgs[cnt].msg_hdr.msg_iov = &iov[cnt];
+            msgs[cnt].msg_hdr.msg_iovlen = 1;
+            cnt++;
+        }
+
+        if (cnt == 1)
+        {
+            calls++;
+            if (sendto(udp_sock, iov[0].iov_base, iov[0].iov_len, 0,
+                       (const sockaddr *)&jobs[i].addr, jobs[i].addrlen) < 0)
+                perror("sendto failed");
+        }
+        else
+        {
+            for (unsigned off = 0; off < cnt;)
             {
-                if (i.ip == ip && i.state == ClientInfo::State::NOT_ARRIVED)
+                calls++;
+                int sent = sendmmsg(udp_sock, msgs + off, cnt - off, 0);
+                if (sent <= 0)
                 {
-                    i.msg = msg;
-                    i.port = ntohs(client_addr.sin_port);
-                    i.addr = client_addr;
-                    i.addrlen = addrlen;
-                    i.socket = udp_sock; // set FD before ARRIVED
-                    if (msg.type != msg_type::TYPE_3)
-                    {
-                        i.state = ClientInfo::State::INVALID;
-                        ts_print("Invalidated : ", i.ip, ":", i.port, "\n");
-                    }
-                    else
-                        i.state = ClientInfo::State::ARRIVED;
-                    return 0; // do NOT close udp_sock here, FCFS will
+                    perror("sendmmsg failed");
+                    break;
                 }
+                off += sent;
             }
         }
-        ts_print("No client for ip ", ip);
-        return -1;
+        if (!jobs[i].keep_alive)
+            close(udp_sock);
     }
+    return calls;
 }
+// ---- ACK dispatch stage ----
+// The scheduling policy only decides *who* is served next; the actual
+// sending runs on a pool of workers so ACKs to different clients go out in
+// parallel. Jobs are dequeued strictly in decision order, every decision is
+// logged and can be checked against the policy afterwards.
 
-int udp_send_and_close(int udp_sock, const std::string &ack_msg,
-                       const sockaddr_in &client_addr, socklen_t addrlen)
+struct DispatchRecord
 {
-    message ack{};
-    ack.set(msg_type::TYPE_4, ack_msg.c_str()); // <-- pass c_str + size
-    char buf[sizeof(int32_t) * 2 + MSG_LEN];
-    int n = ack.printToBuf(buf, sizeof(buf));
-    if (n < 0)
-        return -1;
+    size_t client;
+    int worker = -1; // -1 until a worker picked it up
+    std::chrono::steady_clock::time_point decided;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point sent;
+};
 
-    ssize_t sent = sendto(udp_sock, buf, n, 0,
-                          (const sockaddr *)&client_addr, addrlen);
-    if (sent < 0)
+class DispatchPool
+{
+public:
+    void start(size_t n_workers)
     {
-        perror("sendto failed");
-        return -1;
+        sends = std::make_unique<std::atomic<uint64_t>[]>(n_workers);
+        n = n_workers;
+        for (size_t w = 0; w < n_workers; w++)
+        {
+            sends[w] = 0;
+            std::thread(&DispatchPool::worker, this, (int)w).detach();
+        }
+        std::thread(&DispatchPool::reporter, this).detach();
+    }
+
+    // called by the scheduler thread only, with jobs in decision order;
+    // assigns their sequence numbers
+    void submit(std::vector<AckJob> &batch)
+    {
+        if (batch.empty())
+            return;
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &job : batch)
+        {
+            job.seq = log_base + log.size();
+            log.push_back(DispatchRecord{job.client, -1, now, {}, {}});
+            queue.push_back(job);
+        }
+        if (queue.size() > max_depth)
+            max_depth = queue.size();
+        cv.notify_all();
+    }
+
+    // Checks the decisions recorded since the last call against the ordering
+    // the policy promises:
+    //  fcfs - clients are served in registration (index) order,
+    //  both - no client is served twice.
+    // Records are dropped once checked and sent, and clients below `floor`
+    // (reclaimed, so never dispatched again) are forgotten, so a call only
+    // costs the decisions made since the previous one.
+    bool verify_order(bool round_robin, size_t floor, std::string &why)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool ok = true;
+        while (ok && verified < log.size())
+        {
+            uint64_t seq = log_base + verified;
+            const auto &r = log[verified++];
+            if (!seen.insert(r.client).second)
+            {
+                why = "client " + to_string(r.client) + " dispatched twice";
+                ok = false;
+            }
+            else if (!round_robin && r.client < last_client)
+            {
+                why = "decision " + to_string(seq) + " serves client " + to_string(r.client) +
+                      " after client " + to_string(last_client);
+                ok = false;
+            }
+            last_client = r.client;
+        }
+        std::erase_if(seen, [floor](size_t c)
+                      { return c < floor; });
+        // a record is written by its worker until the ACK is sent
+        while (verified > 0 && log.front().sent != std::chrono::steady_clock::time_point{})
+        {
+            log.pop_front();
+            log_base++;
+            verified--;
+        }
+        return ok;
+    }
+
+    bool round_robin = false;
+
+private:
+    void worker(int id)
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]
+                    { return !queue.empty(); });
+            // take a fair share of the backlog so a burst is spread over
+            // all workers but each of them still sends in batches
+            size_t take = std::clamp<size_t>(queue.size() / n, 1, ACK_BATCH);
+            AckJob jobs[ACK_BATCH];
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < take; i++)
+            {
+                jobs[i] = queue.front();
+                queue.pop_front();
+                log[jobs[i].seq - log_base].worker = id;
+                log[jobs[i].seq - log_base].started = now;
+            }
+            lock.unlock();
+
+            int calls = udp_send_batch_and_close(jobs, take);
+
+            now = std::chrono::steady_clock::now();
+            lock.lock();
+            for (size_t i = 0; i < take; i++)
+                log[jobs[i].seq - log_base].sent = now;
+            lock.unlock();
+            sends[id] += take;
+            syscalls += calls;
+            {
+                std::lock_guard<std::mutex> clock(clients_mtx);
+                for (size_t i = 0; i < take; i++)
+                {
+                    auto &cli = clients[jobs[i].client];
+                    cli.state = ClientInfo::State::DONE;
+                    cli.keep_alive.reset();
+                    sessions.erase(cli.key);
+                }
+            }
+            for (size_t i = 0; i < take; i++)
+            {
+                // a keep-alive session gives up its slot when it ends
+                if (!jobs[i].keep_alive)
+                    end_session();
+                jobs[i].keep_alive.reset();
+            }
+        }
     }
 
-    close(udp_sock);
-    return 0;
+    // periodically prints queue depth and per-worker throughput while busy
+    void reporter()
+    {
+        constexpr auto period = std::chrono::seconds(5);
+        std::vector<uint64_t> prev(n, 0);
+        size_t prev_decisions = 0;
+        uint64_t prev_acks = 0, prev_calls = 0;
+        for (;;)
+        {
+            std::this_thread::sleep_for(period);
+            size_t depth, peak, decisions;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                depth = queue.size();
+                peak = max_depth;
+                decisions = log_base + log.size();
+                max_depth = depth;
+            }
+            if (decisions == prev_decisions)
+                continue; // idle, stay quiet
+            prev_decisions = decisions;
+
+            std::string line = "[DISPATCH] queue depth=" + to_string(depth) +
+                               " peak=" + to_string(peak) +
+                               " decisions=" + to_string(decisions) + " | acks/s per worker:";
+            double secs = std::chrono::duration<double>(period).count();
+            for (size_t w = 0; w < n; w++)
+            {
+                uint64_t cur = sends[w];
+                line += " w" + to_string(w) + "=" + to_string((cur - prev[w]) / secs);
+                prev[w] = cur;
+            }
+            uint64_t acks = 0;
+            for (size_t w = 0; w < n; w++)
+                acks += prev[w];
+            uint64_t calls = syscalls;
+            if (calls > prev_calls)
+                line += " | acks/syscall=" + to_string((double)(acks - prev_acks) / (calls - prev_calls));
+            prev_acks = acks;
+            prev_calls = calls;
+            size_t floor;
+            {
+                std::lock_guard<std::mutex> clock(clients_mtx);
+                floor = clients.first();
+            }
+            std::string why;
+            line += verify_order(round_robin, floor, why) ? " | order ok" : " | ORDER VIOLATION: " + why;
+            ts_print(line, "\n");
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<AckJob> queue;
+    // decisions from seq log_base on; the first `verified` of them checked
+    std::deque<DispatchRecord> log;
+    uint64_t log_base = 0;
+    size_t verified = 0;
+    size_t last_client = 0;          // of the last checked decision
+    std::unordered_set<size_t> seen; // clients dispatched, from the window's first on
+    size_t max_depth = 0;
+    size_t n = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> sends;
+    std::atomic<uint64_t> syscalls{0};
+};
+
+DispatchPool dispatcher;
+
+// Marks a client as handed to the dispatch stage and queues its ACK.
+// Caller holds clients_mtx.
+void take_client(size_t idx, std::vector<AckJob> &batch, std::string &trace)
+{
+    auto &cli = clients[idx];
+    cli.state = ClientInfo::State::DISPATCHED;
+    char ip[INET6_ADDRSTRLEN];
+    inet_ntop(cli.addr.sin_family, &(cli.addr.sin_addr), ip, INET_ADDRSTRLEN);
+    trace += "Servicing: " + std::string(ip) + ":" + to_string(cli.port) + "\n" + cli.msg.print(false) + "\n";
+    batch.push_back(AckJob{0, idx, cli.socket, cli.keep_alive ? tagged_ack(ack_frame, cli.msg) : std::string(),
+                           cli.addr, cli.addrlen, cli.keep_alive});
+}
+
+// Drops the served and invalidated clients at the front of the list.
+// Caller holds clients_mtx.
+void reclaim_clients()
+{
+    clients.reclaim([](const ClientInfo &cli)
+                    { return cli.state == ClientInfo::State::DONE || cli.state == ClientInfo::State::INVALID; });
 }
+
 void fcfs()
 {
     size_t cur = 0;
-    char ip[INET6_ADDRSTRLEN];
     int wait_cnt = 0;
     int slptime = 10;
+    std::vector<AckJob> batch;
+    std::string trace;
+    auto take = [&](size_t idx)
+    { take_client(idx, batch, trace); };
     for (;;)
     {
         std::unique_lock<std::mutex> lock(clients_mtx);
-        if (cur == clients.size())
+        reclaim_clients();
+        switch (fcfs_pass(clients, cur, take))
         {
+        case FcfsStep::IDLE:
             lock.unlock();
             std::this_thread::sleep_for(std::chrono::milliseconds(10)); // tiny backoff
-        }
-        else if (cur < clients.size() && clients[cur].state == ClientInfo::State::ARRIVED)
-        {
-            auto cli = clients[cur]; // copy the info you need
-            lock.unlock();           // release lock while sending
-            inet_ntop(clients[cur].addr.sin_family, &(clients[cur].addr.sin_addr), ip, INET_ADDRSTRLEN);
-            ts_print("Servicing: ", ip, ":", clients[cur].port, "\n", clients[cur].msg.print(false), "\n");
-            udp_send_and_close(cli.socket, ack_msg, cli.addr, cli.addrlen);
-
-            lock.lock();
-            clients[cur].state = ClientInfo::State::DONE;
-            ++cur;
+            break;
+        case FcfsStep::SKIPPED:
             wait_cnt = 0;
-        }
-        else
-        {
+            break;
+        case FcfsStep::TOOK:
+            lock.unlock();
+            ts_print(trace);
+            dispatcher.submit(batch);
+            batch.clear();
+            trace.clear();
+            wait_cnt = 0;
+            break;
+        case FcfsStep::WAITING:
             wait_cnt += slptime;
             if (wait_cnt >= timeout)
             {
@@ -179,6 +605,7 @@ void fcfs()
             }
             lock.unlock();
             std::this_thread::sleep_for(std::chrono::milliseconds(slptime)); // tiny backoff
+            break;
         }
     }
 }
@@ -186,10 +613,15 @@ void fcfs()
 void rr()
 {
     size_t cur = 0;
-    char ip[INET6_ADDRSTRLEN];
-    for (;; cur = (cur + 1) % clients.size())
+    std::vector<AckJob> batch;
+    std::string trace;
+    std::unordered_set<uint16_t> served; // sessions (by UDP port) served this turn
+    auto take = [&](size_t idx)
+    { take_client(idx, batch, trace); };
+    for (;;)
     {
         std::unique_lock<std::mutex> lock(clients_mtx);
+        reclaim_clients();
 
         if (clients.empty())
         {
@@ -198,38 +630,303 @@ void rr()
             continue;
         }
 
-        if (clients[cur].state == ClientInfo::State::ARRIVED)
+        rr_turn(clients, cur, served, take);
+        lock.unlock();
+
+        if (batch.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        ts_print(trace);
+        dispatcher.submit(batch);
+        batch.clear();
+        trace.clear();
+    }
+}
+
+// Adds a handshaken client to the clients list and the session index.
+SessionKey register_session(const PendingConn &conn, uint16_t port)
+{
+    lock_guard<mutex> lock(clients_mtx);
+    // ts_print("pushing\n");
+    ClientInfo &cli = clients.emplace_back();
+    cli.ip = conn.ip;
+    cli.accepted = conn.accepted;
+    cli.welcomed = std::chrono::steady_clock::now();
+    cli.key = SessionKey{conn.peer, port, (uint32_t)(clients.size() - 1)};
+    sessions.insert(cli.key, &cli);
+    return cli.key;
+}
+
+// ---- Keep-alive sessions ----
+// One handshake, then any number of TYPE_3 requests on the session's UDP
+// port until the client sends TYPE_6 or stays idle for idle_timeout. Each
+// request becomes a client entry of its own when it arrives, so the active
+// policy schedules requests rather than sessions; the entry is reclaimed
+// with the other served clients once its ACK is out.
+
+struct KeepAliveSession
+{
+    std::string ip;
+    SessionKey key; // key.session unused, every request gets its own
+    std::shared_ptr<SessionSocket> sock;
+    std::chrono::steady_clock::time_point accepted, welcomed;
+
+    KeepAliveSession(const PendingConn &conn, uint16_t port, int udp_sock)
+        : ip(conn.ip), key{conn.peer, port, 0}, sock(std::make_shared<SessionSocket>(udp_sock)),
+          accepted(conn.accepted), welcomed(std::chrono::steady_clock::now()) {}
+};
+
+// Queues one request of a keep-alive session, already ARRIVED.
+void keepalive_request(const KeepAliveSession &ka, const message &msg,
+                       const sockaddr_in &client_addr, socklen_t addrlen)
+{
+    lock_guard<mutex> lock(clients_mtx);
+    ClientInfo &cli = clients.emplace_back();
+    cli.ip = ka.ip;
+    cli.msg = msg;
+    cli.port = ntohs(client_addr.sin_port);
+    cli.addr = client_addr;
+    cli.addrlen = addrlen;
+    cli.socket = ka.sock->fd;
+    cli.keep_alive = ka.sock;
+    cli.accepted = ka.accepted;
+    cli.welcomed = ka.welcomed;
+    // not in the session index: nothing looks a request up by its key
+    cli.key = SessionKey{ka.key.ip, ka.key.port, (uint32_t)(clients.size() - 1)};
+    trace_datagram(cli);
+    cli.state = ClientInfo::State::ARRIVED;
+}
+
+// Handles one datagram of a keep-alive session; false once the client
+// closed the session.
+bool keepalive_datagram(const KeepAliveSession &ka, const message &msg,
+                        const sockaddr_in &client_addr, socklen_t addrlen)
+{
+    if (msg.type == msg_type::TYPE_6)
+        return false;
+    if (msg.type != msg_type::TYPE_3)
+    {
+        ts_print("[UDP] Ignoring type ", (int)msg.type, " from ", ka.ip, " on port ", ka.key.port, "\n");
+        return true;
+    }
+    keepalive_request(ka, msg, client_addr, addrlen);
+    return true;
+}
+
+void keepalive_for_client(PendingConn conn, uint16_t udp_port)
+{
+    int udp_sock = bind_udp(udp_port);
+    if (udp_sock < 0)
+    {
+        ts_print("[UDP] bind failed on port ", udp_port, "\n");
+        end_session();
+        return;
+    }
+    timeval tv{idle_timeout / 1000, (idle_timeout % 1000) * 1000};
+    setsockopt(udp_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    KeepAliveSession ka(conn, udp_port, udp_sock);
+    const std::string &ip = ka.ip;
+
+    ts_print("[UDP] Keep-alive session for ", ip, " on port ", udp_port, "\n");
+
+    char buf[DGRAM_BUF];
+    Reassembler ra(frag_pool, frag_limits);
+    size_t requests = 0;
+    const char *why = "closed";
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t addrlen = sizeof(client_addr);
+        ssize_t n = recvfrom(udp_sock, buf, sizeof(buf), 0,
+                             (sockaddr *)&client_addr, &addrlen);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            why = "idle";
+            break;
+        }
+        if (n < 0)
         {
-            auto cli = clients[cur]; // copy client info
-            lock.unlock();           // release lock before sending
-            inet_ntop(clients[cur].addr.sin_family, &(clients[cur].addr.sin_addr), ip, INET_ADDRSTRLEN);
-            ts_print("Servicing: ", ip, "\n", clients[cur].msg.print(false), "\n");
-            // simulate one "time quantum" (send once per turn)
-            udp_send_and_close(cli.socket, ack_msg, cli.addr, cli.addrlen);
+            ts_print("[UDP] recvfrom error for ", ip, "\n");
+            continue;
+        }
+        if (client_addr.sin_addr.s_addr != ka.key.ip)
+        {
+            ts_print("[UDP] Ignoring datagram from foreign host on port ", udp_port, "\n");
+            continue;
+        }
 
-            lock.lock();
-            clients[cur].state = ClientInfo::State::DONE;
+        message msg{};
+        if (datagram_to_message(ra, client_addr, buf, n, msg) <= 0)
+            continue;
+        if (!keepalive_datagram(ka, msg, client_addr, addrlen))
+            break;
+        requests++;
+    }
+    // the socket itself closes once the last pending ACK is out
+    ts_print("[UDP] ", ip, " on port ", udp_port, " ", why, " after ", requests, " requests\n");
+    trace_session_end(ka.accepted, ka.welcomed, udp_port, true);
+    end_session();
+}
+
+// ---- Coroutine mode ----
+// Same sessions, scheduler and dispatch stage, but instead of a handshake
+// thread per connection and a UDP thread per session every session is one
+// straight-line coroutine, all multiplexed on a single executor thread.
+Executor *async_exec = nullptr;
+// datagrams are consumed before the next suspension, so the sessions of
+// the executor thread can share one receive buffer
+thread_local char async_dgram[DGRAM_BUF];
+
+Task<void> async_keepalive(PendingConn conn, uint16_t port, int udp_sock)
+{
+    Executor &ex = *async_exec;
+    const IoOptions opt{std::chrono::milliseconds(idle_timeout)};
+    KeepAliveSession ka(conn, port, udp_sock);
+    ts_print("[UDP] Keep-alive session for ", conn.ip, " on port ", port, "\n");
+
+    Reassembler ra(frag_pool, frag_limits);
+    size_t requests = 0;
+    const char *why = "closed";
+    for (;;)
+    {
+        message msg{};
+        sockaddr_in client_addr{};
+        socklen_t addrlen;
+        int n = co_await async_recvfrom(ex, udp_sock, async_dgram, sizeof(async_dgram), client_addr, addrlen, opt);
+        if (n == IO_TIMEOUT || n == IO_CANCELLED)
+        {
+            why = "idle";
+            break;
         }
-        else
+        if (n < 0)
+            continue;
+        if (client_addr.sin_addr.s_addr != ka.key.ip)
         {
-            lock.unlock();
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ts_print("[UDP] Ignoring datagram from foreign host on port ", port, "\n");
+            continue;
         }
+        if (datagram_to_message(ra, client_addr, async_dgram, n, msg) <= 0)
+            continue; // incomplete or unparsable
+        if (!keepalive_datagram(ka, msg, client_addr, addrlen))
+            break;
+        requests++;
     }
+    ts_print("[UDP] ", conn.ip, " on port ", port, " ", why, " after ", requests, " requests\n");
+    trace_session_end(ka.accepted, ka.welcomed, port, true);
+    end_session();
 }
 
-void tcp_server(const char *PORT)
+Task<void> async_session(PendingConn conn)
+{
+    Executor &ex = *async_exec;
+    const IoOptions opt{std::chrono::milliseconds(timeout)};
+    // reserve the port before advertising it, so concurrent
+    // handshakes never hand out the same one
+    uint16_t port = UDP_PORT++;
+    int udp_sock = bind_udp(port);
+    set_nonblocking(conn.fd);
+    int rv = -1;
+    if (udp_sock >= 0)
+        rv = co_await async_server_handshake(ex, conn.fd, to_string(port).c_str(), opt);
+    close(conn.fd);
+    if (rv < 0)
+    {
+        ts_print("[TCP] Handshake unsuccessful!\n");
+        if (udp_sock >= 0)
+            close(udp_sock);
+        end_session();
+        co_return;
+    }
+    set_nonblocking(udp_sock);
+    if (rv == 1)
+    {
+        co_await async_keepalive(conn, port, udp_sock);
+        co_return;
+    }
+    SessionKey key = register_session(conn, port);
+    ts_print("[UDP] Dedicated UDP server for ", conn.ip, " on port ", port, "\n");
+
+    Reassembler ra(frag_pool, frag_limits);
+    for (;;)
+    {
+        message msg{};
+        sockaddr_in client_addr{};
+        socklen_t addrlen;
+        rv = co_await async_recvfrom(ex, udp_sock, async_dgram, sizeof(async_dgram), client_addr, addrlen, opt);
+        if (rv < 0)
+        {
+            ts_print("[UDP] ", conn.ip, " on port ", port, " timed out\n");
+            abandon_session(key, udp_sock);
+            co_return;
+        }
+        if (client_addr.sin_addr.s_addr != key.ip)
+        {
+            ts_print("[UDP] Ignoring datagram from foreign host on port ", port, "\n");
+            continue;
+        }
+        rv = datagram_to_message(ra, client_addr, async_dgram, rv, msg);
+        if (rv == 0)
+            continue;
+        if (rv < 0)
+            msg.type = msg_type{}; // unparsable, gets invalidated
+        deliver_datagram(key, msg, client_addr, addrlen, udp_sock);
+        co_return;
+    }
+}
+
+// handshake and register an admitted connection on its own thread
+void start_session(PendingConn conn)
+{
+    if (async_exec)
+    {
+        async_exec->post([conn]()
+                         { async_exec->spawn(async_session(conn)); });
+        return;
+    }
+    std::thread([conn]()
+                {
+                    // reserve the port before advertising it, so concurrent
+                    // handshakes never hand out the same one
+                    uint16_t port = UDP_PORT++;
+                    int rv = server_handshake(conn.fd, to_string(port).c_str());
+                    if (rv < 0) {
+                        ts_print("[TCP] Handshake unsuccessful!\n");
+                        close(conn.fd);
+                        end_session();
+                        return;
+                    }
+                    if (rv == 1) {
+                        close(conn.fd);
+                        keepalive_for_client(conn, port);
+                        return;
+                    }
+                    SessionKey key = register_session(conn, port);
+                    thread client_thread([ip = conn.ip, key]() {
+                        udp_for_client(ip, key);
+                    });
+                    client_thread.detach();
+                    close(conn.fd); })
+        .detach();
+}
+
+// a session is over (ACKed, invalid or failed): hand its slot on
+void end_session()
 {
-    int sockfd, new_fd;
+    if (auto next = admission.release())
+        start_session(*next);
+}
+
+int tcp_listen(const char *PORT)
+{
+    int sockfd;
     addrinfo hints{}, *servinfo{}, *ptr{};
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
     int yes{1};
     int rv{};
-    sockaddr_storage their_addr;
-    socklen_t sin_size;
-    char s[INET6_ADDRSTRLEN];
 
     if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0)
     {
@@ -261,66 +958,210 @@ void tcp_server(const char *PORT)
         ts_print("[TCP] failed to bind!\n");
         exit(1);
     }
-    if (listen(sockfd, BACKLOGS) == -1)
+    if (listen(sockfd, admission.config().backlog) == -1)
     {
         ts_print("[TCP] listen failed!\n");
         exit(1);
     }
     ts_print("[TCP] Listening on ", PORT, "\n");
+    return sockfd;
+}
+
+// run a freshly accepted connection through admission control
+void admit(int new_fd, sockaddr_storage &their_addr)
+{
+    char s[INET6_ADDRSTRLEN];
+    inet_ntop(their_addr.ss_family,
+              get_in_addr((struct sockaddr *)&their_addr),
+              s, sizeof(s));
+    ts_print("[TCP] Got connection from ", s, "\n");
+
+    PendingConn conn{new_fd, ((sockaddr_in *)&their_addr)->sin_addr.s_addr, std::string(s),
+                     std::chrono::steady_clock::now()};
+    switch (admission.on_connect(conn))
+    {
+    case AdmissionControl::Verdict::ADMIT:
+        start_session(conn);
+        break;
+    case AdmissionControl::Verdict::QUEUED:
+        ts_print("[TCP] ", s, " queued for a free session slot\n");
+        break;
+    case AdmissionControl::Verdict::REJECT:
+        ts_print("[TCP] ", s, " rejected, server busy\n");
+        reply_busy(new_fd);
+        break;
+    }
+}
+
+void tcp_server(const char *PORT)
+{
+    int sockfd = tcp_listen(PORT);
+    sockaddr_storage their_addr;
+    socklen_t sin_size;
 
     while (1)
     {
         sin_size = sizeof(their_addr);
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+        int new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
         if (new_fd == -1)
         {
             ts_print("[TCP] accept error\n");
             continue;
         }
+        admit(new_fd, their_addr);
+    }
+}
 
-        inet_ntop(their_addr.ss_family,
-                  get_in_addr((struct sockaddr *)&their_addr),
-                  s, sizeof(s));
-        ts_print("[TCP] Got connection from ", s, "\n");
-
-        std::thread([new_fd, s]()
-                    {
-                    if (server_handshake(new_fd, to_string(UDP_PORT).c_str()) < 0) {
-                        ts_print("[TCP] Handshake unsuccessful!\n");
-                        close(new_fd);
-                        return;
-                    }
-                    {
-                        lock_guard<mutex> lock(clients_mtx);
-                        // ts_print("pushing\n");
-                        clients.push_back(ClientInfo{0,std::string(s), 0, message{}, ClientInfo::State::NOT_ARRIVED});
-
-                        thread client_thread([s, port=UDP_PORT++]() {
-                            udp_for_client(std::string(s), port);
-                        });
-                        client_thread.detach();
-                    }
-                    close(new_fd); })
-            .detach();
+Task<void> async_accept_loop(int sockfd)
+{
+    set_nonblocking(sockfd);
+    for (;;)
+    {
+        co_await async_exec->wait_io(sockfd, EPOLLIN);
+        for (;;)
+        {
+            sockaddr_storage their_addr;
+            socklen_t sin_size = sizeof(their_addr);
+            int new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC);
+            if (new_fd == -1)
+                break; // backlog drained
+            admit(new_fd, their_addr);
+        }
     }
 }
 
+void async_tcp_server(const char *PORT)
+{
+    int sockfd = tcp_listen(PORT);
+    async_exec->spawn(async_accept_loop(sockfd));
+    async_exec->run(true);
+}
+
 int main(int argc, char **argv)
 {
+    // --key=value options configure admission control, the rest is positional
+    AdmissionConfig adm;
+    bool use_async = false;
+    string trace_path;
+    PerCoreConfig pc;
+    vector<char *> args;
+    for (int i = 0; i < argc; i++)
+    {
+        string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == string::npos)
+        {
+            args.push_back(argv[i]);
+            continue;
+        }
+        string key = arg.substr(2, eq - 2), val = arg.substr(eq + 1);
+        if (key == "max-sessions")
+            adm.max_sessions = stoul(val);
+        else if (key == "max-pending")
+            adm.max_pending = stoul(val);
+        else if (key == "max-wait")
+            adm.max_wait_ms = std::max(0, stoi(val));
+        else if (key == "ip-rate")
+            adm.ip_rate = stod(val);
+        else if (key == "ip-burst")
+            adm.ip_burst = stod(val);
+        else if (key == "backlog")
+            adm.backlog = stoi(val);
+        else if (key == "trace")
+            trace_path = val;
+        else if (key == "idle-timeout")
+            idle_timeout = std::max(1, stoi(val));
+        else if (key == "spin")
+            pc.spin_us = std::max(0, stoi(val));
+        else if (key == "cpus")
+            pc.cpus = parse_cpu_list(val);
+        else if (key == "mlock")
+            pc.lock_memory = val != "0";
+        else if (key == "io" && (val == "threads" || val == "async"))
+            use_async = val == "async";
+        else
+        {
+            cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
     if (argc < 2)
     {
-        cerr << "USAGE: .\\server [PORT] [[rr]]\n";
+        cerr << "USAGE: .\\server [PORT] [[fcfs|rr]] [[ACK_WORKERS]]\n"
+             << "       .\\server [PORT] percore [[CORES]]\n"
+             << "       [--max-sessions=N] [--max-pending=N] [--max-wait=MS] [--ip-rate=PER_SEC] [--ip-burst=N]\n"
+             << "       [--backlog=N]"
+             << "       [--io=threads|async] [--idle-timeout=MS] [--trace=FILE]\n"
+             << "       percore only: [--spin=BUSY_POLL_US] [--cpus=LIST] [--mlock=1]\n";
         return 1;
     }
-    thread tcp_thread(tcp_server, argv[1]);
+    if (argc >= 3 && string(argv[2]) == "percore")
+    {
+        if (!trace_path.empty())
+            cerr << "--trace is not supported in percore mode, ignored\n";
+        pc.cores = argc >= 4 ? std::max(1, atoi(argv[3]))
+                             : (int)std::max(1u, std::thread::hardware_concurrency());
+        // the session cap is split evenly, each core enforces its share
+        pc.max_sessions = adm.max_sessions ? std::max<size_t>(1, adm.max_sessions / pc.cores) : 0;
+        pc.session_timeout_ms = timeout;
+        pc.idle_timeout_ms = idle_timeout;
+        PerCoreServer(argv[1], pc, ack_msg).run();
+        return 0;
+    }
+    if (pc.spin_us || !pc.cpus.empty() || pc.lock_memory)
+        cerr << "--spin, --cpus and --mlock are only supported in percore mode, ignored\n";
+    admission.configure(adm);
+    if (!trace_path.empty() && !tracer.open(trace_path))
+    {
+        cerr << "cannot write trace " << trace_path << "\n";
+        return 1;
+    }
+    prefill_reassembly(frag_pool, frag_limits, frag_limits.max_message);
+    Executor executor;
+    if (use_async)
+        async_exec = &executor;
+    thread tcp_thread(use_async ? async_tcp_server : tcp_server, argv[1]);
     void (*scheduling_policy)(void) = fcfs;
-    if (argc == 3)
+    if (argc >= 3)
     {
-        if (argv[2] == "rr")
+        if (string(argv[2]) == "rr")
         {
             scheduling_policy = rr;
+            dispatcher.round_robin = true;
         }
     }
+    size_t ack_workers = std::max(1u, std::thread::hardware_concurrency());
+    if (argc >= 4)
+        ack_workers = std::max(1, atoi(argv[3]));
+    dispatcher.start(ack_workers);
+    thread([]()
+           {
+        for (;;)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+            std::string line = admission.report();
+            if (!line.empty())
+                ts_print(line, "\n");
+            tracer.flush(); // a killed server still leaves its trace behind
+        } })
+        .detach();
+    // queued connections that waited too long are shed
+    if (adm.max_pending > 0 && adm.max_wait_ms > 0)
+        thread([]()
+               {
+            for (;;)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                for (const PendingConn &conn : admission.expire_pending(std::chrono::steady_clock::now()))
+                {
+                    ts_print("[TCP] ", conn.ip, " waited too long for a session slot, server busy\n");
+                    reply_busy(conn.fd);
+                }
+            } })
+            .detach();
     // thread udp_thread(udp_server);
     thread fcfs_thread(scheduling_policy);
     // udp_thread.join();
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <netinet/in.h>
+
+// ---- Session index ----
+// Sessions are identified by the client's IPv4 address, the dedicated UDP
+// port the server handed out in the handshake and a server-assigned id, so
+// several clients behind the same IP never get mixed up.
+struct SessionKey
+{
+    in_addr_t ip;     // network byte order, as in sockaddr_in
+    uint16_t port;    // server-side UDP port assigned to the session
+    uint32_t session; // server-assigned session id
+
+    bool operator==(const SessionKey &o) const
+    {
+        return ip == o.ip && port == o.port && session == o.session;
+    }
+};
+
+struct SessionKeyHash
+{
+    size_t operator()(const SessionKey &k) const
+    {
+        uint64_t h = ((uint64_t)k.ip << 32) ^ ((uint64_t)k.port << 16) ^ k.session;
+        // splitmix64 finalizer, spreads the key over all shards
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+};
+
+// Concurrent hash index from SessionKey to T*, split into independently
+// locked shards: a lookup only contends with sessions hashing to the same
+// shard, never with the scheduler or the global clients list.
+template <typename T, size_t SHARDS = 64>
+class SessionIndex
+{
+public:
+    void insert(const SessionKey &key, T *value)
+    {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        s.map[key] = value;
+    }
+
+    void erase(const SessionKey &key)
+    {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        s.map.erase(key);
+    }
+
+    // Runs fn on the session while its shard is locked.
+    // Returns false if the key is unknown.
+    template <typename Fn>
+    bool with(const SessionKey &key, Fn &&fn)
+    {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+        fn(*it->second);
+        return true;
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (auto &s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            n += s.map.size();
+        }
+        return n;
+    }
+
+private:
+    struct alignas(64) Shard // one cache line per lock, no false sharing
+    {
+        std::mutex mtx;
+        std::unordered_map<SessionKey, T *, SessionKeyHash> map;
+    };
+
+    Shard &shard(const SessionKey &key)
+    {
+        return shards[SessionKeyHash{}(key) % SHARDS];
+    }
+
+    Shard shards[SHARDS];
+};
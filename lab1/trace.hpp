@@ -0,0 +1,173 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ---- Arrival traces ----
+// A trace is a fixed header followed by fixed-size records in host byte
+// order, so a reader can mmap the file and use it as a TraceRecord array.
+// There is no record count in the header: a server that is killed mid-run
+// still leaves a valid trace, its length is whatever was flushed.
+// One record per datagram; the datagrams of one keep-alive session share
+// connect_ns and session. A keep-alive session, and a session that never
+// sent its datagram, also get a TRACE_SESSION record when they end: no
+// datagram, udp_gap_us is WELCOME sent -> session over. Version 1 traces
+// have no session records.
+
+#define TRACE_MAGIC "NLTRACE"
+#define TRACE_VERSION 2
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t wall_start_ns; // system clock at the start, informational only
+};
+
+struct TraceRecord
+{
+    uint64_t connect_ns;   // accept() time since the trace started
+    uint32_t handshake_us; // accept -> WELCOME sent
+    uint32_t udp_gap_us;   // WELCOME sent -> datagram arrived (session ended)
+    uint32_t payload;      // message length in bytes
+    int32_t type;          // msg_type as sent by the client
+    uint32_t session;      // server UDP port of the session
+    uint32_t flags;        // TRACE_KEEPALIVE, TRACE_SESSION
+};
+
+#define TRACE_KEEPALIVE 1u
+#define TRACE_SESSION 2u // end of a session, not a datagram
+
+static_assert(sizeof(TraceRecord) == 32, "trace records are part of the file format");
+
+// Appends records from any thread; buffered, flushed every TRACE_FLUSH
+// records and on flush()/destruction.
+#define TRACE_FLUSH 256
+
+class TraceWriter
+{
+public:
+    bool open(const std::string &path)
+    {
+        f = fopen(path.c_str(), "wb");
+        if (!f)
+            return false;
+        TraceHeader h{};
+        memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+        h.version = TRACE_VERSION;
+        h.record_size = sizeof(TraceRecord);
+        h.wall_start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::system_clock::now().time_since_epoch())
+                              .count();
+        start = std::chrono::steady_clock::now();
+        return fwrite(&h, sizeof(h), 1, f) == 1;
+    }
+
+    bool enabled() const { return f != nullptr; }
+
+    uint64_t since_start_ns(std::chrono::steady_clock::time_point t) const
+    {
+        return t < start ? 0 : std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count();
+    }
+
+    void record(const TraceRecord &r)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!f)
+            return;
+        buf.push_back(r);
+        if (buf.size() >= TRACE_FLUSH)
+            flush_locked();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        flush_locked();
+    }
+
+    ~TraceWriter()
+    {
+        flush();
+        if (f)
+            fclose(f);
+    }
+
+private:
+    void flush_locked()
+    {
+        if (!f || buf.empty())
+            return;
+        fwrite(buf.data(), sizeof(TraceRecord), buf.size(), f);
+        fflush(f);
+        buf.clear();
+    }
+
+    FILE *f = nullptr;
+    std::mutex mtx;
+    std::vector<TraceRecord> buf;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Read-only view of a trace file, mapped into memory.
+class TraceFile
+{
+public:
+    bool open(const std::string &path, std::string &why)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            why = "cannot open " + path;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceHeader))
+        {
+            close(fd);
+            why = path + " is not a trace";
+            return false;
+        }
+        len = st.st_size;
+        void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            why = "cannot map " + path;
+            return false;
+        }
+        base = (const char *)p;
+        const TraceHeader *h = header();
+        if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version < 1 || h->version > TRACE_VERSION || h->record_size != sizeof(TraceRecord))
+        {
+            why = path + ": unsupported trace format";
+            return false;
+        }
+        return true;
+    }
+
+    const TraceHeader *header() const { return (const TraceHeader *)base; }
+    const TraceRecord *begin() const { return (const TraceRecord *)(base + sizeof(TraceHeader)); }
+    const TraceRecord *end() const { return begin() + size(); }
+    size_t size() const { return (len - sizeof(TraceHeader)) / sizeof(TraceRecord); }
+
+    ~TraceFile()
+    {
+        if (base)
+            munmap((void *)base, len);
+    }
+
+private:
+    const char *base = nullptr;
+    size_t len = 0;
+};